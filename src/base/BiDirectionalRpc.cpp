@@ -3,11 +3,121 @@
 #include "TimeHandler.hpp"
 
 namespace codefs {
+namespace {
+// Used until we have a round trip sample
+const int64_t INITIAL_RETRANSMIT_TIMEOUT_MICROS = 1000 * 1000;
+const int64_t MIN_RETRANSMIT_TIMEOUT_MICROS = 20 * 1000;
+const int64_t MAX_RETRANSMIT_TIMEOUT_MICROS = 3000 * 1000;
+// Clock granularity term from RFC 6298
+const int64_t RTT_GRANULARITY_MICROS = 1000;
+// Keeps a full frame inside one ethernet MTU
+const int64_t DEFAULT_MAX_FRAME_SIZE = 1400;
+const int64_t DEFAULT_FLUSH_WINDOW_MICROS = 200;
+// Upper bound on the msgpack framing around a record's payload
+const int64_t RECORD_OVERHEAD = 64;
+const int64_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+// Caps how much of a large transfer can be queued ahead of other traffic.
+// Counted in bytes so that transports with small chunks still keep the
+// pipe full.
+const int64_t MAX_CHUNK_BYTES_IN_FLIGHT = 16 * DEFAULT_CHUNK_SIZE;
+// Partially reassembled messages are dropped after this long without a new
+// chunk, which only happens when a stray retransmit arrives after the
+// message was already delivered.
+const int64_t STALE_CHUNKS_MICROS = 60 * 1000 * 1000;
+// How long, and for how many requests, late copies of a request that was
+// already answered are recognized.  Retransmits stop as soon as the reply
+// arrives, so only copies that were delayed in the network show up here.
+const int64_t COMPLETED_REQUEST_WINDOW_MICROS = 60 * 1000 * 1000;
+const int64_t MAX_COMPLETED_REQUESTS = 64 * 1024;
+// Replies that the clock offset is averaged over.  We also log our stats
+// this often.
+const int64_t NETWORK_STATS_SAMPLES = 100;
+// Send tuning runs this often, steering the queueing delay, which is the
+// round trip above the smallest one seen lately, toward the target
+const int64_t SEND_TUNING_INTERVAL_MICROS = 100 * 1000;
+const int64_t TARGET_QUEUE_DELAY_MICROS = 10 * 1000;
+// Paths change, so the smallest round trip is forgotten after this long
+const int64_t MIN_RTT_WINDOW_MICROS = 30 * 1000 * 1000;
+// Above these send rates zlib's higher levels can't keep up, so a busy fast
+// link would end up waiting on the cpu instead of the network
+const int64_t FAST_SEND_BYTES_PER_SECOND = 32 * 1024 * 1024;
+const int64_t MEDIUM_SEND_BYTES_PER_SECOND = 8 * 1024 * 1024;
+const int MEDIUM_SEND_MAX_LEVEL = 6;
+// Both sides start out assuming the peer uses the default window
+const int64_t DEFAULT_RECEIVE_WINDOW = 256;
+const int64_t DEFAULT_MAX_QUEUED_REQUESTS = 4096;
+
+// Fields that index our tables, checked so a corrupt frame can't run off
+// the end of them
+RpcPriority readPriority(FrameReader* reader) {
+  unsigned char priority = reader->readByte();
+  if (priority >= NUM_PRIORITIES) {
+    throw std::runtime_error("Invalid priority");
+  }
+  return RpcPriority(priority);
+}
+
+RpcHeader readChunkKind(FrameReader* reader) {
+  unsigned char kind = reader->readByte();
+  if (kind != REQUEST && kind != REPLY) {
+    throw std::runtime_error("Invalid chunk kind");
+  }
+  return RpcHeader(kind);
+}
+}  // namespace
+
 BiDirectionalRpc::BiDirectionalRpc()
-    : onBarrier(0),
+    : orderedWaitingRequests(0),
+      nextRequestSequence(0),
+      duplicateRequests(0),
+      chunksInFlight(0),
+      chunkSize(DEFAULT_CHUNK_SIZE),
+      requestsStarted(0),
+      peerRequestLimit(DEFAULT_RECEIVE_WINDOW),
+      blockedSequence(0),
+      requestsAccepted(0),
+      receiveWindow(DEFAULT_RECEIVE_WINDOW),
+      lastAdvertisedLimit(DEFAULT_RECEIVE_WINDOW),
+      maxQueuedRequests(DEFAULT_MAX_QUEUED_REQUESTS),
+      pendingRecords(0),
+      pendingFramePriority(PRIORITY_INTERACTIVE),
+      pendingFrameStartTime(0),
+      maxFrameSize(DEFAULT_MAX_FRAME_SIZE),
+      flushWindowMicros(DEFAULT_FLUSH_WINDOW_MICROS),
+      baseFlushWindowMicros(DEFAULT_FLUSH_WINDOW_MICROS),
+      compressionLevel(Z_BEST_COMPRESSION),
+      smoothedRtt(0),
+      rttVariance(0),
+      smoothedServerTime(0),
+      requestRetransmits(0),
+      replyRetransmits(0),
+      chunkRetransmits(0),
+      onBarrier(0),
       onId(0),
       flaky(false),
-      timeOffsetController(1.0, 1000000, -1000000, 0.6, 1.2, 1.0) {}
+      sessionId(sole::uuid4().cd),
+      peerSessionId(0),
+      peerResetPending(false),
+      wireVersion(WIRE_VERSION_1),
+      localFeatures(LOCAL_FEATURES),
+      negotiatedFeatures(0),
+      peerHeardUs(false),
+      helloReplyPending(false),
+      clockOffsetSum(0),
+      networkStatsSamples(0),
+      sendTuningController(1.0, 1.0, 0.0, 0.05, 0.0, 0.02),
+      sendHeadroom(0.5),
+      lastSendTuningTime(TimeHandler::currentTimeMicros()),
+      tuningBytesSent(0),
+      sendThroughput(0),
+      queueDelay(0),
+      queueDelaySum(0),
+      queueDelaySamples(0),
+      minRtt(-1),
+      nextMinRtt(-1),
+      minRttWindowStart(lastSendTuningTime) {
+  applySendTuning();
+}
 
 BiDirectionalRpc::~BiDirectionalRpc() {}
 
@@ -19,195 +129,544 @@ void BiDirectionalRpc::heartbeat() {
   // received data, flush a lot of data out
   VLOG(1) << "BEAT: " << int64_t(this);
   if (!outgoingReplies.empty() || !outgoingRequests.empty()) {
-    resendRandomOutgoingMessage();
+    // The retransmits double as a keepalive
+    resendOverdueMessages();
   } else {
     VLOG(1) << "SENDING HEARTBEAT";
-    string s = "0";
-    s[0] = HEARTBEAT;
-    send(s);
-  }
-}
-
-void BiDirectionalRpc::resendRandomOutgoingMessage() {
-  if (!outgoingReplies.empty() &&
-      (outgoingRequests.empty() || rand() % 2 == 0)) {
-    // Re-send a random reply
-    DRAW_FROM_UNORDERED(it, outgoingReplies);
-    sendReply(it->first, it->second);
-  } else if (!outgoingRequests.empty()) {
-    // Re-send a random request
-    DRAW_FROM_UNORDERED(it, outgoingRequests);
-    sendRequest(it->first, it->second);
+    beginRecord(1, PRIORITY_INTERACTIVE);
+    pendingFrame.writeByte(HEARTBEAT);
+    endRecord();
+  }
+  // Repeat the window in case the last advertisement was lost
+  advertiseWindow(true);
+}
+
+void BiDirectionalRpc::resendOverdueMessages() {
+  lock_guard<recursive_mutex> guard(mutex);
+  int64_t now = TimeHandler::currentTimeMicros();
+
+  // The retransmits share frames with whatever else is pending
+  while (!requestDeadlines.empty() && requestDeadlines.begin()->first <= now) {
+    RpcId id = requestDeadlines.begin()->second;
+    requestDeadlines.erase(requestDeadlines.begin());
+    auto it = outgoingRequests.find(id);
+    if (it == outgoingRequests.end()) {
+      LOGFATAL << "Retransmit deadline for a request that isn't outgoing: "
+               << id.str();
+    }
+    auto& timer = it->second.timer;
+    VLOG(1) << "RETRANSMITTING REQUEST " << id.str() << " (attempt "
+            << timer.attempts + 1 << ")";
+    // Exponential backoff until we hear back
+    timer.attempts++;
+    requestRetransmits++;
+    timer.lastSendTime = now;
+    timer.timeout = min(timer.timeout * 2, MAX_RETRANSMIT_TIMEOUT_MICROS);
+    requestDeadlines.insert(make_pair(timer.deadline(), id));
+    sendRequest(id, it->second);
+  }
+
+  while (!replyDeadlines.empty() && replyDeadlines.begin()->first <= now) {
+    RpcId id = replyDeadlines.begin()->second;
+    replyDeadlines.erase(replyDeadlines.begin());
+    auto it = outgoingReplies.find(id);
+    if (it == outgoingReplies.end()) {
+      LOGFATAL << "Retransmit deadline for a reply that isn't outgoing: "
+               << id.str();
+    }
+    auto& timer = it->second.timer;
+    VLOG(1) << "RETRANSMITTING REPLY " << id.str() << " (attempt "
+            << timer.attempts + 1 << ")";
+    timer.attempts++;
+    replyRetransmits++;
+    timer.lastSendTime = now;
+    timer.timeout = min(timer.timeout * 2, MAX_RETRANSMIT_TIMEOUT_MICROS);
+    replyDeadlines.insert(make_pair(timer.deadline(), id));
+    sendReply(id, it->second);
+  }
+
+  while (!chunkDeadlines.empty() && get<0>(*chunkDeadlines.begin()) <= now) {
+    ChunkDeadline chunkDeadline = *chunkDeadlines.begin();
+    chunkDeadlines.erase(chunkDeadlines.begin());
+    RpcHeader kind = get<1>(chunkDeadline);
+    const RpcId& id = get<2>(chunkDeadline);
+    int index = get<3>(chunkDeadline);
+    OutgoingMessage* message = findOutgoing(kind, id);
+    if (message == NULL || !message->unackedChunks.count(index)) {
+      LOGFATAL << "Retransmit deadline for a chunk that isn't outgoing: "
+               << id.str() << " " << index;
+    }
+    auto& timer = message->unackedChunks[index];
+    VLOG(1) << "RETRANSMITTING CHUNK " << index << " OF " << id.str();
+    timer.attempts++;
+    chunkRetransmits++;
+    timer.lastSendTime = now;
+    timer.timeout = min(timer.timeout * 2, MAX_RETRANSMIT_TIMEOUT_MICROS);
+    chunkDeadlines.insert(ChunkDeadline(timer.deadline(), kind, id, index));
+    sendChunk(kind, id, *message, index);
+  }
+
+  pruneCompletedRequests(now);
+
+  for (auto it = incomingChunks.begin(); it != incomingChunks.end();) {
+    if (now - it->second.lastUpdate > STALE_CHUNKS_MICROS) {
+      VLOG(1) << "DROPPING STALE CHUNKS FOR " << it->first.second.str();
+      it = incomingChunks.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+int64_t BiDirectionalRpc::microsUntilNextResend() {
+  lock_guard<recursive_mutex> guard(mutex);
+  if (requestDeadlines.empty() && replyDeadlines.empty() &&
+      chunkDeadlines.empty()) {
+    return -1;
+  }
+  int64_t nextDeadline = numeric_limits<int64_t>::max();
+  if (!requestDeadlines.empty()) {
+    nextDeadline = min(nextDeadline, requestDeadlines.begin()->first);
+  }
+  if (!replyDeadlines.empty()) {
+    nextDeadline = min(nextDeadline, replyDeadlines.begin()->first);
+  }
+  if (!chunkDeadlines.empty()) {
+    nextDeadline = min(nextDeadline, get<0>(*chunkDeadlines.begin()));
+  }
+  return max(int64_t(0), nextDeadline - TimeHandler::currentTimeMicros());
+}
+
+int64_t BiDirectionalRpc::retransmitTimeout() {
+  if (smoothedRtt == 0 && rttVariance == 0) {
+    return INITIAL_RETRANSMIT_TIMEOUT_MICROS;
+  }
+  int64_t timeout = smoothedRtt + max(RTT_GRANULARITY_MICROS, 4 * rttVariance);
+  return min(MAX_RETRANSMIT_TIMEOUT_MICROS,
+             max(MIN_RETRANSMIT_TIMEOUT_MICROS, timeout));
+}
+
+void BiDirectionalRpc::updateRtt(int64_t rttSample) {
+  rttSample = max(int64_t(0), rttSample);
+  if (smoothedRtt == 0 && rttVariance == 0) {
+    smoothedRtt = rttSample;
+    rttVariance = rttSample / 2;
+  } else {
+    rttVariance = (3 * rttVariance + abs(smoothedRtt - rttSample)) / 4;
+    smoothedRtt = (7 * smoothedRtt + rttSample) / 8;
+  }
+  VLOG(2) << "RTT: " << smoothedRtt << " +/- " << rttVariance
+          << " RTO: " << retransmitTimeout();
+
+  if (minRtt < 0 || rttSample < minRtt) {
+    minRtt = rttSample;
+  }
+  if (nextMinRtt < 0 || rttSample < nextMinRtt) {
+    nextMinRtt = rttSample;
+  }
+  queueDelaySum += rttSample - minRtt;
+  queueDelaySamples++;
+}
+
+void BiDirectionalRpc::tuneSending(int64_t now) {
+  sendThroughput =
+      tuningBytesSent * 1000 * 1000 / max(int64_t(1), now - lastSendTuningTime);
+  tuningBytesSent = 0;
+  lastSendTuningTime = now;
+  if (now - minRttWindowStart > MIN_RTT_WINDOW_MICROS) {
+    minRtt = nextMinRtt;
+    nextMinRtt = -1;
+    minRttWindowStart = now;
+  }
+  if (queueDelaySamples == 0) {
+    // Nothing was timed, so we know no more than last time
+    applySendTuning();
+    return;
+  }
+  queueDelay = queueDelaySum / queueDelaySamples;
+  queueDelaySum = 0;
+  queueDelaySamples = 0;
+  // In milliseconds, which is the scale the gains are tuned for
+  sendHeadroom = sendTuningController.calculate(
+      TARGET_QUEUE_DELAY_MICROS / 1000.0, queueDelay / 1000.0);
+  applySendTuning();
+  VLOG(2) << "SEND TUNING: delay " << queueDelay << "us throughput "
+          << sendThroughput << "B/s headroom " << sendHeadroom << " window "
+          << flushWindowMicros << "us level " << compressionLevel;
+}
+
+void BiDirectionalRpc::applySendTuning() {
+  // A quarter of the configured window with the link idle, up to four times
+  // it with queues building
+  if (baseFlushWindowMicros <= 0) {
+    flushWindowMicros = 0;
   } else {
+    flushWindowMicros = int64_t(baseFlushWindowMicros *
+                                pow(2.0, 2.0 - 4.0 * sendHeadroom));
+  }
+  compressionLevel =
+      Z_BEST_COMPRESSION - int(lround((Z_BEST_COMPRESSION - Z_BEST_SPEED) *
+                                      sendHeadroom));
+  if (sendThroughput > FAST_SEND_BYTES_PER_SECOND) {
+    compressionLevel = Z_BEST_SPEED;
+  } else if (sendThroughput > MEDIUM_SEND_BYTES_PER_SECOND) {
+    compressionLevel = min(compressionLevel, MEDIUM_SEND_MAX_LEVEL);
   }
 }
 
 void BiDirectionalRpc::receive(const string& message) {
+  receive(message.data(), message.size());
+}
+
+void BiDirectionalRpc::receive(const char* data, int64_t size) {
   lock_guard<recursive_mutex> guard(mutex);
-  VLOG(1) << "Receiving message with length " << message.length();
-  MessageReader reader;
-  reader.load(message);
-  RpcHeader header = (RpcHeader)reader.readPrimitive<unsigned char>();
+  VLOG(1) << "Receiving message with length " << size;
   if (flaky && rand() % 2 == 0) {
     // Pretend we never got the message
     VLOG(1) << "FLAKE";
-  } else {
+    return;
+  }
+  FrameReader reader;
+  try {
+    reader.load(data, size);
+    if (reader.getVersion() == WIRE_VERSION_1 &&
+        wireVersion != WIRE_VERSION_1) {
+      // Version 1 frames carry no session tag, so once we have moved on they
+      // could be left over from anyone.  Only the hello in front of them
+      // counts: it shows a restarted peer, or one that hasn't heard our
+      // answer yet and asks for it again.
+      VLOG(1) << "DROPPING VERSION 1 FRAME";
+      if (reader.hasMore() && reader.readByte() == HELLO) {
+        handleHello(&reader);
+      }
+    } else if (reader.getVersion() != WIRE_VERSION_1 &&
+               (peerSessionId == 0 ||
+                reader.getSessionTag() !=
+                    (unsigned char)(peerSessionId & 0xff))) {
+      // Sent by an earlier incarnation of the peer, or by a peer that knew an
+      // earlier incarnation of us.  Either way our hello sorts it out and the
+      // sender retransmits whatever it needs to.
+      VLOG(1) << "DROPPING FRAME FROM ANOTHER SESSION";
+      return;
+    } else {
+      handleRecords(&reader);
+    }
+  } catch (const std::exception& e) {
+    // A stray datagram, or a frame cut short.  The records before the bad
+    // one were fine and are kept, the peer retransmits the rest.
+    VLOG(1) << "DROPPING MALFORMED FRAME: " << e.what();
+  }
+  if (helloReplyPending) {
+    helloReplyPending = false;
+    beginRecord(RECORD_OVERHEAD, PRIORITY_INTERACTIVE);
+    writeHello();
+    endRecord();
+  }
+  flushAcknowledges();
+  advertiseWindow(false);
+}
+
+void BiDirectionalRpc::handleRecords(FrameReader* reader) {
+  // A frame is a sequence of records, each starting with its own header
+  while (reader->hasMore()) {
+    RpcHeader header = (RpcHeader)reader->readByte();
     if (header != HEARTBEAT) {
-      VLOG(1) << "GOT PACKET WITH HEADER " << header;
+      VLOG(1) << "GOT RECORD WITH HEADER " << header;
     }
     switch (header) {
       case HEARTBEAT: {
         // MultiEndpointHandler deals with keepalive
       } break;
       case REQUEST: {
-        while (reader.sizeRemaining()) {
-          RpcId rpcId = reader.readClass<RpcId>();
-          string payload = reader.readPrimitive<string>();
-          handleRequest(rpcId, payload);
-        }
+        RpcPriority priority = readPriority(reader);
+        RpcId rpcId = readRpcId(reader, true);
+        string payload = reader->readBytes();
+        handleRequest(IdPayload(rpcId, std::move(payload), priority));
       } break;
       case REPLY: {
-        while (reader.sizeRemaining()) {
-          RpcId uid = reader.readClass<RpcId>();
-          int64_t requestReceiptTime = reader.readPrimitive<int64_t>();
-          int64_t replySendTime = reader.readPrimitive<int64_t>();
-          auto requestSendTimeIt = requestSendTimeMap.find(uid);
-          if (requestSendTimeIt != requestSendTimeMap.end()) {
-            int64_t requestSendTime = requestSendTimeIt->second;
-            requestSendTimeMap.erase(requestSendTimeIt);
-            int64_t replyRecieveTime = TimeHandler::currentTimeMicros();
-            updateDrift(requestSendTime, requestReceiptTime, replySendTime,
-                        replyRecieveTime);
-          }
-          string payload = reader.readPrimitive<string>();
-          handleReply(uid, payload);
+        RpcId uid = readRpcId(reader, false);
+        int64_t requestReceiptTime = reader->readTime();
+        int64_t replySendTime = reader->readTime();
+        auto requestIt = outgoingRequests.find(uid);
+        // Karn's algorithm: a reply to a retransmitted request could belong
+        // to any of the copies, so don't trust its timing.  The timing of a
+        // chunked or replayed request includes the whole transfer or outage.
+        if (requestIt != outgoingRequests.end() &&
+            requestIt->second.timer.attempts == 0 &&
+            !requestIt->second.replayed &&
+            requestIt->second.numChunks == 0) {
+          int64_t replyRecieveTime = TimeHandler::currentTimeMicros();
+          updateRtt(updateDrift(requestIt->second.timestamp,
+                                requestReceiptTime, replySendTime,
+                                replyRecieveTime));
         }
+        string payload = reader->readBytes();
+        handleReply(uid, std::move(payload));
       } break;
       case ACKNOWLEDGE: {
-        RpcId uid = reader.readClass<RpcId>();
-        VLOG(1) << "ACK UID " << uid.str();
-        for (auto it = outgoingReplies.begin(); it != outgoingReplies.end();
-             it++) {
-          VLOG(1) << "REPLY UID " << it->first.str();
-          if (it->first == uid) {
-            if (requestRecieveTimeMap.find(it->first) ==
-                requestRecieveTimeMap.end()) {
-              LOG(INFO) << requestRecieveTimeMap.size();
-              for (const auto& it2 : requestRecieveTimeMap) {
-                LOG(INFO) << "XXXX: " << it2.first.str();
-              }
-              LOGFATAL << "Tried to remove a request receive time that we "
-                          "didn't have: "
-                       << it->first.str();
-            }
-            requestRecieveTimeMap.erase(it->first);
-            outgoingReplies.erase(it);
-            break;
+        int64_t count = int64_t(reader->readUnsigned());
+        for (int64_t a = 0; a < count; a++) {
+          RpcId uid = readRpcId(reader, true);
+          VLOG(1) << "ACK UID " << uid.str();
+          auto it = outgoingReplies.find(uid);
+          if (it != outgoingReplies.end()) {
+            replyDeadlines.erase(
+                make_pair(it->second.timer.deadline(), it->first));
+            forgetChunks(REPLY, uid, &it->second);
+            retireReply(uid);
           }
         }
       } break;
+      case CHUNK: {
+        RpcHeader kind = readChunkKind(reader);
+        RpcPriority priority = readPriority(reader);
+        RpcId uid = readRpcId(reader, kind == REQUEST);
+        uint64_t index = reader->readUnsigned();
+        uint64_t numChunks = reader->readUnsigned();
+        if (index >= numChunks || numChunks > uint64_t(INT_MAX)) {
+          throw std::runtime_error("Invalid chunk index");
+        }
+        string data = reader->readBytes();
+        handleChunk(kind, priority, uid, int(index), int(numChunks), data);
+      } break;
+      case CHUNK_ACKNOWLEDGE: {
+        int64_t count = int64_t(reader->readUnsigned());
+        for (int64_t a = 0; a < count; a++) {
+          RpcHeader kind = readChunkKind(reader);
+          RpcId uid = readRpcId(reader, kind == REPLY);
+          int index = int(reader->readUnsigned());
+          handleChunkAcknowledge(kind, uid, index);
+        }
+      } break;
+      case WINDOW: {
+        if (reader->getVersion() == WIRE_VERSION_1) {
+          // Compact frames carry a session tag instead
+          notePeerSession(reader->readUnsigned());
+        }
+        int64_t limit = reader->readSigned();
+        // Frames arrive in order, so the latest limit wins.  It only goes
+        // down when the peer reconfigures its window.
+        VLOG(1) << "PEER WINDOW LIMIT " << limit;
+        peerRequestLimit = limit;
+        sendBlockedRequests();
+      } break;
+      case HELLO: {
+        handleHello(reader);
+      } break;
       default: {
-        LOGFATAL << "Got invalid header: " << header << " in message "
-                 << message;
+        throw std::runtime_error("Invalid header " + to_string(int(header)));
       }
     }
   }
 }
 
-void BiDirectionalRpc::handleRequest(const RpcId& rpcId,
-                                     const string& payload) {
-  VLOG(1) << "GOT REQUEST: " << rpcId.str();
+bool BiDirectionalRpc::startsWithHello(const char* data, int64_t size) {
+  FrameReader reader;
+  try {
+    reader.load(data, size);
+    if (!reader.hasMore() || reader.readByte() != HELLO) {
+      return false;
+    }
+    uint64_t peerVersion = reader.readUnsigned();
+    if (peerVersion < WIRE_VERSION_1 || peerVersion > WIRE_VERSION_2) {
+      return false;
+    }
+    // Features, session, heard session and whether it wants a reply
+    reader.readUnsigned();
+    reader.readUnsigned();
+    reader.readUnsigned();
+    reader.readByte();
+  } catch (const std::exception& e) {
+    return false;
+  }
+  return true;
+}
+
+void BiDirectionalRpc::handleHello(FrameReader* reader) {
+  uint64_t peerVersion = reader->readUnsigned();
+  uint64_t peerFeatures = reader->readUnsigned();
+  uint64_t helloSessionId = reader->readUnsigned();
+  uint64_t heardSessionId = reader->readUnsigned();
+  bool needsReply = reader->readByte() != 0;
+  if (peerVersion < WIRE_VERSION_1 || peerVersion > WIRE_VERSION_2) {
+    throw std::runtime_error("Invalid wire version " +
+                             to_string(peerVersion));
+  }
+  notePeerSession(helloSessionId);
+  if (heardSessionId == sessionId && !peerHeardUs) {
+    peerHeardUs = true;
+    wireVersion = min(PROTOCOL_VERSION, int(peerVersion));
+    negotiatedFeatures = localFeatures & peerFeatures;
+    LOG(INFO) << "Speaking wire version " << wireVersion << " with features "
+              << negotiatedFeatures;
+  }
+  if (needsReply) {
+    helloReplyPending = true;
+  }
+}
 
-  bool skip = (incomingRequests.find(rpcId) != incomingRequests.end());
-  if (!skip) {
-    for (const auto& it : outgoingReplies) {
-      if (it.first == rpcId) {
-        // We already processed this request.  Send the reply again
-        skip = true;
-        sendReply(it.first, it.second);
-        break;
+IdPayload BiDirectionalRpc::getFirstIncomingRequest() {
+  lock_guard<recursive_mutex> guard(mutex);
+  for (int priority = 0; priority < NUM_PRIORITIES; priority++) {
+    auto& queue = incomingRequestQueues[priority];
+    while (!queue.empty()) {
+      auto it = incomingRequests.find(queue.front());
+      if (it != incomingRequests.end()) {
+        // The payload is handed over rather than copied, the request itself
+        // stays until it is replied to
+        IdPayload idPayload(it->second.id, std::move(it->second.payload),
+                            it->second.priority);
+        it->second.payload.clear();
+        return idPayload;
       }
+      // Already replied to
+      queue.pop_front();
     }
   }
-  if (!skip) {
-    addIncomingRequest(IdPayload(rpcId, payload));
+  LOGFATAL << "Tried to get a request when one doesn't exist";
+  return IdPayload();
+}
+
+void BiDirectionalRpc::handleRequest(IdPayload idPayload) {
+  const RpcId& rpcId = idPayload.id;
+  VLOG(1) << "GOT REQUEST: " << rpcId.str();
+
+  if (incomingRequests.find(rpcId) != incomingRequests.end()) {
+    // We are already processing this request
+    return;
+  }
+  auto completedIt = completedRequests.find(rpcId);
+  if (completedIt != completedRequests.end()) {
+    // A copy that was delayed past our acknowledged reply
+    VLOG(1) << "DROPPING DUPLICATE REQUEST " << rpcId.str()
+            << " ANSWERED WITH DIGEST " << completedIt->second.replyDigest;
+    duplicateRequests++;
+    return;
+  }
+  auto it = outgoingReplies.find(rpcId);
+  if (it != outgoingReplies.end()) {
+    // We already processed this request.  Send the reply again, unless it
+    // is chunked and already retransmitting on its own.
+    if (it->second.numChunks == 0) {
+      sendReply(it->first, it->second);
+    }
+    return;
   }
+  addIncomingRequest(std::move(idPayload));
 }
 
-void BiDirectionalRpc::handleReply(const RpcId& rpcId, const string& payload) {
-  bool skip = false;
+void BiDirectionalRpc::handleReply(const RpcId& rpcId, string payload) {
   if (incomingReplies.find(rpcId) != incomingReplies.end()) {
     // We already received this reply.  Send acknowledge again and skip.
     sendAcknowledge(rpcId);
-    skip = true;
-  }
-  if (!skip) {
-    // Stop sending the request once you get the reply
-    bool deletedRequest = false;
-    for (auto it = outgoingRequests.begin(); it != outgoingRequests.end();
-         it++) {
-      if (it->first == rpcId) {
-        outgoingRequests.erase(it);
-        deletedRequest = true;
-        tryToSendBarrier();
-        break;
-      }
+    return;
+  }
+  // Stop sending the request once you get the reply
+  auto it = outgoingRequests.find(rpcId);
+  if (it != outgoingRequests.end()) {
+    if (it->second.messageType >= 0) {
+      requestLatency[it->second.messageType].add(
+          TimeHandler::currentTimeMicros() - it->second.timestamp);
     }
-    if (deletedRequest) {
-      auto it = oneWayRequests.find(rpcId);
-      if (it != oneWayRequests.end()) {
-        // Remove this from the set of one way requests and don't bother
-        // adding a reply.
-        oneWayRequests.erase(it);
-      } else {
-        // Add a reply to be processed
-        addIncomingReply(rpcId, payload);
-      }
-      sendAcknowledge(rpcId);
+    requestDeadlines.erase(make_pair(it->second.timer.deadline(), it->first));
+    // The peer can't reply without every chunk, so any that are still
+    // unacknowledged only lost their acknowledgement.
+    forgetChunks(REQUEST, rpcId, &it->second);
+    string orderingKey = it->second.orderingKey;
+    outgoingRequests.erase(it);
+    if (!orderingKey.empty()) {
+      releaseOrderingKey(orderingKey);
+    }
+    tryToSendBarrier();
+
+    auto oneWayIt = oneWayRequests.find(rpcId);
+    if (oneWayIt != oneWayRequests.end()) {
+      // Remove this from the set of one way requests and don't bother
+      // adding a reply.
+      oneWayRequests.erase(oneWayIt);
     } else {
-      // We must have processed both this request and reply.  Send the
-      // acknowledge again.
-      sendAcknowledge(rpcId);
+      // Add a reply to be processed
+      addIncomingReply(rpcId, std::move(payload));
     }
   }
+  // If we didn't find the request, we must have processed both this request
+  // and reply already.  Either way, acknowledge so the peer stops resending.
+  sendAcknowledge(rpcId);
 }
 
-RpcId BiDirectionalRpc::request(const string& payload) {
-  auto fullUuid = sole::uuid4();
-  auto uuid = RpcId(onBarrier, fullUuid.cd);
-  auto idPayload = IdPayload(uuid, payload);
-  requestWithId(idPayload);
+RpcId BiDirectionalRpc::request(string payload, RpcPriority priority,
+                                const string& orderingKey) {
+  waitForSendCapacity();
+  RpcId uuid = newRpcId();
+  requestWithId(IdPayload(uuid, std::move(payload), priority, orderingKey));
   return uuid;
 }
 
-void BiDirectionalRpc::requestNoReply(const string& payload) {
+future<string> BiDirectionalRpc::requestAsync(string payload,
+                                              RpcPriority priority,
+                                              const string& orderingKey) {
+  waitForSendCapacity();
   lock_guard<recursive_mutex> guard(mutex);
-  auto fullUuid = sole::uuid4();
-  auto uuid = RpcId(onBarrier, fullUuid.cd);
+  RpcId uuid = newRpcId();
+  promise<string> replyPromise;
+  future<string> replyFuture = replyPromise.get_future();
+  // Register the promise before sending in case the reply comes back fast
+  replyPromises.emplace(uuid, std::move(replyPromise));
+  requestWithId(IdPayload(uuid, std::move(payload), priority, orderingKey));
+  return replyFuture;
+}
+
+void BiDirectionalRpc::requestNoReply(string payload,
+                                      RpcPriority priority,
+                                      const string& orderingKey) {
+  waitForSendCapacity();
+  lock_guard<recursive_mutex> guard(mutex);
+  RpcId uuid = newRpcId();
   oneWayRequests.insert(uuid);
-  auto idPayload = IdPayload(uuid, payload);
-  requestWithId(idPayload);
+  requestWithId(IdPayload(uuid, std::move(payload), priority, orderingKey));
 }
 
-void BiDirectionalRpc::requestWithId(const IdPayload& idPayload) {
+void BiDirectionalRpc::requestWithId(IdPayload idPayload) {
   lock_guard<recursive_mutex> guard(mutex);
-  if (outgoingRequests.empty() ||
-      outgoingRequests.begin()->first.barrier == onBarrier) {
-    // We can send the request immediately
-    outgoingRequests[idPayload.id] = idPayload.payload;
-    requestSendTimeMap[idPayload.id] = TimeHandler::currentTimeMicros();
-    sendRequest(idPayload.id, idPayload.payload);
+  if ((outgoingRequests.empty() ||
+       outgoingRequests.begin()->first.barrier == onBarrier) &&
+      (blockedRequests.empty() ||
+       blockedRequests.begin()->second.id.barrier == onBarrier)) {
+    // Nothing from an older barrier is in the way
+    dispatchRequest(std::move(idPayload));
   } else {
     // We have to wait for existing requests from an older barrier
-    delayedRequests[idPayload.id] = idPayload.payload;
+    RpcId id = idPayload.id;
+    delayedRequests[id] = std::move(idPayload);
   }
 }
 
-void BiDirectionalRpc::reply(const RpcId& rpcId, const string& payload) {
+void BiDirectionalRpc::reply(const RpcId& rpcId, string payload) {
   lock_guard<recursive_mutex> guard(mutex);
-  incomingRequests.erase(incomingRequests.find(rpcId));
-  outgoingReplies[rpcId] = payload;
-  sendReply(rpcId, payload);
+  auto requestIt = incomingRequests.find(rpcId);
+  if (requestIt == incomingRequests.end()) {
+    LOGFATAL << "Tried to reply to a request that doesn't exist: "
+             << rpcId.str();
+  }
+  RpcPriority priority = requestIt->second.priority;
+  incomingRequests.erase(requestIt);
+  auto receiveTimeIt = requestRecieveTimeMap.find(rpcId);
+  if (receiveTimeIt == requestRecieveTimeMap.end()) {
+    LOGFATAL << "Got a request with no receive time: " << rpcId.str() << " "
+             << requestRecieveTimeMap.size();
+  }
+  int64_t now = TimeHandler::currentTimeMicros();
+  auto& outgoingReply = outgoingReplies[rpcId];
+  outgoingReply =
+      OutgoingMessage(std::move(payload), priority, receiveTimeIt->second,
+                      RetransmitTimer(now, retransmitTimeout()));
+  requestRecieveTimeMap.erase(receiveTimeIt);
+  if (int64_t(outgoingReply.payload.size()) > chunkSize) {
+    startChunkedSend(REPLY, rpcId, &outgoingReply);
+    return;
+  }
+  replyDeadlines.insert(make_pair(outgoingReply.timer.deadline(), rpcId));
+  sendReply(rpcId, outgoingReply);
 }
 
 void BiDirectionalRpc::tryToSendBarrier() {
@@ -215,7 +674,7 @@ void BiDirectionalRpc::tryToSendBarrier() {
     // Nothing to send
     return;
   }
-  if (outgoingRequests.empty()) {
+  if (outgoingRequests.empty() && blockedRequests.empty()) {
     // There are no outgoing requests, we can send the next barrier
     int64_t lowestBarrier = delayedRequests.begin()->first.barrier;
     for (const auto& it : delayedRequests) {
@@ -224,151 +683,606 @@ void BiDirectionalRpc::tryToSendBarrier() {
 
     for (auto it = delayedRequests.begin(); it != delayedRequests.end();) {
       if (it->first.barrier == lowestBarrier) {
-        outgoingRequests[it->first] = it->second;
-        requestSendTimeMap[it->first] = TimeHandler::currentTimeMicros();
-        sendRequest(it->first, it->second);
+        dispatchRequest(std::move(it->second));
         it = delayedRequests.erase(it);
       } else {
         it++;
       }
     }
+    sendCapacityCondition.notify_all();
   }
 }
 
-void BiDirectionalRpc::sendRequest(const RpcId& id, const string& payload) {
-  VLOG(1) << "SENDING REQUEST: " << id.str();
-  MessageWriter writer;
-  writer.start();
-  set<RpcId> rpcsSent;
-
-  rpcsSent.insert(id);
-  writer.writePrimitive<unsigned char>(REQUEST);
-  writer.writeClass<RpcId>(id);
-  writer.writePrimitive<string>(payload);
-  // Try to attach more requests to this packet
-  int i = 0;
-  while (!outgoingRequests.empty() &&
-         rpcsSent.size() < outgoingRequests.size()) {
-    DRAW_FROM_UNORDERED(it, outgoingRequests);
-    if (rpcsSent.find(it->first) != rpcsSent.end()) {
-      // Drew an rpc that's already in the packet.  Just bail for now, maybe in
-      // the future do something more clever.
-      break;
+void BiDirectionalRpc::waitForSendCapacity() {
+  unique_lock<recursive_mutex> guard(mutex);
+  sendCapacityCondition.wait(guard, [this] { return hasSendCapacity(); });
+}
+
+void BiDirectionalRpc::dispatchRequest(IdPayload idPayload) {
+  if (idPayload.orderingKey.empty()) {
+    startRequest(std::move(idPayload));
+    return;
+  }
+  auto& domain = orderingDomains[idPayload.orderingKey];
+  if (domain.empty()) {
+    // Only the id stays behind to mark the key as busy
+    domain.push_back(IdPayload(idPayload.id, string()));
+    startRequest(std::move(idPayload));
+  } else {
+    VLOG(1) << "HOLDING " << idPayload.id.str() << " BEHIND "
+            << domain.front().id.str();
+    domain.push_back(std::move(idPayload));
+    orderedWaitingRequests++;
+  }
+}
+
+void BiDirectionalRpc::releaseOrderingKey(const string& orderingKey) {
+  auto it = orderingDomains.find(orderingKey);
+  if (it == orderingDomains.end()) {
+    LOGFATAL << "Released an ordering key that isn't held: " << orderingKey;
+  }
+  it->second.pop_front();
+  if (it->second.empty()) {
+    orderingDomains.erase(it);
+    return;
+  }
+  orderedWaitingRequests--;
+  IdPayload next = std::move(it->second.front());
+  it->second.front() = IdPayload(next.id, string());
+  startRequest(std::move(next));
+  sendCapacityCondition.notify_all();
+}
+
+void BiDirectionalRpc::startRequest(IdPayload idPayload) {
+  if (blockedRequests.empty() && requestsStarted < peerRequestLimit) {
+    addOutgoingRequest(std::move(idPayload));
+  } else {
+    VLOG(1) << "PEER WINDOW FULL, HOLDING " << idPayload.id.str();
+    auto key = make_pair(idPayload.priority, blockedSequence++);
+    blockedRequests.insert(make_pair(key, std::move(idPayload)));
+  }
+}
+
+void BiDirectionalRpc::sendBlockedRequests() {
+  bool sentAny = false;
+  while (!blockedRequests.empty() && requestsStarted < peerRequestLimit) {
+    IdPayload idPayload = std::move(blockedRequests.begin()->second);
+    blockedRequests.erase(blockedRequests.begin());
+    addOutgoingRequest(std::move(idPayload));
+    sentAny = true;
+  }
+  if (sentAny) {
+    sendCapacityCondition.notify_all();
+  }
+}
+
+void BiDirectionalRpc::advertiseWindow(bool force) {
+  int64_t freeSlots =
+      receiveWindow - int64_t(incomingRequests.size() + outgoingReplies.size());
+  int64_t limit = requestsAccepted + max(int64_t(0), freeSlots);
+  if (!force && limit == lastAdvertisedLimit) {
+    return;
+  }
+  lastAdvertisedLimit = limit;
+  beginRecord(RECORD_OVERHEAD, PRIORITY_INTERACTIVE);
+  pendingFrame.writeByte(WINDOW);
+  if (pendingFrame.getVersion() == WIRE_VERSION_1) {
+    pendingFrame.writeUnsigned(sessionId);
+  }
+  pendingFrame.writeSigned(lastAdvertisedLimit);
+  endRecord();
+}
+
+void BiDirectionalRpc::notePeerSession(uint64_t newPeerSessionId) {
+  if (newPeerSessionId == peerSessionId) {
+    return;
+  }
+  bool restarted = peerSessionId != 0;
+  // Set first so the hello in front of the replay names the new peer
+  peerSessionId = newPeerSessionId;
+  if (restarted) {
+    handlePeerReset();
+  }
+}
+
+void BiDirectionalRpc::writeHello() {
+  pendingFrame.writeByte(HELLO);
+  pendingFrame.writeUnsigned(PROTOCOL_VERSION);
+  pendingFrame.writeUnsigned(localFeatures);
+  pendingFrame.writeUnsigned(sessionId);
+  // Zero if we haven't heard from the peer yet
+  pendingFrame.writeUnsigned(peerSessionId);
+  // Keep asking for an answer until the peer shows that it heard us
+  pendingFrame.writeByte(peerHeardUs ? 0 : 1);
+}
+
+RpcId BiDirectionalRpc::newRpcId() {
+  lock_guard<recursive_mutex> guard(mutex);
+  onId++;
+  return RpcId(onBarrier, sessionId + onId);
+}
+
+void BiDirectionalRpc::handlePeerReset() {
+  LOG(INFO) << "Peer restarted, replaying " << outgoingRequests.size()
+            << " requests";
+  // The old peer will never finish its half sent messages.  Replies we still
+  // owe it are acknowledged by the new peer as unknown, so they drain on their
+  // own.
+  incomingChunks.clear();
+  pendingChunkAcknowledges.clear();
+  completedRequests.clear();
+  completedRequestOrder.clear();
+  requestsAccepted = 0;
+  lastAdvertisedLimit = -1;
+  // The new peer doesn't know us, so go back to the format everyone speaks
+  // until it answers our hello
+  wireVersion = WIRE_VERSION_1;
+  negotiatedFeatures = 0;
+  peerHeardUs = false;
+  // Anything framed so far was meant for the old peer.  The replay below
+  // starts a fresh frame that the new one can read.
+  pendingRecords = 0;
+
+  vector<pair<uint64_t, RpcId>> replay;
+  for (const auto& it : outgoingRequests) {
+    replay.push_back(make_pair(it.second.sequence, it.first));
+  }
+  sort(replay.begin(), replay.end());
+  // The new peer counts each of these once they arrive
+  requestsStarted = int64_t(replay.size());
+  // Chunked requests start over, queued again in their original order.  No
+  // chunk may go out until they all are, or the new peer would get the
+  // middle of a message before its start.
+  for (int priority = 0; priority < NUM_PRIORITIES; priority++) {
+    auto& queue = chunkedSendQueues[priority];
+    queue.erase(remove_if(queue.begin(), queue.end(),
+                          [](const pair<RpcHeader, RpcId>& kindId) {
+                            return kindId.first == REQUEST;
+                          }),
+                queue.end());
+  }
+  int64_t now = TimeHandler::currentTimeMicros();
+  for (const auto& it : replay) {
+    const RpcId& id = it.second;
+    OutgoingMessage& request = outgoingRequests[id];
+    request.replayed = true;
+    if (request.numChunks) {
+      clearChunkTimers(REQUEST, id, &request);
+      request.nextChunk = 0;
+      chunkedSendQueues[request.priority].push_back(make_pair(REQUEST, id));
+      continue;
+    }
+    requestDeadlines.erase(make_pair(request.timer.deadline(), id));
+    request.timer = RetransmitTimer(now, retransmitTimeout());
+    requestDeadlines.insert(make_pair(request.timer.deadline(), id));
+    sendRequest(id, request);
+  }
+  sendChunks();
+
+  peerResetPending = true;
+  incomingCondition.notify_all();
+  onIncoming();
+}
+
+void BiDirectionalRpc::addOutgoingRequest(IdPayload idPayload) {
+  const RpcId id = idPayload.id;
+  int64_t now = TimeHandler::currentTimeMicros();
+  requestsStarted++;
+  auto& outgoingRequest = outgoingRequests[id];
+  outgoingRequest =
+      OutgoingMessage(std::move(idPayload.payload), idPayload.priority, now,
+                      RetransmitTimer(now, retransmitTimeout()));
+  outgoingRequest.orderingKey = std::move(idPayload.orderingKey);
+  outgoingRequest.sequence = nextRequestSequence++;
+  if (!outgoingRequest.payload.empty()) {
+    outgoingRequest.messageType = (unsigned char)outgoingRequest.payload[0];
+  }
+  if (int64_t(outgoingRequest.payload.size()) > chunkSize) {
+    startChunkedSend(REQUEST, id, &outgoingRequest);
+    return;
+  }
+  requestDeadlines.insert(make_pair(outgoingRequest.timer.deadline(), id));
+  sendRequest(id, outgoingRequest);
+}
+
+BiDirectionalRpc::OutgoingMessage* BiDirectionalRpc::findOutgoing(
+    RpcHeader kind, const RpcId& id) {
+  auto& messages = (kind == REQUEST) ? outgoingRequests : outgoingReplies;
+  auto it = messages.find(id);
+  if (it == messages.end()) {
+    return NULL;
+  }
+  return &(it->second);
+}
+
+void BiDirectionalRpc::startChunkedSend(RpcHeader kind, const RpcId& id,
+                                        OutgoingMessage* message) {
+  message->numChunks =
+      int((int64_t(message->payload.size()) + chunkSize - 1) / chunkSize);
+  message->nextChunk = 0;
+  VLOG(1) << "SPLITTING " << id.str() << " INTO " << message->numChunks
+          << " CHUNKS";
+  chunkedSendQueues[message->priority].push_back(make_pair(kind, id));
+  sendChunks();
+}
+
+void BiDirectionalRpc::sendChunks() {
+  int64_t now = TimeHandler::currentTimeMicros();
+  int priority = 0;
+  int64_t maxChunksInFlight =
+      max(int64_t(1), MAX_CHUNK_BYTES_IN_FLIGHT / chunkSize);
+  while (chunksInFlight < maxChunksInFlight && priority < NUM_PRIORITIES) {
+    auto& queue = chunkedSendQueues[priority];
+    if (queue.empty()) {
+      priority++;
+      continue;
+    }
+    auto kindId = queue.front();
+    queue.pop_front();
+    OutgoingMessage* message = findOutgoing(kindId.first, kindId.second);
+    if (message == NULL || message->nextChunk >= message->numChunks) {
+      // Finished or forgotten
+      continue;
     }
-    int size = sizeof(RpcId) + it->second.length();
-    if (size + writer.size() > 400) {
-      // Too big
+    int index = message->nextChunk++;
+    RetransmitTimer timer(now, retransmitTimeout());
+    message->unackedChunks[index] = timer;
+    chunkDeadlines.insert(
+        ChunkDeadline(timer.deadline(), kindId.first, kindId.second, index));
+    chunksInFlight++;
+    sendChunk(kindId.first, kindId.second, *message, index);
+    if (message->nextChunk < message->numChunks) {
+      queue.push_back(kindId);
+    }
+  }
+}
+
+void BiDirectionalRpc::sendChunk(RpcHeader kind, const RpcId& id,
+                                 const OutgoingMessage& message, int index) {
+  VLOG(1) << "SENDING CHUNK " << index << " OF " << id.str();
+  int64_t offset = int64_t(index) * chunkSize;
+  int64_t size = min(chunkSize, int64_t(message.payload.size()) - offset);
+  beginRecord(size + RECORD_OVERHEAD, message.priority);
+  pendingFrame.writeByte(CHUNK);
+  pendingFrame.writeByte(kind);
+  pendingFrame.writeByte(message.priority);
+  writeRpcId(id, kind == REQUEST);
+  pendingFrame.writeUnsigned(index);
+  pendingFrame.writeUnsigned(message.numChunks);
+  pendingFrame.writeBytes(message.payload.data() + offset, size);
+  endRecord();
+}
+
+void BiDirectionalRpc::forgetChunks(RpcHeader kind, const RpcId& id,
+                                    OutgoingMessage* message) {
+  if (message->numChunks == 0) {
+    return;
+  }
+  clearChunkTimers(kind, id, message);
+  message->nextChunk = message->numChunks;
+  sendChunks();
+}
+
+void BiDirectionalRpc::clearChunkTimers(RpcHeader kind, const RpcId& id,
+                                        OutgoingMessage* message) {
+  for (const auto& it : message->unackedChunks) {
+    chunkDeadlines.erase(
+        ChunkDeadline(it.second.deadline(), kind, id, it.first));
+    chunksInFlight--;
+  }
+  message->unackedChunks.clear();
+}
+
+void BiDirectionalRpc::handleChunk(RpcHeader kind, RpcPriority priority,
+                                   const RpcId& id, int index, int numChunks,
+                                   const string& data) {
+  VLOG(1) << "GOT CHUNK " << index << " OF " << id.str();
+  pendingChunkAcknowledges.push_back(make_tuple(kind, id, index));
+
+  bool delivered;
+  if (kind == REQUEST) {
+    delivered = incomingRequests.find(id) != incomingRequests.end() ||
+                outgoingReplies.find(id) != outgoingReplies.end() ||
+                completedRequests.find(id) != completedRequests.end();
+  } else {
+    delivered = outgoingRequests.find(id) == outgoingRequests.end() ||
+                incomingReplies.find(id) != incomingReplies.end();
+  }
+  if (delivered) {
+    // A retransmit that crossed paths with our acknowledgement
+    return;
+  }
+
+  auto key = make_pair(kind, id);
+  auto& incoming = incomingChunks[key];
+  incoming.numChunks = numChunks;
+  incoming.lastUpdate = TimeHandler::currentTimeMicros();
+  if (index < incoming.nextIndex) {
+    return;
+  }
+  incoming.outOfOrderChunks.insert(make_pair(index, data));
+  while (true) {
+    auto it = incoming.outOfOrderChunks.find(incoming.nextIndex);
+    if (it == incoming.outOfOrderChunks.end()) {
       break;
     }
-    i++;
-    rpcsSent.insert(it->first);
-    writer.writeClass<RpcId>(it->first);
-    writer.writePrimitive<string>(it->second);
+    incoming.assembled.append(it->second);
+    incoming.outOfOrderChunks.erase(it);
+    incoming.nextIndex++;
+  }
+  if (incoming.nextIndex < incoming.numChunks) {
+    return;
+  }
+
+  string payload;
+  payload.swap(incoming.assembled);
+  incomingChunks.erase(key);
+  if (kind == REQUEST) {
+    handleRequest(IdPayload(id, std::move(payload), priority));
+  } else {
+    handleReply(id, std::move(payload));
   }
-  VLOG(1) << "Attached " << i << " extra packets";
-  send(writer.finish());
 }
 
-void BiDirectionalRpc::sendReply(const RpcId& id, const string& payload) {
+void BiDirectionalRpc::handleChunkAcknowledge(RpcHeader kind, const RpcId& id,
+                                              int index) {
+  OutgoingMessage* message = findOutgoing(kind, id);
+  if (message == NULL) {
+    return;
+  }
+  auto it = message->unackedChunks.find(index);
+  if (it == message->unackedChunks.end()) {
+    return;
+  }
+  chunkDeadlines.erase(ChunkDeadline(it->second.deadline(), kind, id, index));
+  message->unackedChunks.erase(it);
+  chunksInFlight--;
+  if (kind == REPLY && message->nextChunk == message->numChunks &&
+      message->unackedChunks.empty()) {
+    // Every chunk arrived, so the reply as a whole is acknowledged
+    retireReply(id);
+  }
+  sendChunks();
+}
+
+void BiDirectionalRpc::sendRequest(const RpcId& id,
+                                   const OutgoingMessage& request) {
+  lock_guard<recursive_mutex> guard(mutex);
+  VLOG(1) << "SENDING REQUEST: " << id.str();
+  beginRecord(int64_t(request.payload.size()) + RECORD_OVERHEAD,
+              request.priority);
+  pendingFrame.writeByte(REQUEST);
+  pendingFrame.writeByte(request.priority);
+  writeRpcId(id, true);
+  pendingFrame.writeBytes(request.payload);
+  endRecord();
+}
+
+void BiDirectionalRpc::sendReply(const RpcId& id,
+                                 const OutgoingMessage& reply) {
   lock_guard<recursive_mutex> guard(mutex);
   VLOG(1) << "SENDING REPLY: " << id.str();
-  set<RpcId> rpcsSent;
-
-  rpcsSent.insert(id);
-  MessageWriter writer;
-  writer.start();
-  writer.writePrimitive<unsigned char>(REPLY);
-  writer.writeClass<RpcId>(id);
-  auto receiveTimeIt = requestRecieveTimeMap.find(id);
-  if (receiveTimeIt == requestRecieveTimeMap.end()) {
-    LOGFATAL << "Got a request with no receive time: " << id.str() << " "
-             << requestRecieveTimeMap.size();
+  beginRecord(int64_t(reply.payload.size()) + RECORD_OVERHEAD, reply.priority);
+  pendingFrame.writeByte(REPLY);
+  writeRpcId(id, false);
+  pendingFrame.writeTime(reply.timestamp);
+  pendingFrame.writeTime(TimeHandler::currentTimeMicros());
+  pendingFrame.writeBytes(reply.payload);
+  endRecord();
+}
+
+void BiDirectionalRpc::retireReply(const RpcId& id) {
+  auto it = outgoingReplies.find(id);
+  if (it == outgoingReplies.end()) {
+    LOGFATAL << "Tried to retire a reply that isn't outgoing: " << id.str();
   }
-  writer.writePrimitive<int64_t>(receiveTimeIt->second);
-  writer.writePrimitive<int64_t>(TimeHandler::currentTimeMicros());
-  writer.writePrimitive<string>(payload);
-  // Try to attach more replies to this packet
-  int i = 0;
-  while (!outgoingReplies.empty() && rpcsSent.size() < outgoingReplies.size()) {
-    DRAW_FROM_UNORDERED(it, outgoingReplies);
-    if (rpcsSent.find(it->first) != rpcsSent.end()) {
-      // Drew an rpc that's already in the packet.  Just bail for now, maybe in
-      // the future do something more clever.
-      break;
-    }
-    int size = sizeof(RpcId) + it->second.length();
-    if (size + writer.size() > 400) {
-      // Too big
-      break;
+  int64_t now = TimeHandler::currentTimeMicros();
+  CompletedRequest completed = {now, fnv1aHash(it->second.payload)};
+  outgoingReplies.erase(it);
+  if (completedRequests.insert(make_pair(id, completed)).second) {
+    completedRequestOrder.push_back(make_pair(now, id));
+  }
+  pruneCompletedRequests(now);
+}
+
+void BiDirectionalRpc::pruneCompletedRequests(int64_t now) {
+  while (!completedRequestOrder.empty() &&
+         (int64_t(completedRequestOrder.size()) > MAX_COMPLETED_REQUESTS ||
+          now - completedRequestOrder.front().first >
+              COMPLETED_REQUEST_WINDOW_MICROS)) {
+    completedRequests.erase(completedRequestOrder.front().second);
+    completedRequestOrder.pop_front();
+  }
+}
+
+void BiDirectionalRpc::sendAcknowledge(const RpcId& uid) {
+  pendingAcknowledges.push_back(uid);
+}
+
+void BiDirectionalRpc::flushAcknowledges() {
+  if (!pendingChunkAcknowledges.empty()) {
+    beginRecord(int64_t(pendingChunkAcknowledges.size()) * RECORD_OVERHEAD,
+                PRIORITY_INTERACTIVE);
+    pendingFrame.writeByte(CHUNK_ACKNOWLEDGE);
+    pendingFrame.writeUnsigned(pendingChunkAcknowledges.size());
+    for (const auto& it : pendingChunkAcknowledges) {
+      pendingFrame.writeByte(get<0>(it));
+      writeRpcId(get<1>(it), get<0>(it) == REPLY);
+      pendingFrame.writeUnsigned(get<2>(it));
     }
-    i++;
-    rpcsSent.insert(it->first);
-    writer.writeClass<RpcId>(it->first);
-    receiveTimeIt = requestRecieveTimeMap.find(it->first);
-    if (receiveTimeIt == requestRecieveTimeMap.end()) {
-      LOGFATAL << "Got a request with no receive time";
+    pendingChunkAcknowledges.clear();
+    endRecord();
+  }
+  if (pendingAcknowledges.empty()) {
+    return;
+  }
+  // One record acknowledges everything we got in the frame we just processed
+  beginRecord(int64_t(pendingAcknowledges.size()) * RECORD_OVERHEAD,
+              PRIORITY_INTERACTIVE);
+  pendingFrame.writeByte(ACKNOWLEDGE);
+  pendingFrame.writeUnsigned(pendingAcknowledges.size());
+  for (const auto& uid : pendingAcknowledges) {
+    writeRpcId(uid, true);
+  }
+  pendingAcknowledges.clear();
+  endRecord();
+}
+
+void BiDirectionalRpc::beginRecord(int64_t recordSize, RpcPriority priority) {
+  if (pendingRecords && pendingFrame.size() + recordSize > maxFrameSize) {
+    flushPendingFrame();
+  }
+  if (pendingRecords == 0) {
+    pendingFrameStartTime = TimeHandler::currentTimeMicros();
+    pendingFrame.start(wireVersion, (unsigned char)(sessionId & 0xff),
+                       pendingFrameStartTime);
+    pendingFramePriority = priority;
+    if (!peerHeardUs) {
+      // Rides in front of the first record until the peer answers it
+      writeHello();
     }
-    writer.writePrimitive<int64_t>(receiveTimeIt->second);
-    writer.writePrimitive<int64_t>(TimeHandler::currentTimeMicros());
-    writer.writePrimitive<string>(it->second);
+  } else {
+    pendingFramePriority = min(pendingFramePriority, priority);
   }
-  VLOG(1) << "Attached " << i << " extra packets";
-  send(writer.finish());
 }
 
-void BiDirectionalRpc::sendAcknowledge(const RpcId& uid) {
-  MessageWriter writer;
-  writer.start();
-  writer.writePrimitive<unsigned char>(ACKNOWLEDGE);
-  writer.writeClass<RpcId>(uid);
-  send(writer.finish());
+void BiDirectionalRpc::endRecord() {
+  pendingRecords++;
+  if (pendingFrame.size() >= maxFrameSize || flushWindowMicros <= 0) {
+    flushPendingFrame();
+  } else if (pendingRecords == 1) {
+    onFramePending();
+  }
+}
+
+void BiDirectionalRpc::flushPendingFrame() {
+  lock_guard<recursive_mutex> guard(mutex);
+  if (pendingRecords == 0) {
+    return;
+  }
+  VLOG(1) << "FLUSHING " << pendingRecords << " RECORDS IN "
+          << pendingFrame.size() << " BYTES";
+  pendingRecords = 0;
+  string frame = pendingFrame.finish();
+  tuningBytesSent += frame.size();
+  send(std::move(frame), pendingFramePriority);
+  int64_t now = TimeHandler::currentTimeMicros();
+  if (now - lastSendTuningTime >= SEND_TUNING_INTERVAL_MICROS) {
+    tuneSending(now);
+  }
+}
+
+int64_t BiDirectionalRpc::microsUntilFlush() {
+  lock_guard<recursive_mutex> guard(mutex);
+  if (pendingRecords == 0) {
+    return -1;
+  }
+  return max(int64_t(0), pendingFrameStartTime + flushWindowMicros -
+                             TimeHandler::currentTimeMicros());
 }
 
-void BiDirectionalRpc::addIncomingRequest(const IdPayload& idPayload) {
+void BiDirectionalRpc::addIncomingRequest(IdPayload idPayload) {
   lock_guard<recursive_mutex> guard(mutex);
   if (requestRecieveTimeMap.find(idPayload.id) != requestRecieveTimeMap.end()) {
     LOGFATAL << "Already created receive time for id: " << idPayload.id.str();
   }
   requestRecieveTimeMap[idPayload.id] = TimeHandler::currentTimeMicros();
-  incomingRequests.insert(make_pair(idPayload.id, idPayload.payload));
+  requestsAccepted++;
+  RpcId id = idPayload.id;
+  incomingRequestQueues[idPayload.priority].push_back(id);
+  incomingRequests.insert(make_pair(id, std::move(idPayload)));
+  incomingCondition.notify_all();
+  onIncoming();
 }
 
-void BiDirectionalRpc::updateDrift(int64_t requestSendTime,
-                                   int64_t requestReceiptTime,
-                                   int64_t replySendTime,
-                                   int64_t replyRecieveTime) {
+int64_t BiDirectionalRpc::updateDrift(int64_t requestSendTime,
+                                      int64_t requestReceiptTime,
+                                      int64_t replySendTime,
+                                      int64_t replyRecieveTime) {
   int64_t timeOffset = ((requestReceiptTime - requestSendTime) +
                         (replySendTime - replyRecieveTime)) /
                        2;
+  int64_t serverTime = max(int64_t(0), replySendTime - requestReceiptTime);
   int64_t ping = (replyRecieveTime - requestSendTime) -
                  (replySendTime - requestReceiptTime);
-  networkStatsQueue.push_back({timeOffset, ping});
   VLOG(2) << "Time Sync Info: " << timeOffset << " " << ping << " "
           << (replyRecieveTime - requestSendTime) << " "
           << (replySendTime - requestReceiptTime);
-  if (networkStatsQueue.size() >= 100) {
-    LOG(INFO) << "Time Sync Info: " << timeOffset << " " << ping << " "
-              << (replyRecieveTime - requestSendTime) << " "
-              << (replySendTime - requestReceiptTime);
-    int64_t sumShift = 0;
-    int64_t shiftCount = 0;
-    for (int i = 0; i < networkStatsQueue.size(); i++) {
-      sumShift += networkStatsQueue.at(i).offset;
-      shiftCount++;
-    }
-    if (shiftCount) {
-      VLOG(2) << "New shift: " << (sumShift / shiftCount);
-      auto shift =
-          std::chrono::microseconds{sumShift / shiftCount / int64_t(5)};
-      VLOG(2) << "TIME CHANGE: " << TimeHandler::currentTimeMicros();
-      TimeHandler::initialTime -= shift;
-      VLOG(2) << "TIME CHANGE: " << TimeHandler::currentTimeMicros();
-    }
+
+  networkStatsQueue.push_back({timeOffset, ping});
+  clockOffsetSum += timeOffset;
+  if (int64_t(networkStatsQueue.size()) > NETWORK_STATS_SAMPLES) {
+    clockOffsetSum -= networkStatsQueue.front().offset;
+    networkStatsQueue.pop_front();
+  }
+  if (networkStatsSamples == 0) {
+    smoothedServerTime = serverTime;
+  } else {
+    smoothedServerTime = (7 * smoothedServerTime + serverTime) / 8;
+  }
+  networkStatsSamples++;
+  if (networkStatsSamples % NETWORK_STATS_SAMPLES == 0) {
+    LOG(INFO) << "Rpc stats: " << getStats().summary();
+  }
+  return ping;
+}
+
+RpcStats BiDirectionalRpc::getStats() {
+  lock_guard<recursive_mutex> guard(mutex);
+  RpcStats stats;
+  stats.smoothedRtt = smoothedRtt;
+  stats.rttVariance = rttVariance;
+  stats.retransmitTimeout = retransmitTimeout();
+  stats.oneWayLatency = smoothedRtt / 2;
+  stats.smoothedServerTime = smoothedServerTime;
+  if (!networkStatsQueue.empty()) {
+    stats.clockOffset = clockOffsetSum / int64_t(networkStatsQueue.size());
+  }
+  stats.requestRetransmits = requestRetransmits;
+  stats.replyRetransmits = replyRetransmits;
+  stats.chunkRetransmits = chunkRetransmits;
+  stats.outgoingRequests = outgoingRequests.size();
+  stats.queuedRequests =
+      int64_t(blockedRequests.size() + delayedRequests.size()) +
+      orderedWaitingRequests;
+  stats.incomingRequests = incomingRequests.size();
+  stats.outgoingReplies = outgoingReplies.size();
+  stats.incomingReplies = incomingReplies.size();
+  stats.chunksInFlight = chunksInFlight;
+  for (const auto& it : outgoingRequests) {
+    stats.outgoingRequestBytes += it.second.payload.capacity();
+  }
+  for (const auto& it : outgoingReplies) {
+    stats.outgoingReplyBytes += it.second.payload.capacity();
+  }
+  stats.completedRequests = completedRequests.size();
+  stats.duplicateRequests = duplicateRequests;
+  stats.requestLatency = requestLatency;
+  stats.queueDelay = queueDelay;
+  stats.sendThroughput = sendThroughput;
+  stats.flushWindow = flushWindowMicros;
+  stats.compressionLevel = compressionLevel;
+  return stats;
+}
+
+string RpcStats::summary() const {
+  std::ostringstream ss;
+  ss << "rtt " << smoothedRtt << "us (+/- " << rttVariance << ") server "
+     << smoothedServerTime << "us offset " << clockOffset
+     << "us retransmits " << requestRetransmits << "/" << replyRetransmits
+     << "/" << chunkRetransmits << " queues " << outgoingRequests << "/"
+     << queuedRequests << "/" << incomingRequests << "/" << outgoingReplies
+     << "/" << incomingReplies << " unacked bytes " << outgoingRequestBytes
+     << "/" << outgoingReplyBytes << " completed " << completedRequests
+     << " duplicates " << duplicateRequests << " queue delay " << queueDelay
+     << "us sending " << sendThroughput << "B/s window " << flushWindow
+     << "us level " << compressionLevel;
+  for (const auto& it : requestLatency) {
+    ss << " [" << it.first << ": n=" << it.second.getCount()
+       << " p50=" << it.second.getPercentile(0.5)
+       << " p99=" << it.second.getPercentile(0.99) << "]";
   }
-  // auto shift = std::chrono::microseconds{
-  //     int64_t(timeOffsetController.calculate(0, double(timeOffset)))};
-  // TimeHandler::initialTime += shift;
-  networkStatsQueue.clear();
+  return ss.str();
 }
 
 }  // namespace codefs
@@ -2,20 +2,41 @@
 #define __BIDIRECTIONAL_RPC_H__
 
 #include "Headers.hpp"
+#include "LatencyHistogram.hpp"
 #include "MessageReader.hpp"
 #include "MessageWriter.hpp"
 #include "PidController.hpp"
+#include "RpcFrame.hpp"
 #include "RpcId.hpp"
 
 namespace codefs {
+// Requests in a lower class are sent and dispatched ahead of requests in a
+// higher one, first-in first-out within a class.  Replies and chunks inherit
+// the class of their request.
+enum RpcPriority {
+  PRIORITY_INTERACTIVE = 0,
+  PRIORITY_BULK = 1,
+  PRIORITY_BACKGROUND = 2,
+  NUM_PRIORITIES = 3
+};
+
 class IdPayload {
  public:
-  IdPayload() {}
-  IdPayload(const RpcId& _id, const string& _payload)
-      : id(_id), payload(_payload) {}
+  IdPayload() : priority(PRIORITY_INTERACTIVE) {}
+  IdPayload(const RpcId& _id, string _payload,
+            RpcPriority _priority = PRIORITY_INTERACTIVE,
+            const string& _orderingKey = string())
+      : id(_id),
+        payload(std::move(_payload)),
+        priority(_priority),
+        orderingKey(_orderingKey) {}
 
   RpcId id;
   string payload;
+  RpcPriority priority;
+  // Requests with the same non-empty key are started one at a time, in the
+  // order they were made.  Only used on the sending side.
+  string orderingKey;
 };
 }  // namespace codefs
 
@@ -36,7 +57,97 @@ struct hash<codefs::RpcId> : public std::unary_function<codefs::RpcId, size_t> {
 }  // namespace std
 
 namespace codefs {
-enum RpcHeader { HEARTBEAT = 1, REQUEST = 2, REPLY = 3, ACKNOWLEDGE = 4 };
+enum RpcHeader {
+  HEARTBEAT = 1,
+  REQUEST = 2,
+  REPLY = 3,
+  ACKNOWLEDGE = 4,
+  CHUNK = 5,
+  CHUNK_ACKNOWLEDGE = 6,
+  // Carries the sender's session id along with its limit, since a limit only
+  // means something against the counters of that session
+  WINDOW = 7,
+  // The sender's session id, wire version and features.  Leads every frame
+  // until the peer has answered with one of its own.
+  HELLO = 8
+};
+
+// A snapshot of what an rpc endpoint knows about its link and its peer.  All
+// times are in microseconds.
+struct RpcStats {
+  RpcStats()
+      : smoothedRtt(0),
+        rttVariance(0),
+        retransmitTimeout(0),
+        oneWayLatency(0),
+        smoothedServerTime(0),
+        clockOffset(0),
+        requestRetransmits(0),
+        replyRetransmits(0),
+        chunkRetransmits(0),
+        outgoingRequests(0),
+        queuedRequests(0),
+        incomingRequests(0),
+        outgoingReplies(0),
+        incomingReplies(0),
+        chunksInFlight(0),
+        outgoingRequestBytes(0),
+        outgoingReplyBytes(0),
+        completedRequests(0),
+        duplicateRequests(0),
+        queueDelay(0),
+        sendThroughput(0),
+        flushWindow(0),
+        compressionLevel(0) {}
+
+  // Round trip on the network alone, not counting the time the peer spent
+  // before replying
+  int64_t smoothedRtt;
+  int64_t rttVariance;
+  int64_t retransmitTimeout;
+  // Half the round trip, since we can't tell the two directions apart
+  int64_t oneWayLatency;
+  // How long the peer takes to reply once it has a request
+  int64_t smoothedServerTime;
+  // The peer's clock minus ours
+  int64_t clockOffset;
+
+  int64_t requestRetransmits;
+  int64_t replyRetransmits;
+  int64_t chunkRetransmits;
+
+  // Queue depths when the snapshot was taken.  Queued requests wait on the
+  // peer's window, a barrier or an ordering key before they are sent.
+  int64_t outgoingRequests;
+  int64_t queuedRequests;
+  int64_t incomingRequests;
+  int64_t outgoingReplies;
+  int64_t incomingReplies;
+  int64_t chunksInFlight;
+
+  // Memory held by payloads until the peer acknowledges them
+  int64_t outgoingRequestBytes;
+  int64_t outgoingReplyBytes;
+  // Entries in the duplicate detection window, and late copies of requests
+  // that it caught
+  int64_t completedRequests;
+  int64_t duplicateRequests;
+
+  // Round trip above the smallest one seen lately, over the last tuning
+  // interval, and the frame bytes per second we sent in it
+  int64_t queueDelay;
+  int64_t sendThroughput;
+  // What send tuning chose for them
+  int64_t flushWindow;
+  int compressionLevel;
+
+  // Time from first sending a request to getting its reply, keyed by the
+  // first byte of the request, which is the header of codefs messages
+  map<int, LatencyHistogram> requestLatency;
+
+  // One line for the logs
+  string summary() const;
+};
 
 class BiDirectionalRpc {
  public:
@@ -44,15 +155,28 @@ class BiDirectionalRpc {
   virtual ~BiDirectionalRpc();
   void shutdown();
   void heartbeat();
+  // Holds every later request until all earlier ones are replied to.  Prefer
+  // an ordering key, which only serializes requests that share the key.
   void barrier() {
     lock_guard<recursive_mutex> guard(mutex);
     onBarrier++;
   }
 
-  RpcId request(const string& payload);
-  void requestNoReply(const string& payload);
-  virtual void requestWithId(const IdPayload& idPayload);
-  virtual void reply(const RpcId& rpcId, const string& payload);
+  // Payloads are taken by value, so callers that are done with theirs can
+  // std::move them in and skip a copy.
+  RpcId request(string payload,
+                RpcPriority priority = PRIORITY_INTERACTIVE,
+                const string& orderingKey = string());
+  // Sends a request and returns a future that is fulfilled with the reply
+  // payload when it arrives, so callers can block without polling.
+  future<string> requestAsync(string payload,
+                              RpcPriority priority = PRIORITY_INTERACTIVE,
+                              const string& orderingKey = string());
+  void requestNoReply(string payload,
+                      RpcPriority priority = PRIORITY_INTERACTIVE,
+                      const string& orderingKey = string());
+  virtual void requestWithId(IdPayload idPayload);
+  virtual void reply(const RpcId& rpcId, string payload);
   inline void replyOneWay(const RpcId& rpcId) { reply(rpcId, "OK"); }
 
   bool hasIncomingRequest() {
@@ -63,14 +187,10 @@ class BiDirectionalRpc {
     lock_guard<recursive_mutex> guard(mutex);
     return incomingRequests.find(rpcId) != incomingRequests.end();
   }
-  IdPayload getFirstIncomingRequest() {
-    lock_guard<recursive_mutex> guard(mutex);
-    if (!hasIncomingRequest()) {
-      LOGFATAL << "Tried to get a request when one doesn't exist";
-    }
-    return IdPayload(incomingRequests.begin()->first,
-                     incomingRequests.begin()->second);
-  }
+  // Returns the oldest request in the most urgent class.  It stays first
+  // until it is replied to, but its payload is moved out, so call this once
+  // per request.
+  IdPayload getFirstIncomingRequest();
 
   bool hasIncomingReply() {
     lock_guard<recursive_mutex> guard(mutex);
@@ -83,7 +203,7 @@ class BiDirectionalRpc {
       LOGFATAL << "Tried to get reply when there was none";
     }
     IdPayload idPayload = IdPayload(incomingReplies.begin()->first,
-                                    incomingReplies.begin()->second);
+                                    std::move(incomingReplies.begin()->second));
     incomingReplies.erase(incomingReplies.begin());
     return idPayload;
   }
@@ -98,61 +218,446 @@ class BiDirectionalRpc {
     if (it == incomingReplies.end()) {
       LOGFATAL << "Tried to get a reply that didn't exist!";
     }
-    string payload = it->second;
+    string payload = std::move(it->second);
     incomingReplies.erase(it);
     return payload;
   }
 
+  // Blocks until there is an incoming request or reply to process, or a peer
+  // reset to consume, or until the timeout elapses.  Returns true if there is
+  // work.
+  bool waitForIncoming(int64_t timeoutMs) {
+    unique_lock<recursive_mutex> guard(mutex);
+    return incomingCondition.wait_for(
+        guard, std::chrono::milliseconds(timeoutMs), [this] {
+          return !incomingRequests.empty() || !incomingReplies.empty() ||
+                 peerResetPending;
+        });
+  }
+
   void setFlaky(bool _flaky) { flaky = _flaky; }
 
+  RpcStats getStats();
+  // Zero until the first reply has been timed
+  int64_t getSmoothedRtt() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return smoothedRtt;
+  }
+  // The zlib level payloads for the peer are worth, from Z_BEST_SPEED when
+  // the link has room to spare to Z_BEST_COMPRESSION when it is the
+  // bottleneck
+  int getCompressionLevel() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return compressionLevel;
+  }
+
+  // Random id for this endpoint, which the peer uses to notice that we
+  // restarted and lost our state.  Our rpc ids count up from it.
+  uint64_t getSessionId() const { return sessionId; }
+  // The wire format we send in, which is version 1 until the HELLO exchange
+  // with the peer completes
+  int getWireVersion() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return wireVersion;
+  }
+  // Optional features that both we and the peer support
+  uint64_t getNegotiatedFeatures() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return negotiatedFeatures;
+  }
+  // True once after the peer is found to have restarted.  Everything it
+  // hadn't replied to is replayed automatically, but anything cached from
+  // the old peer should be validated again.
+  bool consumePeerReset() {
+    lock_guard<recursive_mutex> guard(mutex);
+    bool reset = peerResetPending;
+    peerResetPending = false;
+    return reset;
+  }
+
   virtual void receive(const string& message);
+  // Parses a frame straight out of the transport's buffer.  Frames that are
+  // truncated or malformed are dropped.
+  virtual void receive(const char* data, int64_t size);
+  // True if the frame opens with a well formed HELLO, which is how every
+  // new peer starts.  Lets a router ignore strays before it keeps any state.
+  static bool startsWithHello(const char* data, int64_t size);
+  // Leads our frames with a hello again until the peer answers.  For when
+  // the peer may have restarted without us hearing from it.
+  void resendHello() {
+    lock_guard<recursive_mutex> guard(mutex);
+    peerHeardUs = false;
+  }
+
+  // Retransmits every outgoing request/reply whose retransmit timer has
+  // expired.
+  void resendOverdueMessages();
+  // Microseconds until the next retransmit timer expires, or -1 if nothing is
+  // waiting on an acknowledgement.
+  int64_t microsUntilNextResend();
+
+  // Outgoing records are packed into frames of up to maxFrameSize bytes.  A
+  // frame that isn't full goes out once its first record has waited about
+  // flushWindowMicros, which send tuning shortens on an idle link and
+  // stretches when queues build; a window of zero sends every record on its
+  // own.
+  void setFrameCoalescing(int64_t _maxFrameSize, int64_t _flushWindowMicros) {
+    lock_guard<recursive_mutex> guard(mutex);
+    maxFrameSize = _maxFrameSize;
+    baseFlushWindowMicros = _flushWindowMicros;
+    applySendTuning();
+  }
+  // Requests and replies with payloads bigger than this are split into
+  // chunks that are acknowledged and retransmitted one at a time.
+  void setChunkSize(int64_t _chunkSize) {
+    lock_guard<recursive_mutex> guard(mutex);
+    chunkSize = _chunkSize;
+  }
+  // We hold at most receiveWindow of the peer's requests at a time, counting
+  // both unprocessed requests and replies that aren't acknowledged yet.
+  // Callers of request() and friends block while maxQueuedRequests requests
+  // are waiting for the peer's window to open.
+  void setFlowControl(int64_t _receiveWindow, int64_t _maxQueuedRequests) {
+    lock_guard<recursive_mutex> guard(mutex);
+    receiveWindow = _receiveWindow;
+    maxQueuedRequests = _maxQueuedRequests;
+    sendCapacityCondition.notify_all();
+  }
+  // False if a request made now would block waiting for the peer
+  bool hasSendCapacity() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return int64_t(blockedRequests.size() + delayedRequests.size()) +
+               orderedWaitingRequests <
+           maxQueuedRequests;
+  }
+  // How many more requests the peer's advertised window lets us start now,
+  // after everything already waiting for it
+  int64_t getWindowCredit() {
+    lock_guard<recursive_mutex> guard(mutex);
+    int64_t waiting = int64_t(blockedRequests.size() + delayedRequests.size()) +
+                      orderedWaitingRequests;
+    return max(int64_t(0), peerRequestLimit - requestsStarted - waiting);
+  }
+  // Sends the partially filled outgoing frame, if there is one.
+  void flushPendingFrame();
+  // Microseconds until the pending frame's flush window closes, or -1 if
+  // there is nothing to flush.
+  int64_t microsUntilFlush();
 
   bool hasWork() {
     lock_guard<recursive_mutex> guard(mutex);
-    return !delayedRequests.empty() || !outgoingRequests.empty() ||
+    return !delayedRequests.empty() || !orderingDomains.empty() ||
+           !blockedRequests.empty() ||
+           !outgoingRequests.empty() ||
            !incomingRequests.empty() || !outgoingReplies.empty() ||
            !incomingReplies.empty();
   }
 
  protected:
-  unordered_map<RpcId, string> delayedRequests;
-  unordered_map<RpcId, string> outgoingRequests;
-  unordered_map<RpcId, string> incomingRequests;
+  unordered_map<RpcId, IdPayload> delayedRequests;
+  // Requests for each ordering key.  The front one has been started, the
+  // rest wait for it to be replied to.
+  unordered_map<string, deque<IdPayload>> orderingDomains;
+  int64_t orderedWaitingRequests;
+  unordered_map<RpcId, IdPayload> incomingRequests;
+  // Arrival order of incomingRequests for each class.  Ids that were replied
+  // to are skipped when they reach the front.
+  deque<RpcId> incomingRequestQueues[NUM_PRIORITIES];
   unordered_set<RpcId> oneWayRequests;
 
-  unordered_map<RpcId, int64_t> requestSendTimeMap;
+  // Receive times of requests that we haven't replied to yet.  Once we reply,
+  // the time moves into the OutgoingMessage for the reply.
   unordered_map<RpcId, int64_t> requestRecieveTimeMap;
 
-  unordered_map<RpcId, string> outgoingReplies;
+  struct RetransmitTimer {
+    RetransmitTimer() : lastSendTime(0), timeout(0), attempts(0) {}
+    RetransmitTimer(int64_t _lastSendTime, int64_t _timeout)
+        : lastSendTime(_lastSendTime), timeout(_timeout), attempts(0) {}
+
+    int64_t deadline() const { return lastSendTime + timeout; }
+
+    int64_t lastSendTime;
+    int64_t timeout;
+    int attempts;
+  };
+
+  // Everything we need to (re)send a message until it is acknowledged
+  struct OutgoingMessage {
+    OutgoingMessage()
+        : priority(PRIORITY_INTERACTIVE),
+          sequence(0),
+          messageType(-1),
+          timestamp(0),
+          replayed(false),
+          numChunks(0),
+          nextChunk(0) {}
+    OutgoingMessage(string _payload, RpcPriority _priority,
+                    int64_t _timestamp, const RetransmitTimer& _timer)
+        : payload(std::move(_payload)),
+          priority(_priority),
+          sequence(0),
+          messageType(-1),
+          timestamp(_timestamp),
+          replayed(false),
+          timer(_timer),
+          numChunks(0),
+          nextChunk(0) {}
+
+    string payload;
+    RpcPriority priority;
+    // For requests, the ordering key to release once the reply arrives
+    string orderingKey;
+    // For requests, the order they were started in, used to replay them in
+    // the same order if the peer restarts
+    uint64_t sequence;
+    // For requests, the first byte of the payload, or -1 if it is empty
+    int messageType;
+    // For requests, when the request was first sent.  For replies, when the
+    // matching request was received.
+    int64_t timestamp;
+    // For requests, whether they were sent again to a restarted peer.  The
+    // timestamp stays put for the latency stats, so their round trip would
+    // include the whole outage.
+    bool replayed;
+    // Unused for chunked messages, which retransmit per chunk instead
+    RetransmitTimer timer;
+    // Number of chunks the payload is split into, or zero if it fits in a
+    // single record.
+    int numChunks;
+    // The first chunk that hasn't been sent yet
+    int nextChunk;
+    // Chunks that were sent but not acknowledged yet
+    map<int, RetransmitTimer> unackedChunks;
+  };
+  unordered_map<RpcId, OutgoingMessage> outgoingRequests;
+  uint64_t nextRequestSequence;
+  unordered_map<RpcId, OutgoingMessage> outgoingReplies;
+
+  // Requests whose replies the peer acknowledged.  A late copy of one of
+  // these must not run again, so we remember them for a while, keeping only
+  // a digest of the reply.  completedRequestOrder is oldest first.
+  struct CompletedRequest {
+    int64_t time;
+    uint64_t replyDigest;
+  };
+  unordered_map<RpcId, CompletedRequest> completedRequests;
+  deque<pair<int64_t, RpcId>> completedRequestOrder;
+  int64_t duplicateRequests;
   unordered_map<RpcId, string> incomingReplies;
 
+  // Retransmit deadlines sorted by expiry, mirroring the timers above
+  set<pair<int64_t, RpcId>> requestDeadlines;
+  set<pair<int64_t, RpcId>> replyDeadlines;
+
+  // Ids to acknowledge, sent as one ACKNOWLEDGE record per received frame
+  vector<RpcId> pendingAcknowledges;
+
+  // Chunk retransmit deadlines, keyed by (deadline, REQUEST/REPLY, id, index)
+  typedef tuple<int64_t, RpcHeader, RpcId, int> ChunkDeadline;
+  set<ChunkDeadline> chunkDeadlines;
+  // Chunked messages that still have unsent chunks, per class.  Within a
+  // class each one gets a chunk in turn so concurrent transfers share the
+  // window.
+  deque<pair<RpcHeader, RpcId>> chunkedSendQueues[NUM_PRIORITIES];
+  int64_t chunksInFlight;
+  int64_t chunkSize;
+
+  struct IncomingChunkedMessage {
+    IncomingChunkedMessage() : numChunks(0), nextIndex(0), lastUpdate(0) {}
+
+    int numChunks;
+    // The payload up to the first missing chunk
+    string assembled;
+    int nextIndex;
+    // Chunks past the first missing one, held until the gap is filled
+    map<int, string> outOfOrderChunks;
+    int64_t lastUpdate;
+  };
+  map<pair<RpcHeader, RpcId>, IncomingChunkedMessage> incomingChunks;
+  vector<tuple<RpcHeader, RpcId, int>> pendingChunkAcknowledges;
+
+  // Flow control works like a TCP window over request counts.  The peer
+  // allows us to start up to peerRequestLimit requests in total; the rest
+  // wait in blockedRequests, ordered by class and then arrival.  In turn we
+  // tell the peer how many of its requests it may start, based on
+  // requestsAccepted and receiveWindow.
+  int64_t requestsStarted;
+  int64_t peerRequestLimit;
+  map<pair<RpcPriority, uint64_t>, IdPayload> blockedRequests;
+  uint64_t blockedSequence;
+  int64_t requestsAccepted;
+  int64_t receiveWindow;
+  int64_t lastAdvertisedLimit;
+  int64_t maxQueuedRequests;
+  condition_variable_any sendCapacityCondition;
+
+  // Records that haven't been handed to the transport yet, and the most
+  // urgent class among them
+  FrameWriter pendingFrame;
+  int pendingRecords;
+  RpcPriority pendingFramePriority;
+  int64_t pendingFrameStartTime;
+  int64_t maxFrameSize;
+  // The window in use, and the one it was configured with
+  int64_t flushWindowMicros;
+  int64_t baseFlushWindowMicros;
+  int compressionLevel;
+
+  // RFC 6298 style round trip estimator, in microseconds.  Both are zero until
+  // the first sample arrives.
+  int64_t smoothedRtt;
+  int64_t rttVariance;
+  int64_t smoothedServerTime;
+  int64_t requestRetransmits;
+  int64_t replyRetransmits;
+  int64_t chunkRetransmits;
+  map<int, LatencyHistogram> requestLatency;
+  unordered_map<RpcId, promise<string>> replyPromises;
+
   int64_t onBarrier;
   uint64_t onId;
   bool flaky;
+  uint64_t sessionId;
+  // Zero until the peer's first hello or window arrives
+  uint64_t peerSessionId;
+  bool peerResetPending;
+
+  // Version negotiation.  We keep leading our frames with a hello until one
+  // from the peer shows that it heard us, and then send in the highest
+  // version we both speak.
+  int wireVersion;
+  uint64_t localFeatures;
+  uint64_t negotiatedFeatures;
+  bool peerHeardUs;
+  // The peer asked us to confirm that we heard its hello
+  bool helloReplyPending;
   recursive_mutex mutex;
+  condition_variable_any incomingCondition;
 
   struct NetworkStats {
     int64_t offset;
     int64_t ping;
   };
+  // The most recent samples, used to average out the clock offset
   deque<NetworkStats> networkStatsQueue;
-  PidController timeOffsetController;
+  int64_t clockOffsetSum;
+  int64_t networkStatsSamples;
 
-  void handleRequest(const RpcId& rpcId, const string& payload);
-  virtual void handleReply(const RpcId& rpcId, const string& payload);
-  void resendRandomOutgoingMessage();
+  // Send tuning.  Each interval the controller compares the queueing delay
+  // with a target and sets the headroom, from 0 when queues are building to
+  // 1 when the link is idle.  Headroom shortens the flush window and lowers
+  // the compression level, trading bandwidth for latency and cpu.
+  PidController sendTuningController;
+  double sendHeadroom;
+  int64_t lastSendTuningTime;
+  int64_t tuningBytesSent;
+  int64_t sendThroughput;
+  int64_t queueDelay;
+  int64_t queueDelaySum;
+  int64_t queueDelaySamples;
+  // The smallest round trip in this window and in the one being collected,
+  // or -1 before the first sample
+  int64_t minRtt;
+  int64_t nextMinRtt;
+  int64_t minRttWindowStart;
+
+  // Handles each record in a frame, throwing if one is malformed
+  void handleRecords(FrameReader* reader);
+  // Reads the rest of a HELLO record and settles the wire version with it
+  void handleHello(FrameReader* reader);
+  void handleRequest(IdPayload idPayload);
+  virtual void handleReply(const RpcId& rpcId, string payload);
+  int64_t retransmitTimeout();
+  void updateRtt(int64_t rttSample);
+  // Runs the controller over what was measured since the last interval
+  void tuneSending(int64_t now);
+  // Derives the flush window and compression level from the headroom
+  void applySendTuning();
   void tryToSendBarrier();
-  void sendRequest(const RpcId& id, const string& payload);
-  void sendReply(const RpcId& id, const string& payload);
+  // Blocks until there is room to queue another request.  Must be called
+  // without holding the mutex.
+  void waitForSendCapacity();
+  // Starts the request unless an earlier one with the same ordering key is
+  // still outstanding
+  void dispatchRequest(IdPayload idPayload);
+  // Starts the next request waiting on the key, if any
+  void releaseOrderingKey(const string& orderingKey);
+  // Sends the request if the peer's window allows, otherwise queues it
+  void startRequest(IdPayload idPayload);
+  void sendBlockedRequests();
+  // Tells the peer how many requests it may start.  Unless forced, only
+  // sends anything if the limit changed since the last advertisement.
+  void advertiseWindow(bool force);
+  // The peer came back with a new session, so it has forgotten everything it
+  // got from us.  Starts its window over and replays our requests.
+  void handlePeerReset();
+  // Records the session id from a hello or window, resetting if it changed
+  void notePeerSession(uint64_t newPeerSessionId);
+  void writeHello();
+  // Ids count up from the session id of the endpoint that made the request,
+  // which version 2 frames use to shrink them to a small counter
+  void writeRpcId(const RpcId& id, bool madeByUs) {
+    pendingFrame.writeId(id, madeByUs ? sessionId : peerSessionId);
+  }
+  RpcId readRpcId(FrameReader* reader, bool madeBySender) {
+    return reader->readId(madeBySender ? peerSessionId : sessionId);
+  }
+  RpcId newRpcId();
+  void addOutgoingRequest(IdPayload idPayload);
+  void sendRequest(const RpcId& id, const OutgoingMessage& request);
+  void sendReply(const RpcId& id, const OutgoingMessage& reply);
+  // Every record is written between beginRecord() and endRecord().
+  // beginRecord() flushes the pending frame first if a record of about
+  // recordSize bytes would not fit.
+  void beginRecord(int64_t recordSize, RpcPriority priority);
+  void endRecord();
+  OutgoingMessage* findOutgoing(RpcHeader kind, const RpcId& id);
+  void startChunkedSend(RpcHeader kind, const RpcId& id,
+                        OutgoingMessage* message);
+  // Sends new chunks while there is room in the in-flight window
+  void sendChunks();
+  void sendChunk(RpcHeader kind, const RpcId& id,
+                 const OutgoingMessage& message, int index);
+  // Stops retransmitting the chunks of a message that is going away
+  void forgetChunks(RpcHeader kind, const RpcId& id, OutgoingMessage* message);
+  // Stops retransmitting the chunks in flight, without touching the queues
+  void clearChunkTimers(RpcHeader kind, const RpcId& id,
+                        OutgoingMessage* message);
+  void handleChunk(RpcHeader kind, RpcPriority priority, const RpcId& id,
+                   int index, int numChunks, const string& data);
+  void handleChunkAcknowledge(RpcHeader kind, const RpcId& id, int index);
+  // Drops a reply that the peer acknowledged, remembering its request in the
+  // duplicate detection window
+  void retireReply(const RpcId& id);
+  // Forgets completed requests that fell out of the window
+  void pruneCompletedRequests(int64_t now);
   void sendAcknowledge(const RpcId& uid);
-  virtual void addIncomingRequest(const IdPayload& idPayload);
-  virtual void addIncomingReply(const RpcId& uid, const string& payload) {
-    incomingReplies.emplace(uid, payload);
+  void flushAcknowledges();
+  virtual void addIncomingRequest(IdPayload idPayload);
+  virtual void addIncomingReply(const RpcId& uid, string payload) {
+    auto it = replyPromises.find(uid);
+    if (it != replyPromises.end()) {
+      // Someone is waiting on this reply, hand it over directly
+      it->second.set_value(std::move(payload));
+      replyPromises.erase(it);
+      return;
+    }
+    incomingReplies.emplace(uid, std::move(payload));
+    incomingCondition.notify_all();
+    onIncoming();
   }
-  void updateDrift(int64_t requestSendTime, int64_t requestReceiptTime,
-                   int64_t replySendTime, int64_t replyRecieveTime);
+  // Called with the mutex held whenever a request or reply is queued for the
+  // application
+  virtual void onIncoming() {}
+  int64_t updateDrift(int64_t requestSendTime, int64_t requestReceiptTime,
+                      int64_t replySendTime, int64_t replyRecieveTime);
 
-  virtual void send(const string& message) = 0;
+  // Called when a record lands in an empty frame, so the transport can
+  // schedule a flush when the window closes.
+  virtual void onFramePending() {}
+  // Takes ownership of the frame so the transport can hand the buffer to the
+  // socket without copying it
+  virtual void send(string message, RpcPriority priority) = 0;
 };
 }  // namespace codefs
 
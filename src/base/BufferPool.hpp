@@ -0,0 +1,48 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// Spare message buffers for the calling thread.  Readers hand back the
+// payloads they are done with and writers build the next message in them,
+// so a thread answering a steady stream of requests stops allocating.
+// Being per thread, it needs no lock.
+class BufferPool {
+ public:
+  // An empty string, with some capacity if the pool had a spare
+  static string take() {
+    vector<string>& spares = getSpares();
+    if (spares.empty()) {
+      return string();
+    }
+    string s = std::move(spares.back());
+    spares.pop_back();
+    s.clear();
+    return s;
+  }
+
+  static void give(string&& s) {
+    // Don't hang on to the odd huge file
+    if (s.capacity() == 0 || s.capacity() > MAX_POOLED_CAPACITY) {
+      return;
+    }
+    vector<string>& spares = getSpares();
+    if (spares.size() >= MAX_POOLED_BUFFERS) {
+      return;
+    }
+    spares.push_back(std::move(s));
+  }
+
+ protected:
+  static const size_t MAX_POOLED_BUFFERS = 16;
+  static const size_t MAX_POOLED_CAPACITY = 1024 * 1024;
+
+  static vector<string>& getSpares() {
+    static thread_local vector<string> spares;
+    return spares;
+  }
+};
+}  // namespace codefs
+
+#endif  // __BUFFER_POOL_H__
@@ -0,0 +1,480 @@
+#include "Codec.hpp"
+
+namespace codefs {
+namespace {
+// Below this the zlib header and checksum eat most of the savings
+const int64_t MIN_COMPRESS_SIZE = 256;
+// The entropy probe looks at a few slices spread over the payload
+const int64_t PROBE_SLICES = 4;
+const int64_t PROBE_SLICE_SIZE = 1024;
+const double INCOMPRESSIBLE_BITS_PER_BYTE = 7.5;
+// Big enough that splitting barely hurts the ratio
+const int64_t BLOCK_SIZE = 1024 * 1024;
+const int64_t BLOCK_HEADER_SIZE = 1 + 8 + 4;
+// Deflate can't shrink anything by more than this
+const int64_t MAX_ZLIB_EXPANSION = 1032;
+// A primed stream is worth it even for tiny payloads
+const int64_t MIN_DICTIONARY_COMPRESS_SIZE = 32;
+const int64_t DICTIONARY_HEADER_SIZE = 1 + 4;
+const size_t MAX_CODEC_DICTIONARIES = 4;
+// The trainer looks for byte sequences of this length that recur
+const int TRAINING_GRAM_SIZE = 8;
+
+std::mutex codecDictionariesMutex;
+// Oldest first
+deque<pair<uint32_t, shared_ptr<const string>>> codecDictionaries;
+
+ctpl::thread_pool& getCodecThreadPool() {
+  static ctpl::thread_pool pool(
+      max(2, int(std::thread::hardware_concurrency())));
+  return pool;
+}
+
+void writeLittleEndian(uint64_t value, int bytes, char* out) {
+  for (int a = 0; a < bytes; a++) {
+    out[a] = char((value >> (8 * a)) & 0xff);
+  }
+}
+
+uint64_t readLittleEndian(const char* in, int bytes) {
+  uint64_t value = 0;
+  for (int a = 0; a < bytes; a++) {
+    value |= uint64_t((unsigned char)in[a]) << (8 * a);
+  }
+  return value;
+}
+
+int64_t blockRawSize(int64_t rawSize, int64_t block) {
+  return min(BLOCK_SIZE, rawSize - block * BLOCK_SIZE);
+}
+
+string compressBlocks(const string& raw, int level) {
+  int64_t rawSize = raw.size();
+  int64_t numBlocks = (rawSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  vector<future<string>> blocks;
+  for (int64_t block = 0; block < numBlocks; block++) {
+    blocks.push_back(
+        getCodecThreadPool().push([&raw, rawSize, block, level](int) {
+          return compressString(raw.data() + block * BLOCK_SIZE,
+                                blockRawSize(rawSize, block), level);
+        }));
+  }
+  // The tasks read raw, so let them all finish before get() can throw
+  for (auto& it : blocks) {
+    it.wait();
+  }
+  vector<string> compressed;
+  int64_t totalSize = BLOCK_HEADER_SIZE + 4 * numBlocks;
+  for (auto& it : blocks) {
+    compressed.push_back(it.get());
+    totalSize += compressed.back().size();
+  }
+
+  string retval(totalSize, '\0');
+  retval[0] = char(CODEC_ZLIB_BLOCKS);
+  writeLittleEndian(rawSize, 8, &retval[1]);
+  writeLittleEndian(numBlocks, 4, &retval[9]);
+  int64_t offset = BLOCK_HEADER_SIZE;
+  for (const auto& it : compressed) {
+    writeLittleEndian(it.size(), 4, &retval[offset]);
+    offset += 4;
+  }
+  for (const auto& it : compressed) {
+    memcpy(&retval[offset], it.data(), it.size());
+    offset += it.size();
+  }
+  return retval;
+}
+
+void inflateBlock(const char* data, int64_t size, char* out,
+                  int64_t outSize) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) {
+    throw std::runtime_error("inflateInit failed while decompressing.");
+  }
+  zs.next_in = (Bytef*)data;
+  zs.avail_in = size;
+  zs.next_out = (Bytef*)out;
+  zs.avail_out = outSize;
+  int ret = inflate(&zs, Z_FINISH);
+  bool complete = (ret == Z_STREAM_END && int64_t(zs.total_out) == outSize);
+  inflateEnd(&zs);
+  if (!complete) {
+    std::ostringstream oss;
+    oss << "Corrupt compressed block: (" << ret << ")";
+    throw std::runtime_error(oss.str());
+  }
+}
+
+// Deflates raw into a buffer that leaves headerSize bytes in front for the
+// codec header, so the output is never copied to prepend it
+string deflateBehindHeader(const string& raw, int level, int64_t headerSize,
+                           const string* dictionary) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit(&zs, level) != Z_OK ||
+      (dictionary &&
+       deflateSetDictionary(&zs, (const Bytef*)dictionary->data(),
+                            dictionary->size()) != Z_OK)) {
+    throw std::runtime_error("deflateInit failed while compressing.");
+  }
+  zs.next_in = (Bytef*)raw.data();
+  zs.avail_in = raw.size();
+  string retval(headerSize + deflateBound(&zs, raw.size()), '\0');
+  zs.next_out = (Bytef*)&retval[headerSize];
+  zs.avail_out = retval.size() - headerSize;
+  int ret = deflate(&zs, Z_FINISH);
+  retval.resize(headerSize + zs.total_out);
+  deflateEnd(&zs);
+  if (ret != Z_STREAM_END) {
+    std::ostringstream oss;
+    oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
+    throw std::runtime_error(oss.str());
+  }
+  return retval;
+}
+
+string compressWithDictionary(const string& raw, int level, uint32_t id,
+                              const string& dictionary) {
+  string retval =
+      deflateBehindHeader(raw, level, DICTIONARY_HEADER_SIZE, &dictionary);
+  retval[0] = char(CODEC_ZLIB_DICTIONARY);
+  writeLittleEndian(id, 4, &retval[1]);
+  return retval;
+}
+
+string decompressWithDictionary(const char* data, int64_t size) {
+  if (size < DICTIONARY_HEADER_SIZE) {
+    throw std::runtime_error("Truncated dictionary header");
+  }
+  uint32_t id = readLittleEndian(data + 1, 4);
+  shared_ptr<const string> dictionary = getCodecDictionary(id);
+  if (!dictionary) {
+    std::ostringstream oss;
+    oss << "Payload needs unknown dictionary " << id;
+    throw std::runtime_error(oss.str());
+  }
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) {
+    throw std::runtime_error("inflateInit failed while decompressing.");
+  }
+  zs.next_in = (Bytef*)data + DICTIONARY_HEADER_SIZE;
+  zs.avail_in = size - DICTIONARY_HEADER_SIZE;
+  // Metadata compresses around 10x with a good dictionary
+  // compressPayload never primes anything bigger than a block, so a stream
+  // that fills a byte past one is corrupt or hostile
+  int64_t maxSize = BLOCK_SIZE + 1;
+  string retval(min(maxSize, max(int64_t(1024), 10 * size)), '\0');
+  int ret;
+  do {
+    if (zs.total_out == retval.size()) {
+      if (int64_t(retval.size()) == maxSize) {
+        inflateEnd(&zs);
+        throw std::runtime_error("Dictionary payload inflates past a block");
+      }
+      retval.resize(min(maxSize, int64_t(retval.size()) * 2));
+    }
+    zs.next_out = (Bytef*)&retval[zs.total_out];
+    zs.avail_out = retval.size() - zs.total_out;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT) {
+      ret = inflateSetDictionary(&zs, (const Bytef*)dictionary->data(),
+                                 dictionary->size());
+    }
+  } while (ret == Z_OK);
+  retval.resize(zs.total_out);
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END) {
+    std::ostringstream oss;
+    oss << "Exception during zlib decompression: (" << ret << ")";
+    throw std::runtime_error(oss.str());
+  }
+  return retval;
+}
+
+// Checks a blocked payload's header against its size and finds each block.
+// Returns the raw size.
+int64_t readBlockLayout(const char* data, int64_t size,
+                        vector<pair<const char*, int64_t>>* blocks) {
+  if (size < BLOCK_HEADER_SIZE) {
+    throw std::runtime_error("Truncated block header");
+  }
+  int64_t rawSize = readLittleEndian(data + 1, 8);
+  int64_t numBlocks = readLittleEndian(data + 9, 4);
+  if (rawSize < 0 || numBlocks != (rawSize + BLOCK_SIZE - 1) / BLOCK_SIZE ||
+      size < BLOCK_HEADER_SIZE + 4 * numBlocks) {
+    throw std::runtime_error("Corrupt block header");
+  }
+  const char* sizes = data + BLOCK_HEADER_SIZE;
+  int64_t offset = BLOCK_HEADER_SIZE + 4 * numBlocks;
+  int64_t dataSize = 0;
+  for (int64_t block = 0; block < numBlocks; block++) {
+    int64_t blockSize = readLittleEndian(sizes + 4 * block, 4);
+    if (blockSize > size - offset - dataSize) {
+      throw std::runtime_error("Truncated block");
+    }
+    blocks->push_back(make_pair(data + offset + dataSize, blockSize));
+    dataSize += blockSize;
+  }
+  // Otherwise a few bytes of header could make us allocate gigabytes
+  if (rawSize > dataSize * MAX_ZLIB_EXPANSION) {
+    throw std::runtime_error("Block header claims an impossible raw size");
+  }
+  return rawSize;
+}
+
+string decompressBlocks(const char* data, int64_t size) {
+  vector<pair<const char*, int64_t>> layout;
+  int64_t rawSize = readBlockLayout(data, size, &layout);
+  string retval(rawSize, '\0');
+  vector<future<void>> blocks;
+  for (int64_t block = 0; block < int64_t(layout.size()); block++) {
+    const char* blockData = layout[block].first;
+    int64_t blockSize = layout[block].second;
+    char* out = &retval[block * BLOCK_SIZE];
+    int64_t outSize = blockRawSize(rawSize, block);
+    blocks.push_back(getCodecThreadPool().push(
+        [blockData, blockSize, out, outSize](int) {
+          inflateBlock(blockData, blockSize, out, outSize);
+        }));
+  }
+  // get() rethrows anything a block threw, after we stop touching retval
+  for (auto& it : blocks) {
+    it.wait();
+  }
+  for (auto& it : blocks) {
+    it.get();
+  }
+  return retval;
+}
+
+void decompressBlocks(const char* data, int64_t size,
+                      const PayloadSink& sink) {
+  vector<pair<const char*, int64_t>> layout;
+  int64_t rawSize = readBlockLayout(data, size, &layout);
+  // Enough blocks in flight to keep the pool busy while the sink works
+  int64_t window = 2 * int64_t(getCodecThreadPool().size());
+  deque<future<string>> inflight;
+  int64_t nextBlock = 0;
+  try {
+    while (nextBlock < int64_t(layout.size()) || !inflight.empty()) {
+      while (nextBlock < int64_t(layout.size()) &&
+             int64_t(inflight.size()) < window) {
+        const char* blockData = layout[nextBlock].first;
+        int64_t blockSize = layout[nextBlock].second;
+        int64_t outSize = blockRawSize(rawSize, nextBlock);
+        inflight.push_back(getCodecThreadPool().push(
+            [blockData, blockSize, outSize](int) {
+              string out(outSize, '\0');
+              inflateBlock(blockData, blockSize, &out[0], outSize);
+              return out;
+            }));
+        nextBlock++;
+      }
+      string block = inflight.front().get();
+      inflight.pop_front();
+      sink(block.data(), block.size());
+    }
+  } catch (...) {
+    // The tasks still read the caller's buffer.  The one that failed has
+    // already been collected.
+    for (auto& it : inflight) {
+      if (it.valid()) {
+        it.wait();
+      }
+    }
+    throw;
+  }
+}
+}  // namespace
+
+CodecOptions codecOptionsForPeer(uint64_t negotiatedFeatures,
+                                 int compressionLevel) {
+  CodecOptions options;
+  if ((negotiatedFeatures & FEATURE_PAYLOAD_CODECS) == 0) {
+    return options;
+  }
+  options.framed = true;
+  options.level = compressionLevel;
+  return options;
+}
+
+string compressPayload(const string& raw, const CodecOptions& options) {
+  if (!options.framed) {
+    return compressString(raw);
+  }
+  int64_t size = raw.size();
+  shared_ptr<const string> dictionary;
+  if (options.dictionaryId && size <= BLOCK_SIZE) {
+    dictionary = getCodecDictionary(options.dictionaryId);
+  }
+  int64_t minSize = dictionary ? MIN_DICTIONARY_COMPRESS_SIZE
+                               : MIN_COMPRESS_SIZE;
+  if (size >= minSize && !looksIncompressible(raw.data(), size)) {
+    string compressed;
+    if (size > BLOCK_SIZE) {
+      compressed = compressBlocks(raw, options.level);
+    } else if (dictionary) {
+      compressed = compressWithDictionary(raw, options.level,
+                                          options.dictionaryId, *dictionary);
+    } else {
+      compressed = deflateBehindHeader(raw, options.level, 1, NULL);
+      compressed[0] = char(CODEC_ZLIB);
+    }
+    if (int64_t(compressed.size()) <= size) {
+      return compressed;
+    }
+  }
+  string stored;
+  stored.reserve(size + 1);
+  stored.push_back(char(CODEC_NONE));
+  stored.append(raw);
+  return stored;
+}
+
+string decompressPayload(const char* data, int64_t size) {
+  if (size == 0) {
+    throw std::runtime_error("Empty payload");
+  }
+  switch ((unsigned char)data[0]) {
+    case CODEC_NONE:
+      return string(data + 1, size - 1);
+    case CODEC_ZLIB:
+      return decompressString(data + 1, size - 1);
+    case CODEC_ZLIB_BLOCKS:
+      return decompressBlocks(data, size);
+    case CODEC_ZLIB_DICTIONARY:
+      return decompressWithDictionary(data, size);
+    default:
+      // A peer without codecs
+      return decompressString(data, size);
+  }
+}
+
+void decompressPayload(const char* data, int64_t size,
+                       const PayloadSink& sink) {
+  if (size > 0 && (unsigned char)data[0] == CODEC_ZLIB_BLOCKS) {
+    decompressBlocks(data, size, sink);
+    return;
+  }
+  // Everything else is at most a block
+  string raw = decompressPayload(data, size);
+  sink(raw.data(), raw.size());
+}
+
+bool looksIncompressible(const char* data, int64_t size) {
+  int64_t counts[256];
+  memset(counts, 0, sizeof(counts));
+  int64_t sampled = 0;
+  int64_t stride = max(size / PROBE_SLICES, PROBE_SLICE_SIZE);
+  for (int64_t start = 0; start < size; start += stride) {
+    int64_t end = min(size, start + PROBE_SLICE_SIZE);
+    for (int64_t a = start; a < end; a++) {
+      counts[(unsigned char)data[a]]++;
+    }
+    sampled += end - start;
+  }
+  double bitsPerByte = 0;
+  for (int a = 0; a < 256; a++) {
+    if (counts[a]) {
+      double p = double(counts[a]) / sampled;
+      bitsPerByte -= p * std::log2(p);
+    }
+  }
+  return bitsPerByte > INCOMPRESSIBLE_BITS_PER_BYTE;
+}
+
+uint32_t addCodecDictionary(const string& dictionary) {
+  uint32_t id = adler32(adler32(0, NULL, 0), (const Bytef*)dictionary.data(),
+                        dictionary.size());
+  lock_guard<std::mutex> guard(codecDictionariesMutex);
+  for (const auto& it : codecDictionaries) {
+    if (it.first == id) {
+      return id;
+    }
+  }
+  codecDictionaries.push_back(
+      make_pair(id, shared_ptr<const string>(new string(dictionary))));
+  if (codecDictionaries.size() > MAX_CODEC_DICTIONARIES) {
+    codecDictionaries.pop_front();
+  }
+  return id;
+}
+
+shared_ptr<const string> getCodecDictionary(uint32_t id) {
+  lock_guard<std::mutex> guard(codecDictionariesMutex);
+  for (const auto& it : codecDictionaries) {
+    if (it.first == id) {
+      return it.second;
+    }
+  }
+  return shared_ptr<const string>();
+}
+
+string trainCodecDictionary(const vector<string>& samples, int64_t maxSize) {
+  // Every distinct sequence in each sample that could fit
+  vector<unordered_set<uint64_t>> sampleGrams(samples.size());
+  unordered_map<uint64_t, int> gramCounts;
+  for (int a = 0; a < int(samples.size()); a++) {
+    const string& sample = samples[a];
+    if (int64_t(sample.size()) > maxSize) {
+      continue;
+    }
+    for (int b = 0; b + TRAINING_GRAM_SIZE <= int(sample.size()); b++) {
+      uint64_t gram;
+      memcpy(&gram, &sample[b], TRAINING_GRAM_SIZE);
+      if (sampleGrams[a].insert(gram).second) {
+        gramCounts[gram]++;
+      }
+    }
+  }
+
+  // Samples made of sequences that many other samples share come first
+  vector<pair<double, int>> scores;
+  for (int a = 0; a < int(samples.size()); a++) {
+    if (sampleGrams[a].empty()) {
+      // Too big, or too small to say anything about
+      continue;
+    }
+    int64_t shared = 0;
+    for (uint64_t gram : sampleGrams[a]) {
+      shared += gramCounts[gram] - 1;
+    }
+    scores.push_back(make_pair(double(shared) / samples[a].size(), a));
+  }
+  sort(scores.rbegin(), scores.rend());
+
+  unordered_set<uint64_t> covered;
+  vector<int> chosen;
+  int64_t size = 0;
+  for (const auto& it : scores) {
+    const string& sample = samples[it.second];
+    if (size + int64_t(sample.size()) > maxSize) {
+      continue;
+    }
+    // Skip samples that are mostly covered by the ones already chosen
+    int64_t fresh = 0;
+    for (uint64_t gram : sampleGrams[it.second]) {
+      fresh += covered.count(gram) ? 0 : 1;
+    }
+    if (fresh * 2 < int64_t(sampleGrams[it.second].size())) {
+      continue;
+    }
+    covered.insert(sampleGrams[it.second].begin(),
+                   sampleGrams[it.second].end());
+    chosen.push_back(it.second);
+    size += sample.size();
+  }
+
+  // zlib matches against the end of the dictionary most cheaply, so the
+  // best samples go last
+  string dictionary;
+  dictionary.reserve(size);
+  for (auto it = chosen.rbegin(); it != chosen.rend(); it++) {
+    dictionary.append(samples[*it]);
+  }
+  return dictionary;
+}
+}  // namespace codefs
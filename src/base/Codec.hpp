@@ -0,0 +1,78 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// The byte at the front of a framed payload.  A bare zlib stream, which is
+// what peers without FEATURE_PAYLOAD_CODECS send, always starts with 0x78,
+// so the two can be told apart.
+enum PayloadCodec {
+  CODEC_NONE = 1,
+  CODEC_ZLIB = 2,
+  // Independent zlib streams over fixed size blocks, so big payloads can be
+  // compressed and decompressed on every core.  Laid out as
+  // [raw size u64][block count u32][compressed size u32 per block][blocks].
+  CODEC_ZLIB_BLOCKS = 3,
+  // [dictionary id u32][zlib stream primed with that preset dictionary]
+  CODEC_ZLIB_DICTIONARY = 4
+};
+
+// How to compress payloads for one peer
+struct CodecOptions {
+  CodecOptions()
+      : framed(false), level(Z_BEST_COMPRESSION), dictionaryId(0) {}
+
+  // The peer reads the codec byte, so each payload may pick its own codec.
+  // Otherwise everything is a bare zlib stream at the best level.
+  bool framed;
+  // zlib effort for payloads that are worth compressing
+  int level;
+  // A preset dictionary that the peer has too, or 0.  It lets payloads of a
+  // few hundred bytes compress well.
+  uint32_t dictionaryId;
+};
+
+// The level comes from the rpc's send tuning, which knows whether the link
+// or the cpu is the bottleneck
+CodecOptions codecOptionsForPeer(uint64_t negotiatedFeatures,
+                                 int compressionLevel);
+
+// Skips tiny payloads and ones that already look compressed, and falls back
+// to storing the payload if compression didn't shrink it.  Payloads over a
+// block are split up and compressed on a shared thread pool.
+string compressPayload(const string& raw, const CodecOptions& options);
+
+// Reads both framed payloads and bare zlib streams.  Blocked payloads are
+// inflated in parallel, each straight into its place in the output.
+string decompressPayload(const char* data, int64_t size);
+inline string decompressPayload(const string& s) {
+  return decompressPayload(s.data(), s.size());
+}
+
+// Receives a payload's bytes in order, a piece at a time
+typedef function<void(const char*, int64_t)> PayloadSink;
+
+// Streams the payload out a block at a time as the pool inflates them, so a
+// big file never has to sit in memory whole.  If the payload turns out to be
+// corrupt, the sink has already seen the blocks before the bad one.
+void decompressPayload(const char* data, int64_t size,
+                       const PayloadSink& sink);
+
+// Preset dictionaries for CODEC_ZLIB_DICTIONARY.  The id is the dictionary's
+// adler32, which is what zlib calls it too, so both ends agree on it.  Only
+// the most recent few are kept.
+uint32_t addCodecDictionary(const string& dictionary);
+// Null if we don't have it
+shared_ptr<const string> getCodecDictionary(uint32_t id);
+
+// Builds a dictionary of at most maxSize bytes out of the samples whose
+// contents are most common across all of them
+string trainCodecDictionary(const vector<string>& samples, int64_t maxSize);
+
+// Estimates the entropy of a sample of the bytes.  Images, archives and
+// other compressed formats come out near 8 bits per byte.
+bool looksIncompressible(const char* data, int64_t size);
+}  // namespace codefs
+
+#endif  // __CODEC_H__
@@ -0,0 +1,104 @@
+#include "CompoundRequest.hpp"
+
+namespace codefs {
+void CompoundRequest::create(const string& path, int flags, mode_t mode) {
+  beginOp(CLIENT_SERVER_CREATE_FILE, path);
+  writer.writePrimitive<int>(flags);
+  writer.writePrimitive<int>(mode);
+}
+
+void CompoundRequest::mkdir(const string& path, mode_t mode) {
+  beginOp(CLIENT_SERVER_MKDIR, path);
+  writer.writePrimitive<int>(mode);
+}
+
+void CompoundRequest::unlink(const string& path) {
+  beginOp(CLIENT_SERVER_UNLINK, path);
+}
+
+void CompoundRequest::rmdir(const string& path) {
+  beginOp(CLIENT_SERVER_RMDIR, path);
+}
+
+void CompoundRequest::symlink(const string& from, const string& to) {
+  beginOp(CLIENT_SERVER_SYMLINK, from, to);
+  writer.writePrimitive<string>(to);
+}
+
+void CompoundRequest::rename(const string& from, const string& to) {
+  beginOp(CLIENT_SERVER_RENAME, from, to);
+  writer.writePrimitive<string>(to);
+}
+
+void CompoundRequest::link(const string& from, const string& to) {
+  beginOp(CLIENT_SERVER_LINK, from, to);
+  writer.writePrimitive<string>(to);
+}
+
+void CompoundRequest::chmod(const string& path, int mode) {
+  beginOp(CLIENT_SERVER_CHMOD, path);
+  writer.writePrimitive<int>(mode);
+}
+
+void CompoundRequest::lchown(const string& path, int64_t uid, int64_t gid) {
+  beginOp(CLIENT_SERVER_LCHOWN, path);
+  writer.writePrimitive<int64_t>(uid);
+  writer.writePrimitive<int64_t>(gid);
+}
+
+void CompoundRequest::truncate(const string& path, int64_t size) {
+  beginOp(CLIENT_SERVER_TRUNCATE, path);
+  writer.writePrimitive<int64_t>(size);
+}
+
+void CompoundRequest::utimensat(const string& path,
+                                const struct timespec ts[2]) {
+  beginOp(CLIENT_SERVER_UTIMENSAT, path);
+  writer.writePrimitive<int64_t>(ts[0].tv_sec);
+  writer.writePrimitive<int64_t>(ts[0].tv_nsec);
+  writer.writePrimitive<int64_t>(ts[1].tv_sec);
+  writer.writePrimitive<int64_t>(ts[1].tv_nsec);
+}
+
+void CompoundRequest::dropOpsFrom(int index) {
+  if (index >= numOps) {
+    return;
+  }
+  writer.truncate(opOffsets[index]);
+  ops.resize(index);
+  opOffsets.resize(index);
+  numOps = index;
+}
+
+string CompoundRequest::finish() {
+  MessageWriter request;
+  request.start();
+  request.writePrimitive<unsigned char>(CLIENT_SERVER_COMPOUND);
+  request.writePrimitive<int>(numOps);
+  request.writePrimitive<string>(writer.finish());
+  ops.clear();
+  opOffsets.clear();
+  numOps = 0;
+  return request.finish();
+}
+
+vector<int> CompoundRequest::readResults(string reply) {
+  MessageReader reader;
+  reader.load(std::move(reply));
+  int numRan = reader.readPrimitive<int>();
+  vector<int> results;
+  for (int a = 0; a < numRan; a++) {
+    results.push_back(reader.readPrimitive<int>());
+  }
+  return results;
+}
+
+void CompoundRequest::beginOp(unsigned char header, const string& from,
+                              const string& to) {
+  opOffsets.push_back(writer.size());
+  writer.writePrimitive<unsigned char>(header);
+  writer.writePrimitive<string>(from);
+  ops.push_back(make_tuple(header, from, to));
+  numOps++;
+}
+}  // namespace codefs
@@ -0,0 +1,60 @@
+#ifndef __CODEFS_COMPOUND_REQUEST_H__
+#define __CODEFS_COMPOUND_REQUEST_H__
+
+#include "Headers.hpp"
+
+#include "MessageReader.hpp"
+#include "MessageWriter.hpp"
+
+namespace codefs {
+// Path mutations for the server to run in order in one round trip, like an
+// NFSv4 compound.  The server stops at the first one that fails.
+class CompoundRequest {
+ public:
+  CompoundRequest() : numOps(0) { writer.start(); }
+
+  // Creates an empty file with the given mode, checking access like open()
+  // with O_CREAT.  The file is not opened.
+  void create(const string& path, int flags, mode_t mode);
+  void mkdir(const string& path, mode_t mode);
+  void unlink(const string& path);
+  void rmdir(const string& path);
+  void symlink(const string& from, const string& to);
+  void rename(const string& from, const string& to);
+  void link(const string& from, const string& to);
+  void chmod(const string& path, int mode);
+  void lchown(const string& path, int64_t uid, int64_t gid);
+  void truncate(const string& path, int64_t size);
+  void utimensat(const string& path, const struct timespec ts[2]);
+
+  int size() const { return numOps; }
+
+  // The header and paths of each op, for invalidating the client's cache
+  const vector<tuple<unsigned char, string, string>>& getOps() const {
+    return ops;
+  }
+
+  // Forgets the op at index and every op after it
+  void dropOpsFrom(int index);
+
+  // Packs the request and starts a new, empty compound
+  string finish();
+
+  // Reads the errno of each op that ran out of the server's reply
+  static vector<int> readResults(string reply);
+
+ protected:
+  // Each op is packed exactly like its standalone request
+  MessageWriter writer;
+  int numOps;
+  vector<tuple<unsigned char, string, string>> ops;
+  // Where each op starts in writer
+  vector<int64_t> opOffsets;
+
+  // Packs the header and first path.  Ops with a second path pack it next.
+  void beginOp(unsigned char header, const string& from,
+               const string& to = string());
+};
+}  // namespace codefs
+
+#endif  // __CODEFS_COMPOUND_REQUEST_H__
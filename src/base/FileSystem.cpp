@@ -4,12 +4,21 @@
 #include "MessageWriter.hpp"
 
 namespace codefs {
-string FileSystem::serializeFileDataCompressed(const string& path) {
+namespace {
+// Stands in for the file count at the front of a compact payload
+const int COMPACT_LAYOUT = -1;
+
+string childPathOf(const string& parentPath, const string& name) {
+  return (boost::filesystem::path(parentPath) / name).string();
+}
+}  // namespace
+
+string FileSystem::serializeFileData(const string& path, bool compact) {
   std::lock_guard<std::recursive_mutex> lock(mutex);
   MessageWriter writer;
   if (allFileData.find(path) == allFileData.end()) {
     writer.writePrimitive<int>(0);
-  } else {
+  } else if (!compact) {
     const auto& fileData = allFileData.at(path);
     int numChildren = 0;
     for (auto& it : fileData.child_node()) {
@@ -28,25 +37,138 @@ string FileSystem::serializeFileDataCompressed(const string& path) {
         writer.writeProto(childFileData);
       }
     }
+  } else {
+    const auto& fileData = allFileData.at(path);
+    writer.writePrimitive<int>(COMPACT_LAYOUT);
+    FileData parent = fileData;
+    parent.clear_child_node();
+    writer.writeProto(parent);
+    // Siblings tend to share prefixes, so each name only carries the part
+    // that differs from the one before it
+    writer.writePrimitive<int>(fileData.child_node_size());
+    const string* previous = NULL;
+    for (const auto& it : fileData.child_node()) {
+      size_t shared = 0;
+      if (previous) {
+        while (shared < previous->size() && shared < it.size() &&
+               (*previous)[shared] == it[shared]) {
+          shared++;
+        }
+      }
+      writer.writePrimitive<int>(shared);
+      writer.writePrimitive<string>(it.substr(shared));
+      previous = &it;
+    }
+    vector<int> knownChildren;
+    for (int a = 0; a < fileData.child_node_size(); a++) {
+      if (allFileData.count(childPathOf(path, fileData.child_node(a)))) {
+        knownChildren.push_back(a);
+      }
+    }
+    writer.writePrimitive<int>(knownChildren.size());
+    FileData child;
+    for (int a : knownChildren) {
+      string childPath = childPathOf(path, fileData.child_node(a));
+      child = allFileData.at(childPath);
+      if (child.path() == childPath) {
+        child.clear_path();
+      }
+      writer.writePrimitive<int>(a);
+      writer.writeProto(child);
+    }
   }
-  return compressString(writer.finish());
+  return writer.finish();
+}
+
+string FileSystem::serializeFileDataCompressed(
+    const string& path, const CodecOptions& codecOptions, bool compact) {
+  return compressPayload(serializeFileData(path, compact), codecOptions);
 }
 
 void FileSystem::deserializeFileDataCompressed(const string& path,
                                                const string& s) {
   std::lock_guard<std::recursive_mutex> lock(mutex);
   MessageReader reader;
-  reader.load(decompressString(s));
+  reader.load(decompressPayload(s));
   int numFiles = reader.readPrimitive<int>();
+  if (numFiles == COMPACT_LAYOUT) {
+    deserializeCompactFileData(&reader);
+    return;
+  }
   VLOG(1) << "DESERIALIZING " << numFiles << " FILES";
+  FileData fileData;
   for (int a = 0; a < numFiles; a++) {
-    auto fileData = reader.readProto<FileData>();
+    reader.readProto(&fileData);
     VLOG(1) << "GOT FILE: " << fileData.path();
     if (fileData.invalid()) {
       LOGFATAL << "Got an invalid file from the server!";
     }
-    allFileData.erase(fileData.path());
-    allFileData.insert(make_pair(fileData.path(), fileData));
+    // Swap instead of copying, which also hands the map's old entry back to
+    // be cleared and reused by the next parse
+    string filePath = fileData.path();
+    allFileData[filePath].Swap(&fileData);
+  }
+}
+
+void FileSystem::deserializeCompactFileData(MessageReader* reader) {
+  FileData parent;
+  reader->readProto(&parent);
+  if (parent.invalid()) {
+    LOGFATAL << "Got an invalid file from the server!";
+  }
+  int numNames = reader->readPrimitive<int>();
+  string previous;
+  for (int a = 0; a < numNames; a++) {
+    int shared = reader->readPrimitive<int>();
+    if (shared < 0 || shared > int(previous.size())) {
+      LOGFATAL << "Corrupt child name in " << parent.path();
+    }
+    ByteView suffix = reader->readView();
+    previous.resize(shared);
+    previous.append(suffix.data, suffix.size);
+    parent.add_child_node(previous);
+  }
+  int numChildren = reader->readPrimitive<int>();
+  VLOG(1) << "DESERIALIZING " << parent.path() << " WITH " << numChildren
+          << " CHILDREN";
+  FileData child;
+  for (int a = 0; a < numChildren; a++) {
+    int index = reader->readPrimitive<int>();
+    if (index < 0 || index >= parent.child_node_size()) {
+      LOGFATAL << "Corrupt child index in " << parent.path();
+    }
+    reader->readProto(&child);
+    if (!child.has_path()) {
+      child.set_path(childPathOf(parent.path(), parent.child_node(index)));
+    }
+    if (child.invalid()) {
+      LOGFATAL << "Got an invalid file from the server!";
+    }
+    string childPath = child.path();
+    allFileData[childPath].Swap(&child);
+  }
+  string parentPath = parent.path();
+  allFileData[parentPath].Swap(&parent);
+}
+
+vector<string> FileSystem::sampleDirectoryPayloads(int maxSamples) {
+  vector<string> directories;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    for (const auto& it : allFileData) {
+      if (S_ISDIR(it.second.stat_data().mode())) {
+        directories.push_back(it.first);
+      }
+    }
+  }
+  // Each one takes the lock on its own, so other calls get in between
+  vector<string> samples;
+  int64_t stride = max(int64_t(1), int64_t(directories.size()) / maxSamples);
+  for (int64_t a = 0; a < int64_t(directories.size()) &&
+                      int64_t(samples.size()) < maxSamples;
+       a += stride) {
+    samples.push_back(serializeFileData(directories[a], true));
   }
+  return samples;
 }
-}  // namespace codefs
\ No newline at end of file
+}  // namespace codefs
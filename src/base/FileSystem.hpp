@@ -3,6 +3,9 @@
 
 #include "Headers.hpp"
 
+#include "Codec.hpp"
+#include "MessageReader.hpp"
+
 namespace codefs {
 class FileSystem {
  public:
@@ -99,12 +102,29 @@ class FileSystem {
     fileStat->st_ctime = fStat.ctime();
   }
 
-  string serializeFileDataCompressed(const string &path);
+  // Lets the client and server tell whether they hold the same version of a
+  // node
+  static inline uint64_t fingerprint(const FileData &fileData) {
+    return fnv1aHash(fileData.SerializeAsString());
+  }
+
+  // A directory and the children we know about.  The compact layout front
+  // codes the child names and leaves out the child paths, which follow from
+  // them.  Deserializing reads either layout.
+  string serializeFileData(const string &path, bool compact);
+  string serializeFileDataCompressed(const string &path,
+                                     const CodecOptions &codecOptions,
+                                     bool compact);
   void deserializeFileDataCompressed(const string &path, const string &s);
+  // Compact payloads of an even spread of directories, to train a metadata
+  // dictionary on
+  vector<string> sampleDirectoryPayloads(int maxSamples);
 
   unordered_map<string, FileData> allFileData;
 
  protected:
+  void deserializeCompactFileData(MessageReader *reader);
+
   string rootPath;
   shared_ptr<thread> fuseThread;
   std::recursive_mutex mutex;
@@ -40,6 +40,8 @@ extern "C" {
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <stddef.h>
@@ -49,6 +51,7 @@ extern "C" {
 #include <string.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -61,11 +64,15 @@ extern "C" {
 #include <unistd.h>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 #include <deque>
 #include <exception>
 #include <fstream>
 #include <future>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <set>
@@ -73,6 +80,7 @@ extern "C" {
 #include <streambuf>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -124,8 +132,21 @@ using namespace gflags;
 
 using json = nlohmann::json;
 
-// The protocol version supported by this binary
-static const int PROTOCOL_VERSION = 1;
+// The newest rpc wire format this binary speaks.  Peers agree on the lowest
+// of their versions when they say HELLO.
+static const int PROTOCOL_VERSION = 2;
+
+// Optional features, advertised as a bit mask in HELLO.  Only the ones both
+// peers advertise get used.
+enum ProtocolFeature {
+  // Compressed payloads open with a codec byte instead of always being zlib
+  FEATURE_PAYLOAD_CODECS = 1 << 0,
+  // Directory metadata front codes its child names and may be compressed
+  // with a preset dictionary fetched from the server
+  FEATURE_COMPACT_METADATA = 1 << 1,
+};
+static const uint64_t LOCAL_FEATURES =
+    FEATURE_PAYLOAD_CODECS | FEATURE_COMPACT_METADATA;
 
 #define FATAL_IF_FALSE(X) \
   if (((X) == false))     \
@@ -144,10 +165,6 @@ static const int PROTOCOL_VERSION = 1;
 #define FATAL_FAIL(X) \
   if (((X) == -1)) LOGFATAL << "Error: (" << errno << "): " << strerror(errno);
 
-#define DRAW_FROM_UNORDERED(ITERATOR, COLLECTION) \
-  auto ITERATOR = COLLECTION.begin();             \
-  std::advance(ITERATOR, rand() % COLLECTION.size());
-
 template <typename Out>
 inline void split(const std::string& s, char delim, Out result) {
   std::stringstream ss;
@@ -205,9 +222,31 @@ inline int replaceAll(std::string& str, const std::string& from,
   return retval;
 }
 
-/** Compress a STL string using zlib with given compression level and return
+/** 64-bit FNV-1a hash.  Unlike std::hash it gives the same answer on every
+ * platform, so it can be compared across machines. */
+inline uint64_t fnv1aHash(const std::string& s) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline void freeOwnedString(void* data, void* hint) {
+  delete static_cast<std::string*>(hint);
+}
+
+/** Hand a string over to zmq without copying it.  zmq frees the string once
+ * the message is sent. */
+inline zmq::message_t stringToZmqMessage(std::string&& s) {
+  std::string* owned = new std::string(std::move(s));
+  return zmq::message_t(&(*owned)[0], owned->size(), freeOwnedString, owned);
+}
+
+/** Compress a buffer using zlib with given compression level and return
  * the binary data. */
-inline std::string compressString(const std::string& str,
+inline std::string compressString(const char* data, int64_t size,
                                   int compressionlevel = Z_BEST_COMPRESSION) {
   z_stream zs;  // z_stream is zlib's control structure
   memset(&zs, 0, sizeof(zs));
@@ -215,25 +254,16 @@ inline std::string compressString(const std::string& str,
   if (deflateInit(&zs, compressionlevel) != Z_OK)
     throw(std::runtime_error("deflateInit failed while compressing."));
 
-  zs.next_in = (Bytef*)str.data();
-  zs.avail_in = str.size();  // set the z_stream's input
-
-  int ret;
-  char outbuffer[32768];
-  std::string outstring;
-
-  // retrieve the compressed bytes blockwise
-  do {
-    zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-    zs.avail_out = sizeof(outbuffer);
+  zs.next_in = (Bytef*)data;
+  zs.avail_in = size;  // set the z_stream's input
 
-    ret = deflate(&zs, Z_FINISH);
+  // deflateBound is enough room for any input, so one call does it all
+  std::string outstring(deflateBound(&zs, size), '\0');
+  zs.next_out = reinterpret_cast<Bytef*>(&outstring[0]);
+  zs.avail_out = outstring.size();
 
-    if (outstring.size() < zs.total_out) {
-      // append the block to the output string
-      outstring.append(outbuffer, zs.total_out - outstring.size());
-    }
-  } while (ret == Z_OK);
+  int ret = deflate(&zs, Z_FINISH);
+  outstring.resize(zs.total_out);
 
   deflateEnd(&zs);
 
@@ -246,16 +276,23 @@ inline std::string compressString(const std::string& str,
   return outstring;
 }
 
-/** Decompress an STL string using zlib and return the original data. */
-inline std::string decompressString(const std::string& str) {
+/** Compress a STL string using zlib with given compression level and return
+ * the binary data. */
+inline std::string compressString(const std::string& str,
+                                  int compressionlevel = Z_BEST_COMPRESSION) {
+  return compressString(str.data(), str.size(), compressionlevel);
+}
+
+/** Decompress zlib data in a buffer and return the original data. */
+inline std::string decompressString(const char* data, int64_t size) {
   z_stream zs;  // z_stream is zlib's control structure
   memset(&zs, 0, sizeof(zs));
 
   if (inflateInit(&zs) != Z_OK)
     throw(std::runtime_error("inflateInit failed while decompressing."));
 
-  zs.next_in = (Bytef*)str.data();
-  zs.avail_in = str.size();
+  zs.next_in = (Bytef*)data;
+  zs.avail_in = size;
 
   int ret;
   char outbuffer[32768];
@@ -285,4 +322,9 @@ inline std::string decompressString(const std::string& str) {
   return outstring;
 }
 
+/** Decompress an STL string using zlib and return the original data. */
+inline std::string decompressString(const std::string& str) {
+  return decompressString(str.data(), str.size());
+}
+
 #endif
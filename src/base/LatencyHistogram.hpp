@@ -0,0 +1,59 @@
+#ifndef __LATENCY_HISTOGRAM_H__
+#define __LATENCY_HISTOGRAM_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// Latencies in microseconds, bucketed by powers of two.  Bucket i holds
+// samples in [2^i, 2^(i+1)), so percentiles are accurate to within a factor
+// of two, which is plenty to tell a slow link from a slow server.
+class LatencyHistogram {
+ public:
+  static const int NUM_BUCKETS = 32;
+
+  LatencyHistogram() : count(0), sum(0), maximum(0) {
+    memset(buckets, 0, sizeof(buckets));
+  }
+
+  void add(int64_t micros) {
+    micros = max(int64_t(0), micros);
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 && (micros >> (bucket + 1)) > 0) {
+      bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    sum += micros;
+    maximum = max(maximum, micros);
+  }
+
+  int64_t getCount() const { return count; }
+  int64_t getMax() const { return maximum; }
+  int64_t getMean() const { return count ? sum / count : 0; }
+
+  // Upper bound of the bucket holding the given fraction of samples, e.g.
+  // 0.99 for the 99th percentile
+  int64_t getPercentile(double fraction) const {
+    if (count == 0) {
+      return 0;
+    }
+    int64_t target = max(int64_t(1), int64_t(ceil(fraction * count)));
+    int64_t seen = 0;
+    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+      seen += buckets[bucket];
+      if (seen >= target) {
+        return min(maximum, (int64_t(1) << (bucket + 1)) - 1);
+      }
+    }
+    return maximum;
+  }
+
+ protected:
+  int64_t buckets[NUM_BUCKETS];
+  int64_t count;
+  int64_t sum;
+  int64_t maximum;
+};
+}  // namespace codefs
+
+#endif  // __LATENCY_HISTOGRAM_H__
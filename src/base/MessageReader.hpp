@@ -3,71 +3,125 @@
 
 #include "Headers.hpp"
 
+#include "BufferPool.hpp"
+
 namespace codefs {
+// Bytes inside the buffer a MessageReader was loaded with.  Only valid while
+// that buffer is.
+struct ByteView {
+  const char* data;
+  int64_t size;
+
+  ByteView() : data(NULL), size(0) {}
+  ByteView(const char* _data, int64_t _size) : data(_data), size(_size) {}
+
+  string str() const { return string(data, size); }
+};
+
+// Decodes msgpack straight out of the caller's buffer.  The buffer must
+// outlive the reader and anything read from it as a ByteView, unless it was
+// handed over as a temporary string, in which case the reader keeps it.
 class MessageReader {
  public:
-  MessageReader() {}
+  MessageReader() : data(NULL), size(0), offset(0) {}
+
+  ~MessageReader() { BufferPool::give(std::move(ownedBuffer)); }
 
-  inline void load(const string& s) {
-    unpackHandler.remove_nonparsed_buffer();
-    unpackHandler.reserve_buffer(s.size());
-    memcpy(unpackHandler.buffer(), s.c_str(), s.length());
-    unpackHandler.buffer_consumed(s.length());
+  inline void load(const string& s) { load(s.data(), s.size()); }
+
+  // The previous owned buffer goes back to the pool for the next writer
+  inline void load(string&& s) {
+    BufferPool::give(std::move(ownedBuffer));
+    ownedBuffer = std::move(s);
+    load(ownedBuffer.data(), ownedBuffer.size());
+  }
+
+  inline void load(const char* _data, int64_t _size) {
+    data = _data;
+    size = _size;
+    offset = 0;
   }
 
   template <unsigned long i>
   inline void load(const std::array<char, i>& a, int size) {
-    unpackHandler.remove_nonparsed_buffer();
-    unpackHandler.reserve_buffer(size);
-    memcpy(unpackHandler.buffer(), &a[0], size);
-    unpackHandler.buffer_consumed(size);
+    load(&a[0], size);
   }
 
   template <typename T>
   inline T readPrimitive() {
-    msgpack::object_handle oh;
-    FATAL_IF_FALSE(unpackHandler.next(oh));
+    msgpack::object_handle oh = next();
     T t = oh.get().convert();
     return t;
   }
 
   template <typename K, typename V>
   inline map<K, V> readMap() {
-    msgpack::object_handle oh;
-    FATAL_IF_FALSE(unpackHandler.next(oh));
+    msgpack::object_handle oh = next();
     map<K, V> t = oh.get().convert();
     return t;
   }
 
+  // A string or binary field, without copying it out of the buffer
+  inline ByteView readView() {
+    msgpack::object_handle oh = next();
+    const msgpack::object& o = oh.get();
+    if (o.type == msgpack::type::STR) {
+      return ByteView(o.via.str.ptr, o.via.str.size);
+    }
+    if (o.type == msgpack::type::BIN) {
+      return ByteView(o.via.bin.ptr, o.via.bin.size);
+    }
+    throw std::runtime_error("Expected a string");
+  }
+
   template <typename T>
   inline T readClass() {
     T t;
-    string s = readPrimitive<string>();
-    if (s.length() != sizeof(T)) {
+    ByteView view = readView();
+    if (view.size != int64_t(sizeof(T))) {
       throw std::runtime_error("Invalid Class Size");
     }
-    memcpy(&t, &s[0], sizeof(T));
+    memcpy(&t, view.data, sizeof(T));
     return t;
   }
 
   template <typename T>
   inline T readProto() {
     T t;
-    string s = readPrimitive<string>();
-    if (!t.ParseFromString(s)) {
-      throw std::runtime_error("Invalid proto");
-    }
+    readProto(&t);
     return t;
   }
 
-  inline int64_t sizeRemaining() {
-    // TODO: Make sure this is accurate
-    return unpackHandler.nonparsed_size();
+  // Parses into an existing message, which may live in an Arena
+  template <typename T>
+  inline void readProto(T* t) {
+    ByteView view = readView();
+    if (!t->ParseFromArray(view.data, int(view.size))) {
+      throw std::runtime_error("Invalid proto");
+    }
   }
 
+  inline int64_t sizeRemaining() { return size - int64_t(offset); }
+
  protected:
-  msgpack::unpacker unpackHandler;
+  const char* data;
+  int64_t size;
+  size_t offset;
+  string ownedBuffer;
+
+  // Strings and binaries point into our buffer instead of being copied into
+  // the object's zone
+  static bool referenceAll(msgpack::type::object_type, size_t, void*) {
+    return true;
+  }
+
+  inline msgpack::object_handle next() {
+    if (int64_t(offset) >= size) {
+      throw std::runtime_error("Read past the end of the message");
+    }
+    return msgpack::unpack(data, size, offset, &MessageReader::referenceAll);
+  }
 };
 }  // namespace codefs
 
-#endif  // __MESSAGE_READER_H__
\ No newline at end of file
+#endif  // __MESSAGE_READER_H__
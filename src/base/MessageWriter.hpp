@@ -3,18 +3,40 @@
 
 #include "Headers.hpp"
 
+#include "BufferPool.hpp"
+
 namespace codefs {
 class MessageWriter {
  public:
-  MessageWriter() : packHandler(buffer) {}
+  MessageWriter()
+      : buffer(BufferPool::take()), stream(&buffer), packHandler(stream) {}
+
+  ~MessageWriter() { BufferPool::give(std::move(buffer)); }
+
+  // stream points at our buffer, so a copy would write into ours, not its own
+  MessageWriter(const MessageWriter&) = delete;
+  MessageWriter& operator=(const MessageWriter&) = delete;
 
-  inline void start() { buffer.clear(); }
+  inline void start() {
+    if (buffer.capacity() == 0) {
+      // The last message was moved out by finish()
+      buffer = BufferPool::take();
+    } else {
+      buffer.clear();
+    }
+  }
 
   template <typename T>
   inline void writePrimitive(const T& t) {
     packHandler.pack(t);
   }
 
+  // Packs the same bytes as writing them as a string
+  inline void writeBytes(const char* data, int64_t size) {
+    packHandler.pack_str(uint32_t(size));
+    packHandler.pack_str_body(data, uint32_t(size));
+  }
+
   template <typename K, typename V>
   inline void writeMap(const map<K, V>& m) {
     packHandler.pack_map(m.size());
@@ -26,30 +48,56 @@ class MessageWriter {
 
   template <typename T>
   inline void writeClass(const T& t) {
-    string s(sizeof(T), '\0');
-    memcpy(&s[0], &t, sizeof(T));
-    writePrimitive<string>(s);
+    packHandler.pack_str(sizeof(T));
+    packHandler.pack_str_body((const char*)&t, sizeof(T));
   }
 
+  // Packs the same bytes as writing the serialized proto as a string, but
+  // serializes it straight into our buffer behind the length header
   template <typename T>
   inline void writeProto(const T& t) {
-    string s;
-    t.SerializeToString(&s);
-    writePrimitive<string>(s);
+    size_t protoSize = t.ByteSizeLong();
+    packHandler.pack_str(uint32_t(protoSize));
+    size_t offset = buffer.size();
+    buffer.resize(offset + protoSize);
+    t.SerializeWithCachedSizesToArray((uint8_t*)&buffer[offset]);
   }
 
+  // Moves the message out, so it can go to the transport without a copy.
+  // A small message in a big pooled buffer is copied out instead, so a
+  // caller holding on to it until it is acknowledged doesn't pin
+  // up to a megabyte for a few bytes.  We keep the big buffer for the
+  // next message.
   inline string finish() {
-    string s(buffer.data(), buffer.size());
+    if (buffer.capacity() > 2 * buffer.size() + MAX_FINISH_SLACK) {
+      string s(buffer);
+      buffer.clear();
+      return s;
+    }
+    string s;
+    s.swap(buffer);
     start();
     return s;
   }
 
   inline int64_t size() { return buffer.size(); }
+  // Forgets everything written after the first newSize bytes
+  inline void truncate(int64_t newSize) { buffer.resize(newSize); }
 
  protected:
-  msgpack::sbuffer buffer;
-  msgpack::packer<msgpack::sbuffer> packHandler;
+  static const size_t MAX_FINISH_SLACK = 4096;
+
+  // msgpack appends through this straight onto our buffer
+  struct StringStream {
+    explicit StringStream(string* _s) : s(_s) {}
+    void write(const char* data, size_t size) { s->append(data, size); }
+    string* s;
+  };
+
+  string buffer;
+  StringStream stream;
+  msgpack::packer<StringStream> packHandler;
 };
 }  // namespace codefs
 
-#endif  // __MESSAGE_WRITER_H__
\ No newline at end of file
+#endif  // __MESSAGE_WRITER_H__
@@ -0,0 +1,60 @@
+#ifndef __MPSC_QUEUE_H__
+#define __MPSC_QUEUE_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// Unbounded lock-free multi-producer single-consumer queue (Vyukov style).
+// Any thread may push, but only one thread at a time may pop.
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head(new Node()), tail(head.load()) {}
+
+  ~MpscQueue() {
+    T t;
+    while (pop(&t)) {
+    }
+    delete tail;
+  }
+
+  void push(T t) {
+    Node* node = new Node();
+    node->value = std::move(t);
+    Node* prev = head.exchange(node, std::memory_order_acq_rel);
+    // Between the exchange and this store the consumer sees the queue as
+    // empty, which is fine because the producer is about to finish.
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  bool pop(T* t) {
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == NULL) {
+      return false;
+    }
+    *t = std::move(next->value);
+    delete tail;
+    tail = next;
+    return true;
+  }
+
+  bool empty() const {
+    return tail->next.load(std::memory_order_acquire) == NULL;
+  }
+
+ protected:
+  struct Node {
+    Node() : next(NULL) {}
+    atomic<Node*> next;
+    T value;
+  };
+
+  atomic<Node*> head;
+  Node* tail;
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+};
+}  // namespace codefs
+
+#endif  // __MPSC_QUEUE_H__
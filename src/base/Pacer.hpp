@@ -0,0 +1,52 @@
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// Spreads datagrams out over time instead of handing the network a whole
+// window at once, which overflows shallow router buffers on Wi-Fi and turns
+// into the exact losses we are trying to avoid.  The window is sent over one
+// round trip, so the rate follows the measured RTT.
+class Pacer {
+ public:
+  // The unacknowledged bytes we aim to keep on the wire
+  static const int64_t WINDOW_BYTES = 1024 * 1024;
+  // Idle time earns at most this much credit to send back to back
+  static const int64_t MAX_BURST_BYTES = 16 * 1024;
+  // Floor on the RTT so a LAN doesn't ask for an absurd rate
+  static const int64_t MIN_RTT_MICROS = 1000;
+  // Used until the first RTT sample
+  static const int64_t DEFAULT_RTT_MICROS = 100 * 1000;
+
+  Pacer() : bytesPerSecond(0), nextSendTime(0) { setSmoothedRtt(0); }
+
+  void setSmoothedRtt(int64_t smoothedRtt) {
+    if (smoothedRtt <= 0) {
+      smoothedRtt = DEFAULT_RTT_MICROS;
+    } else if (smoothedRtt < MIN_RTT_MICROS) {
+      smoothedRtt = MIN_RTT_MICROS;
+    }
+    bytesPerSecond = WINDOW_BYTES * 1000 * 1000 / smoothedRtt;
+  }
+
+  int64_t getBytesPerSecond() const { return bytesPerSecond; }
+
+  // Microseconds until the next datagram may go out, zero if it may go now
+  int64_t microsUntilSend(int64_t now) const {
+    return max(int64_t(0), nextSendTime - now);
+  }
+
+  void onSend(int64_t bytes, int64_t now) {
+    int64_t burstMicros = MAX_BURST_BYTES * 1000 * 1000 / bytesPerSecond;
+    nextSendTime = max(nextSendTime, now - burstMicros) +
+                   bytes * 1000 * 1000 / bytesPerSecond;
+  }
+
+ protected:
+  int64_t bytesPerSecond;
+  int64_t nextSendTime;
+};
+}  // namespace codefs
+
+#endif  // __PACER_H__
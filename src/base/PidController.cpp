@@ -29,11 +29,15 @@ double PidController::calculate(double setpoint, double pv) {
   // Calculate total output
   double output = Pout + Iout + Dout;
 
-  // Restrict to max/min
-  if (output > _max)
+  // Restrict to max/min.  While pinned, take back this step's integral so
+  // it doesn't wind up and hold the output there long after the error flips.
+  if (output > _max) {
     output = _max;
-  else if (output < _min)
+    if (error > 0) _integral -= error * _dt;
+  } else if (output < _min) {
     output = _min;
+    if (error < 0) _integral -= error * _dt;
+  }
 
   // Save error to previous error
   _pre_error = error;
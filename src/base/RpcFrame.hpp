@@ -0,0 +1,236 @@
+#ifndef __RPC_FRAME_H__
+#define __RPC_FRAME_H__
+
+#include "Headers.hpp"
+
+#include "MessageReader.hpp"
+#include "MessageWriter.hpp"
+#include "RpcId.hpp"
+
+namespace codefs {
+// Version 1 frames are plain msgpack.  Version 2 frames are packed by hand:
+// integers are varints, ids are stored relative to the session id of the
+// endpoint that made them, which leaves a small counter, and times are
+// stored relative to a base time at the front of the frame.  Peers send
+// version 1 until a HELLO exchange shows both sides understand more.
+//
+// Version 1 is not the format of releases before frames were batched: it
+// has per-record headers, priorities and HELLO, none of which older peers
+// understand.  Both ends have to be upgraded together.
+enum RpcWireVersion { WIRE_VERSION_1 = 1, WIRE_VERSION_2 = 2 };
+
+// Version 2 frames open with a byte msgpack never emits, so a receiver can
+// tell the versions apart without any other context
+const unsigned char WIRE_VERSION_2_MARKER = 0xc1;
+
+class FrameWriter {
+ public:
+  FrameWriter() : version(WIRE_VERSION_1), baseTime(0) {}
+
+  // The session tag lets the peer drop frames from a previous incarnation of
+  // this endpoint.  Version 1 frames carry neither it nor the base time.
+  void start(int _version, unsigned char sessionTag, int64_t _baseTime) {
+    version = _version;
+    baseTime = _baseTime;
+    if (version == WIRE_VERSION_1) {
+      writer.start();
+      return;
+    }
+    buffer.clear();
+    buffer.push_back(char(WIRE_VERSION_2_MARKER));
+    buffer.push_back(char(sessionTag));
+    writeSigned(baseTime);
+  }
+
+  int getVersion() const { return version; }
+
+  void writeByte(unsigned char b) {
+    if (version == WIRE_VERSION_1) {
+      writer.writePrimitive<unsigned char>(b);
+    } else {
+      buffer.push_back(char(b));
+    }
+  }
+
+  void writeUnsigned(uint64_t value) {
+    if (version == WIRE_VERSION_1) {
+      writer.writePrimitive<uint64_t>(value);
+      return;
+    }
+    while (value >= 0x80) {
+      buffer.push_back(char((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    buffer.push_back(char(value));
+  }
+
+  void writeSigned(int64_t value) {
+    if (version == WIRE_VERSION_1) {
+      writer.writePrimitive<int64_t>(value);
+      return;
+    }
+    // Zigzag, so small negative numbers stay small too
+    writeUnsigned((uint64_t(value) << 1) ^ uint64_t(value >> 63));
+  }
+
+  void writeId(const RpcId& id, uint64_t base) {
+    if (version == WIRE_VERSION_1) {
+      writer.writeClass<RpcId>(id);
+      return;
+    }
+    writeSigned(id.barrier);
+    writeUnsigned(id.id - base);
+  }
+
+  void writeTime(int64_t time) {
+    if (version == WIRE_VERSION_1) {
+      writer.writePrimitive<int64_t>(time);
+    } else {
+      writeSigned(time - baseTime);
+    }
+  }
+
+  void writeBytes(const string& s) { writeBytes(s.data(), s.length()); }
+
+  // Lets a slice of a bigger buffer go into the frame without first being
+  // copied into a string of its own
+  void writeBytes(const char* data, int64_t size) {
+    if (version == WIRE_VERSION_1) {
+      writer.writeBytes(data, size);
+      return;
+    }
+    writeUnsigned(size);
+    buffer.append(data, size);
+  }
+
+  string finish() {
+    if (version == WIRE_VERSION_1) {
+      return writer.finish();
+    }
+    string s;
+    s.swap(buffer);
+    return s;
+  }
+
+  int64_t size() {
+    return version == WIRE_VERSION_1 ? writer.size() : int64_t(buffer.size());
+  }
+
+ protected:
+  int version;
+  int64_t baseTime;
+  MessageWriter writer;
+  string buffer;
+};
+
+// Throws std::runtime_error on a truncated or malformed frame
+class FrameReader {
+ public:
+  FrameReader()
+      : version(WIRE_VERSION_1),
+        sessionTag(0),
+        baseTime(0),
+        position(NULL),
+        end(NULL) {}
+
+  void load(const char* data, int64_t size) {
+    if (size > 0 && (unsigned char)data[0] == WIRE_VERSION_2_MARKER) {
+      version = WIRE_VERSION_2;
+      position = data + 1;
+      end = data + size;
+      sessionTag = readByte();
+      baseTime = readSigned();
+    } else {
+      version = WIRE_VERSION_1;
+      reader.load(data, size);
+    }
+  }
+
+  int getVersion() const { return version; }
+  // Only set for version 2 frames
+  unsigned char getSessionTag() const { return sessionTag; }
+
+  bool hasMore() {
+    if (version == WIRE_VERSION_1) {
+      return reader.sizeRemaining() > 0;
+    }
+    return position < end;
+  }
+
+  unsigned char readByte() {
+    if (version == WIRE_VERSION_1) {
+      return reader.readPrimitive<unsigned char>();
+    }
+    need(1);
+    return (unsigned char)*(position++);
+  }
+
+  uint64_t readUnsigned() {
+    if (version == WIRE_VERSION_1) {
+      return reader.readPrimitive<uint64_t>();
+    }
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char b = readByte();
+      value |= uint64_t(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return value;
+      }
+    }
+    throw std::runtime_error("Varint is too long");
+  }
+
+  int64_t readSigned() {
+    if (version == WIRE_VERSION_1) {
+      return reader.readPrimitive<int64_t>();
+    }
+    uint64_t value = readUnsigned();
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+  }
+
+  RpcId readId(uint64_t base) {
+    if (version == WIRE_VERSION_1) {
+      return reader.readClass<RpcId>();
+    }
+    RpcId id;
+    id.barrier = readSigned();
+    id.id = base + readUnsigned();
+    return id;
+  }
+
+  int64_t readTime() {
+    if (version == WIRE_VERSION_1) {
+      return reader.readPrimitive<int64_t>();
+    }
+    return baseTime + readSigned();
+  }
+
+  string readBytes() {
+    if (version == WIRE_VERSION_1) {
+      return reader.readPrimitive<string>();
+    }
+    uint64_t length = readUnsigned();
+    need(length);
+    string s(position, length);
+    position += length;
+    return s;
+  }
+
+ protected:
+  int version;
+  unsigned char sessionTag;
+  int64_t baseTime;
+  MessageReader reader;
+  // The unread part of a version 2 frame, which stays in the caller's buffer
+  const char* position;
+  const char* end;
+
+  void need(uint64_t bytes) {
+    if (bytes > uint64_t(end - position)) {
+      throw std::runtime_error("Truncated frame");
+    }
+  }
+};
+}  // namespace codefs
+
+#endif  // __RPC_FRAME_H__
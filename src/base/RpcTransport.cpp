@@ -0,0 +1,46 @@
+#include "RpcTransport.hpp"
+
+#include "ShmBiDirectionalRpc.hpp"
+#include "ShmRpcRouter.hpp"
+#include "UdpBiDirectionalRpc.hpp"
+#include "UdpRpcRouter.hpp"
+#include "ZmqBiDirectionalRpc.hpp"
+#include "ZmqRpcRouter.hpp"
+
+namespace codefs {
+namespace {
+bool isShmAddress(const string& address) {
+  return address.find("shm://") == 0;
+}
+
+bool isUdpAddress(const string& address) {
+  return address.find("udp://") == 0;
+}
+}  // namespace
+
+shared_ptr<RpcEndpoint> createRpcEndpoint(const string& address, bool bind) {
+  if (isShmAddress(address)) {
+    if (bind) {
+      LOGFATAL << "Shared memory only has a router side, use createRpcRouter";
+    }
+    return shared_ptr<RpcEndpoint>(new ShmBiDirectionalRpc(address));
+  }
+  if (isUdpAddress(address)) {
+    if (bind) {
+      LOGFATAL << "Udp only has a router side, use createRpcRouter";
+    }
+    return shared_ptr<RpcEndpoint>(new UdpBiDirectionalRpc(address));
+  }
+  return shared_ptr<RpcEndpoint>(new ZmqBiDirectionalRpc(address, bind));
+}
+
+shared_ptr<RpcRouter> createRpcRouter(const string& address) {
+  if (isShmAddress(address)) {
+    return shared_ptr<RpcRouter>(new ShmRpcRouter(address));
+  }
+  if (isUdpAddress(address)) {
+    return shared_ptr<RpcRouter>(new UdpRpcRouter(address));
+  }
+  return shared_ptr<RpcRouter>(new ZmqRpcRouter(address));
+}
+}  // namespace codefs
@@ -0,0 +1,62 @@
+#ifndef __RPC_TRANSPORT_H__
+#define __RPC_TRANSPORT_H__
+
+#include "BiDirectionalRpc.hpp"
+
+namespace codefs {
+// A BiDirectionalRpc that owns its transport, talking to a single peer
+class RpcEndpoint : public BiDirectionalRpc {
+ public:
+  virtual ~RpcEndpoint() {}
+  virtual void shutdown() = 0;
+  // Processes incoming frames and flushes everything queued to the
+  // transport, including a partially filled frame.  Once start() is called,
+  // only the I/O thread may call this.
+  virtual void update() = 0;
+  // Hands the transport to a dedicated I/O thread that runs update() and
+  // heartbeat() until shutdown.
+  virtual void start() = 0;
+  // Drops the connection and dials again, keeping every request, reply and
+  // cache.  Does nothing when bound.
+  virtual void reconnect() = 0;
+};
+
+// The rpc state for one peer of an RpcRouter
+class RpcSession : public BiDirectionalRpc {
+ public:
+  explicit RpcSession(const string& _identity) : identity(_identity) {}
+  virtual ~RpcSession() {}
+
+  const string& getIdentity() const { return identity; }
+
+ protected:
+  // Unique among the router's peers
+  string identity;
+};
+
+// Listens on an address and keeps a separate session, with its own requests,
+// replies and flow control, for every peer that connects.
+class RpcRouter {
+ public:
+  virtual ~RpcRouter() {}
+  virtual void start() = 0;
+  virtual void shutdown() = 0;
+
+  virtual vector<shared_ptr<RpcSession>> getSessions() = 0;
+  // Drops all state for the peer.  If it talks to us again it starts over
+  // with a new session.
+  virtual void closeSession(const string& identity) = 0;
+
+  // Blocks until any session has a new incoming request or reply, or until
+  // the timeout elapses.  Returns true if there may be work.
+  virtual bool waitForIncoming(int64_t timeoutMs) = 0;
+};
+
+// The transport is picked from the address.  shm://<directory> uses shared
+// memory rings for peers on the same host, udp://<host>:<port> sends paced
+// datagrams, and anything else goes to zmq.
+shared_ptr<RpcEndpoint> createRpcEndpoint(const string& address, bool bind);
+shared_ptr<RpcRouter> createRpcRouter(const string& address);
+}  // namespace codefs
+
+#endif  // __RPC_TRANSPORT_H__
@@ -0,0 +1,211 @@
+#include "ShmBiDirectionalRpc.hpp"
+
+#include "TimeHandler.hpp"
+
+namespace codefs {
+namespace {
+// Same as the zmq client: the router heartbeats every few seconds, so this
+// much silence means it went away
+const int64_t RECONNECT_AFTER_SILENCE_MICROS = 10 * 1000 * 1000;
+const int64_t HEARTBEAT_INTERVAL_MS = 3000;
+// How often to knock on the router's door until it answers
+const int64_t ANNOUNCE_RETRY_MS = 100;
+}  // namespace
+
+ShmBiDirectionalRpc::ShmBiDirectionalRpc(const string& address)
+    : RpcEndpoint(),
+      directory(address.substr(string("shm://").length())),
+      generation(0),
+      announced(false),
+      running(false),
+      reconnectRequested(false),
+      lastReceiveTime(TimeHandler::currentTimeMicros()) {
+  std::ostringstream ss;
+  ss << std::hex << getSessionId();
+  identity = ss.str();
+  LOG(INFO) << "Connecting to shared memory in: " << directory;
+  connectChannel();
+}
+
+ShmBiDirectionalRpc::~ShmBiDirectionalRpc() {
+  if (channel.get()) {
+    LOGFATAL << "Tried to destroy an RPC instance without calling shutdown";
+  }
+}
+
+void ShmBiDirectionalRpc::shutdown() {
+  if (ioThread.get()) {
+    running = false;
+    wakeupPipe.wakeup();
+    ioThread->join();
+    ioThread.reset();
+  }
+  channel.reset();
+}
+
+void ShmBiDirectionalRpc::start() {
+  if (ioThread.get()) {
+    LOGFATAL << "Tried to start the io thread twice";
+  }
+  running = true;
+  ioThread.reset(new thread(&ShmBiDirectionalRpc::runIoThread, this));
+}
+
+void ShmBiDirectionalRpc::reconnect() {
+  if (ioThread.get()) {
+    // The channel belongs to the io thread
+    reconnectRequested = true;
+    wakeupPipe.wakeup();
+    return;
+  }
+  connectChannel();
+}
+
+void ShmBiDirectionalRpc::connectChannel() {
+  generation++;
+  std::ostringstream id;
+  id << identity << "-" << generation;
+  // Drop the old channel first so its files are gone if the router never
+  // picked it up
+  channel.reset();
+  channel.reset(new ShmChannel(directory, id.str(), true));
+  announced = false;
+  announceChannel();
+  lastReceiveTime = TimeHandler::currentTimeMicros();
+}
+
+void ShmBiDirectionalRpc::announceChannel() {
+  string listenPath = directory + "/listen";
+  int fd = ::open(listenPath.c_str(), O_WRONLY | O_NONBLOCK);
+  if (fd < 0) {
+    if (errno != ENXIO && errno != ENOENT) {
+      FATAL_FAIL(fd);
+    }
+    // No router is listening yet
+    VLOG(1) << "Router is not listening on " << listenPath;
+    return;
+  }
+  // Short enough to be written atomically next to other clients' lines
+  string line = channel->getId() + "\n";
+  int rc = ::write(fd, line.c_str(), line.length());
+  ::close(fd);
+  if (rc < 0 && errno != EAGAIN) {
+    FATAL_FAIL(rc);
+  }
+  announced = (rc == int(line.length()));
+}
+
+void ShmBiDirectionalRpc::runIoThread() {
+  auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+  while (running) {
+    resendOverdueMessages();
+    receiveFrames();
+    if (reconnectRequested.exchange(false) ||
+        TimeHandler::currentTimeMicros() - lastReceiveTime >
+            RECONNECT_AFTER_SILENCE_MICROS) {
+      connectChannel();
+    }
+    if (!announced) {
+      announceChannel();
+    }
+
+    int64_t flushMicros = microsUntilFlush();
+    if (flushMicros > 0 && flushMicros < 1000) {
+      usleep(flushMicros);
+      flushMicros = 0;
+    }
+    if (flushMicros == 0) {
+      flushPendingFrame();
+    }
+    flushOutgoingFrames();
+
+    auto msSinceLastHeartbeat =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
+            .count();
+    if (msSinceLastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
+      heartbeat();
+      lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      continue;
+    }
+
+    int64_t timeoutMs = HEARTBEAT_INTERVAL_MS - msSinceLastHeartbeat;
+    if (!announced) {
+      timeoutMs = min(timeoutMs, ANNOUNCE_RETRY_MS);
+    }
+    int64_t resendMicros = microsUntilNextResend();
+    if (resendMicros >= 0) {
+      timeoutMs = min(timeoutMs, (resendMicros + 999) / 1000);
+    }
+    flushMicros = microsUntilFlush();
+    if (flushMicros >= 0) {
+      timeoutMs = min(timeoutMs, (flushMicros + 999) / 1000);
+    }
+    struct pollfd items[] = {
+        {channel->readFd(), POLLIN, 0},
+        {wakeupPipe.readFd(), POLLIN, 0},
+    };
+    int rc = ::poll(items, 2, int(timeoutMs));
+    if (rc < 0 && errno != EINTR) {
+      FATAL_FAIL(rc);
+    }
+    if (items[1].revents & POLLIN) {
+      wakeupPipe.drain();
+    }
+  }
+  flushPendingFrame();
+  flushOutgoingFrames();
+}
+
+void ShmBiDirectionalRpc::update() {
+  resendOverdueMessages();
+  receiveFrames();
+  if (!announced) {
+    announceChannel();
+  }
+  flushPendingFrame();
+  flushOutgoingFrames();
+}
+
+void ShmBiDirectionalRpc::receiveFrames() {
+  channel->drain();
+  string message;
+  while (channel->read(&message)) {
+    VLOG(1) << "Got message with size " << message.size() << endl;
+    lastReceiveTime = TimeHandler::currentTimeMicros();
+    BiDirectionalRpc::receive(message.data(), message.size());
+  }
+  if (!channel->isOpen()) {
+    // The router drops its end too, start over on a fresh channel
+    connectChannel();
+  }
+}
+
+void ShmBiDirectionalRpc::send(string message, RpcPriority priority) {
+  VLOG(1) << "SENDING " << message.length();
+  if (message.length() == 0) {
+    LOGFATAL << "Invalid message size";
+  }
+  outgoingFrames[priority].push(std::move(message));
+  wakeupPipe.wakeup();
+}
+
+void ShmBiDirectionalRpc::flushOutgoingFrames() {
+  string message;
+  while (true) {
+    int priority = 0;
+    while (priority < NUM_PRIORITIES &&
+           !outgoingFrames[priority].pop(&message)) {
+      priority++;
+    }
+    if (priority == NUM_PRIORITIES) {
+      return;
+    }
+    if (!channel->write(message)) {
+      // The router is behind.  Treat it like a lost packet, the frame is
+      // retransmitted if it mattered.
+      VLOG(1) << "Ring full, dropping frame of " << message.length();
+    }
+  }
+}
+}  // namespace codefs
@@ -0,0 +1,52 @@
+#ifndef __SHM_BIDIRECTIONAL_RPC_H__
+#define __SHM_BIDIRECTIONAL_RPC_H__
+
+#include "MpscQueue.hpp"
+#include "RpcTransport.hpp"
+#include "ShmChannel.hpp"
+#include "WakeupPipe.hpp"
+
+namespace codefs {
+// The client end of a shared memory connection to a ShmRpcRouter on the
+// same host.  The address is shm://<directory>, the directory the router
+// listens in.
+class ShmBiDirectionalRpc : public RpcEndpoint {
+ public:
+  explicit ShmBiDirectionalRpc(const string& address);
+  virtual ~ShmBiDirectionalRpc();
+  virtual void shutdown();
+  virtual void update();
+  virtual void start();
+  // Builds a fresh channel.  The router hands our session over to it
+  // because we keep the same identity.
+  virtual void reconnect();
+
+ protected:
+  string directory;
+  // Our session id in hex, which the router keys sessions on
+  string identity;
+  // Bumped for every channel so their files never collide
+  int generation;
+  // Only touched by whoever calls update()
+  shared_ptr<ShmChannel> channel;
+  // Whether the router has been told about the current channel
+  bool announced;
+
+  MpscQueue<string> outgoingFrames[NUM_PRIORITIES];
+  shared_ptr<thread> ioThread;
+  atomic<bool> running;
+  atomic<bool> reconnectRequested;
+  int64_t lastReceiveTime;
+  WakeupPipe wakeupPipe;
+
+  void connectChannel();
+  void announceChannel();
+  void runIoThread();
+  void receiveFrames();
+  void flushOutgoingFrames();
+  virtual void onFramePending() { wakeupPipe.wakeup(); }
+  virtual void send(string message, RpcPriority priority);
+};
+}  // namespace codefs
+
+#endif  // __SHM_BIDIRECTIONAL_RPC_H__
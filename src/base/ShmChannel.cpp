@@ -0,0 +1,223 @@
+#include "ShmChannel.hpp"
+
+namespace codefs {
+namespace {
+// Every frame in a ring is prefixed with its length
+const uint64_t FRAME_HEADER_SIZE = sizeof(uint32_t);
+
+// The headers are padded out to a cache line each so the two sides don't
+// fight over them
+const size_t RING_HEADER_SIZE = 128;
+
+void copyIntoRing(char* data, uint64_t capacity, uint64_t position,
+                  const char* source, uint64_t length) {
+  uint64_t offset = position % capacity;
+  uint64_t firstPart = min(length, capacity - offset);
+  memcpy(data + offset, source, firstPart);
+  memcpy(data, source + firstPart, length - firstPart);
+}
+
+void copyOutOfRing(const char* data, uint64_t capacity, uint64_t position,
+                   char* dest, uint64_t length) {
+  uint64_t offset = position % capacity;
+  uint64_t firstPart = min(length, capacity - offset);
+  memcpy(dest, data + offset, firstPart);
+  memcpy(dest + firstPart, data, length - firstPart);
+}
+
+int openFifo(const string& path) {
+  // Opening read-write never blocks waiting for the other end and keeps the
+  // fifo from reporting EOF while the peer is away
+  int fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd < 0 && errno != ENOENT) {
+    FATAL_FAIL(fd);
+  }
+  return fd;
+}
+}  // namespace
+
+ShmChannel::ShmChannel(const string& _directory, const string& _id,
+                       bool create, uint64_t _capacity)
+    : directory(_directory),
+      id(_id),
+      creator(create),
+      mappingSize(0),
+      mapping(NULL),
+      capacity(0),
+      corrupt(false),
+      incoming(NULL),
+      incomingData(NULL),
+      outgoing(NULL),
+      outgoingData(NULL),
+      incomingFd(-1),
+      outgoingFd(-1) {
+  static_assert(sizeof(ShmRingHeader) <= RING_HEADER_SIZE,
+                "Ring header does not fit");
+  int fd;
+  if (creator) {
+    mappingSize = 2 * (RING_HEADER_SIZE + _capacity);
+    FATAL_FAIL(::mkfifo(clientFifoPath().c_str(), 0600));
+    FATAL_FAIL(::mkfifo(serverFifoPath().c_str(), 0600));
+    fd = ::open(ringPath().c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    FATAL_FAIL(fd);
+    FATAL_FAIL(::ftruncate(fd, mappingSize));
+  } else {
+    fd = ::open(ringPath().c_str(), O_RDWR);
+    if (fd < 0 && errno == ENOENT) {
+      // The client already gave up on this channel
+      return;
+    }
+    FATAL_FAIL(fd);
+    struct stat fileStat;
+    FATAL_FAIL(::fstat(fd, &fileStat));
+    mappingSize = fileStat.st_size;
+    if (mappingSize < 2 * (RING_HEADER_SIZE + FRAME_HEADER_SIZE) ||
+        mappingSize % 2) {
+      LOG(ERROR) << ringPath() << " has a bad size: " << mappingSize;
+      ::close(fd);
+      return;
+    }
+  }
+  incomingFd = openFifo(creator ? clientFifoPath() : serverFifoPath());
+  outgoingFd = openFifo(creator ? serverFifoPath() : clientFifoPath());
+  if (incomingFd < 0 || outgoingFd < 0) {
+    ::close(fd);
+    return;
+  }
+  void* address =
+      ::mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (address == MAP_FAILED) {
+    LOGFATAL << "Could not map " << ringPath() << ": " << strerror(errno);
+  }
+  mapping = (char*)address;
+
+  size_t ringSize = mappingSize / 2;
+  capacity = ringSize - RING_HEADER_SIZE;
+  ShmRingHeader* toServer = (ShmRingHeader*)mapping;
+  ShmRingHeader* toClient = (ShmRingHeader*)(mapping + ringSize);
+  if (creator) {
+    for (ShmRingHeader* header : {toServer, toClient}) {
+      new (header) ShmRingHeader();
+      header->head = 0;
+      header->tail = 0;
+      header->capacity = capacity;
+      header->wakeupPending = 0;
+    }
+  }
+  incoming = creator ? toClient : toServer;
+  outgoing = creator ? toServer : toClient;
+  incomingData = ((char*)incoming) + RING_HEADER_SIZE;
+  outgoingData = ((char*)outgoing) + RING_HEADER_SIZE;
+  if (incoming->capacity != capacity || outgoing->capacity != capacity) {
+    markCorrupt("ring capacity does not match the file");
+  }
+
+  if (!creator) {
+    // Both sides hold everything open now, so the names can go
+    unlinkFiles();
+  }
+}
+
+ShmChannel::~ShmChannel() {
+  if (creator) {
+    // In case the server never attached
+    unlinkFiles();
+  }
+  if (incomingFd >= 0) {
+    ::close(incomingFd);
+  }
+  if (outgoingFd >= 0) {
+    ::close(outgoingFd);
+  }
+  if (mapping) {
+    FATAL_FAIL(::munmap(mapping, mappingSize));
+  }
+}
+
+bool ShmChannel::write(const string& frame) {
+  if (corrupt) {
+    return false;
+  }
+  uint64_t length = frame.length();
+  if (length + FRAME_HEADER_SIZE > capacity) {
+    LOGFATAL << "Frame of " << length << " bytes can never fit in the ring";
+  }
+  uint64_t head = outgoing->head.load(std::memory_order_acquire);
+  uint64_t tail = outgoing->tail.load(std::memory_order_relaxed);
+  if (tail - head > capacity) {
+    markCorrupt("consumer moved past the producer");
+    return false;
+  }
+  if (capacity - (tail - head) < length + FRAME_HEADER_SIZE) {
+    return false;
+  }
+  uint32_t length32 = uint32_t(length);
+  copyIntoRing(outgoingData, capacity, tail, (const char*)&length32,
+               FRAME_HEADER_SIZE);
+  copyIntoRing(outgoingData, capacity, tail + FRAME_HEADER_SIZE, frame.data(),
+               length);
+  outgoing->tail.store(tail + FRAME_HEADER_SIZE + length,
+                       std::memory_order_release);
+
+  if (outgoing->wakeupPending.exchange(1) == 0) {
+    char c = 0;
+    int rc = ::write(outgoingFd, &c, 1);
+    if (rc < 0 && errno != EAGAIN) {
+      FATAL_FAIL(rc);
+    }
+  }
+  return true;
+}
+
+bool ShmChannel::read(string* frame) {
+  if (corrupt) {
+    return false;
+  }
+  uint64_t tail = incoming->tail.load(std::memory_order_acquire);
+  uint64_t head = incoming->head.load(std::memory_order_relaxed);
+  if (head == tail) {
+    return false;
+  }
+  uint64_t available = tail - head;
+  if (available < FRAME_HEADER_SIZE || available > capacity) {
+    markCorrupt("producer published a bad tail");
+    return false;
+  }
+  uint32_t length;
+  copyOutOfRing(incomingData, capacity, head, (char*)&length,
+                FRAME_HEADER_SIZE);
+  if (length + FRAME_HEADER_SIZE > available) {
+    // Don't allocate, or copy, anything on the word of a bad length
+    markCorrupt("frame runs past the tail");
+    return false;
+  }
+  frame->resize(length);
+  copyOutOfRing(incomingData, capacity, head + FRAME_HEADER_SIZE, &(*frame)[0],
+                length);
+  incoming->head.store(head + FRAME_HEADER_SIZE + length,
+                       std::memory_order_release);
+  return true;
+}
+
+void ShmChannel::drain() {
+  incoming->wakeupPending = 0;
+  char buf[64];
+  while (::read(incomingFd, buf, sizeof(buf)) > 0) {
+  }
+}
+
+void ShmChannel::markCorrupt(const string& reason) {
+  LOG(ERROR) << "Channel " << id << " is corrupt, " << reason;
+  corrupt = true;
+}
+
+void ShmChannel::unlinkFiles() {
+  for (const string& path :
+       {ringPath(), clientFifoPath(), serverFifoPath()}) {
+    if (::unlink(path.c_str()) < 0 && errno != ENOENT) {
+      LOGFATAL << "Could not remove " << path << ": " << strerror(errno);
+    }
+  }
+}
+}  // namespace codefs
@@ -0,0 +1,77 @@
+#ifndef __SHM_CHANNEL_H__
+#define __SHM_CHANNEL_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// One direction of a ShmChannel.  head and tail only ever grow, the byte
+// they point at is the value modulo capacity.  Only the consumer moves head
+// and only the producer moves tail.
+struct ShmRingHeader {
+  atomic<uint64_t> head;
+  atomic<uint64_t> tail;
+  uint64_t capacity;
+  // Set once the producer has poked the consumer's fifo, cleared by the
+  // consumer before it drains, so a burst of frames costs one syscall
+  atomic<uint32_t> wakeupPending;
+};
+
+// A pair of single producer, single consumer rings in a memory mapped file,
+// one for each direction, plus a named fifo per side to wake the reader out
+// of poll().  The client creates the files, the server attaches and unlinks
+// them, after which they live exactly as long as both mappings.
+class ShmChannel {
+ public:
+  static const uint64_t DEFAULT_CAPACITY = 4 * 1024 * 1024;
+
+  // Creates <directory>/<id>.ring and its fifos when creating, else attaches
+  // to the ones a client made
+  ShmChannel(const string& directory, const string& id, bool create,
+             uint64_t _capacity = DEFAULT_CAPACITY);
+  ~ShmChannel();
+
+  const string& getId() const { return id; }
+  // False if the client removed the channel before we could attach, or if
+  // the peer has scribbled over it.  Either way it has to be replaced.
+  bool isOpen() const { return mapping != NULL && !corrupt; }
+
+  // Copies the frame into the outgoing ring and wakes the peer.  Returns
+  // false if the ring is too full to take it.
+  bool write(const string& frame);
+  // Pops the next frame from the incoming ring, false if there is none.
+  // Nothing in the ring is trusted, a frame that doesn't fit in what the
+  // peer published marks the channel corrupt.
+  bool read(string* frame);
+
+  // Poll this for readability to learn about new incoming frames
+  int readFd() const { return incomingFd; }
+  // Call before reading so a wakeup that races with us is not lost
+  void drain();
+
+ protected:
+  string directory;
+  string id;
+  bool creator;
+  size_t mappingSize;
+  char* mapping;
+  // Our own copy, the one in the ring header could be overwritten
+  uint64_t capacity;
+  bool corrupt;
+  ShmRingHeader* incoming;
+  char* incomingData;
+  ShmRingHeader* outgoing;
+  char* outgoingData;
+  int incomingFd;
+  int outgoingFd;
+
+  string ringPath() const { return directory + "/" + id + ".ring"; }
+  // The fifo that the client reads from
+  string clientFifoPath() const { return directory + "/" + id + ".c"; }
+  // The fifo that the server reads from
+  string serverFifoPath() const { return directory + "/" + id + ".s"; }
+  void unlinkFiles();
+  void markCorrupt(const string& reason);
+};
+}  // namespace codefs
+
+#endif  // __SHM_CHANNEL_H__
@@ -0,0 +1,308 @@
+#include "ShmRpcRouter.hpp"
+
+#include "TimeHandler.hpp"
+
+namespace codefs {
+namespace {
+// Peers heartbeat every few seconds, so a session this quiet is gone
+const int64_t SESSION_IDLE_TIMEOUT_MICROS = 60 * 1000 * 1000;
+const int64_t HEARTBEAT_INTERVAL_MS = 3000;
+}  // namespace
+
+ShmRouterSession::ShmRouterSession(ShmRpcRouter* _router,
+                                   const string& _identity)
+    : RpcSession(_identity),
+      router(_router),
+      lastReceiveTime(TimeHandler::currentTimeMicros()) {}
+
+void ShmRouterSession::onFramePending() { router->wakeupPipe.wakeup(); }
+
+void ShmRouterSession::onIncoming() { router->notifyIncoming(); }
+
+void ShmRouterSession::send(string message, RpcPriority priority) {
+  VLOG(1) << "SENDING " << message.length();
+  if (message.length() == 0) {
+    LOGFATAL << "Invalid message size";
+  }
+  router->queueFrame(identity, std::move(message), priority);
+}
+
+ShmRpcRouter::ShmRpcRouter(const string& address)
+    : directory(address.substr(string("shm://").length())),
+      running(false),
+      incomingPending(false) {
+  LOG(INFO) << "Listening for shared memory clients in: " << directory;
+  if (::mkdir(directory.c_str(), 0700) < 0 && errno != EEXIST) {
+    LOGFATAL << "Could not create " << directory << ": " << strerror(errno);
+  }
+  // A fifo left behind by a router that crashed has nobody reading it
+  ::unlink(listenPath().c_str());
+  FATAL_FAIL(::mkfifo(listenPath().c_str(), 0600));
+  listenFd = ::open(listenPath().c_str(), O_RDWR | O_NONBLOCK);
+  FATAL_FAIL(listenFd);
+}
+
+ShmRpcRouter::~ShmRpcRouter() {
+  if (listenFd >= 0) {
+    LOGFATAL << "Tried to destroy a router without calling shutdown";
+  }
+}
+
+void ShmRpcRouter::start() {
+  if (ioThread.get()) {
+    LOGFATAL << "Tried to start the io thread twice";
+  }
+  running = true;
+  ioThread.reset(new thread(&ShmRpcRouter::runIoThread, this));
+}
+
+void ShmRpcRouter::shutdown() {
+  if (ioThread.get()) {
+    running = false;
+    wakeupPipe.wakeup();
+    ioThread->join();
+    ioThread.reset();
+  }
+  ::unlink(listenPath().c_str());
+  ::close(listenFd);
+  listenFd = -1;
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  sessions.clear();
+}
+
+vector<shared_ptr<RpcSession>> ShmRpcRouter::getSessions() {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  vector<shared_ptr<RpcSession>> retval;
+  retval.reserve(sessions.size());
+  for (const auto& it : sessions) {
+    retval.push_back(it.second);
+  }
+  return retval;
+}
+
+vector<shared_ptr<ShmRouterSession>> ShmRpcRouter::getShmSessions() {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  vector<shared_ptr<ShmRouterSession>> retval;
+  retval.reserve(sessions.size());
+  for (const auto& it : sessions) {
+    retval.push_back(it.second);
+  }
+  return retval;
+}
+
+void ShmRpcRouter::closeSession(const string& identity) {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  if (sessions.erase(identity)) {
+    LOG(INFO) << "Closed session, " << sessions.size() << " left";
+  }
+}
+
+bool ShmRpcRouter::waitForIncoming(int64_t timeoutMs) {
+  unique_lock<std::mutex> guard(incomingMutex);
+  bool result =
+      incomingCondition.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+                                 [this] { return incomingPending; });
+  incomingPending = false;
+  return result;
+}
+
+void ShmRpcRouter::notifyIncoming() {
+  lock_guard<std::mutex> guard(incomingMutex);
+  incomingPending = true;
+  incomingCondition.notify_all();
+}
+
+void ShmRpcRouter::queueFrame(const string& identity, string message,
+                              RpcPriority priority) {
+  outgoingFrames[priority].push(make_pair(identity, std::move(message)));
+  wakeupPipe.wakeup();
+}
+
+void ShmRpcRouter::runIoThread() {
+  auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+  while (running) {
+    for (auto& session : getShmSessions()) {
+      session->resendOverdueMessages();
+    }
+    acceptChannels();
+    receiveFrames();
+    expireIdleSessions();
+    flushPendingFrames();
+    flushOutgoingFrames();
+
+    auto msSinceLastHeartbeat =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
+            .count();
+    if (msSinceLastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
+      for (auto& session : getShmSessions()) {
+        session->heartbeat();
+      }
+      lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      continue;
+    }
+
+    int64_t timeoutMs = HEARTBEAT_INTERVAL_MS - msSinceLastHeartbeat;
+    auto currentSessions = getShmSessions();
+    vector<struct pollfd> items;
+    items.push_back({listenFd, POLLIN, 0});
+    items.push_back({wakeupPipe.readFd(), POLLIN, 0});
+    for (auto& session : currentSessions) {
+      int64_t resendMicros = session->microsUntilNextResend();
+      if (resendMicros >= 0) {
+        timeoutMs = min(timeoutMs, (resendMicros + 999) / 1000);
+      }
+      int64_t flushMicros = session->microsUntilFlush();
+      if (flushMicros >= 0) {
+        timeoutMs = min(timeoutMs, (flushMicros + 999) / 1000);
+      }
+      if (session->channel.get()) {
+        items.push_back({session->channel->readFd(), POLLIN, 0});
+      }
+    }
+    int rc = ::poll(&items[0], items.size(), int(timeoutMs));
+    if (rc < 0 && errno != EINTR) {
+      FATAL_FAIL(rc);
+    }
+    if (items[1].revents & POLLIN) {
+      wakeupPipe.drain();
+    }
+  }
+  for (auto& session : getShmSessions()) {
+    session->flushPendingFrame();
+  }
+  flushOutgoingFrames();
+}
+
+void ShmRpcRouter::acceptChannels() {
+  char buf[1024];
+  while (true) {
+    int rc = ::read(listenFd, buf, sizeof(buf));
+    if (rc < 0 && errno != EAGAIN) {
+      FATAL_FAIL(rc);
+    }
+    if (rc <= 0) {
+      break;
+    }
+    listenBuffer.append(buf, rc);
+  }
+
+  size_t newline;
+  while ((newline = listenBuffer.find('\n')) != string::npos) {
+    string channelId = listenBuffer.substr(0, newline);
+    listenBuffer.erase(0, newline + 1);
+    // Channel ids are <identity>-<generation>, and name files in our
+    // directory, so anything else could point us somewhere else
+    size_t dash = channelId.rfind('-');
+    if (dash == string::npos || dash == 0 ||
+        channelId.find('/') != string::npos) {
+      LOG(ERROR) << "Ignoring bad channel id: " << channelId;
+      continue;
+    }
+    string identity = channelId.substr(0, dash);
+    shared_ptr<ShmChannel> channel(
+        new ShmChannel(directory, channelId, false));
+    if (!channel->isOpen()) {
+      LOG(INFO) << "Channel " << channelId
+                << " went away or is corrupt, skipping it";
+      continue;
+    }
+
+    lock_guard<recursive_mutex> guard(sessionsMutex);
+    auto it = sessions.find(identity);
+    shared_ptr<ShmRouterSession> session;
+    if (it == sessions.end()) {
+      session.reset(new ShmRouterSession(this, identity));
+      sessions[identity] = session;
+      LOG(INFO) << "Got a new client, " << sessions.size() << " connected";
+    } else {
+      // The client came back on a new channel, e.g. after we went quiet.
+      // Like ZMQ_ROUTER_HANDOVER, the new channel replaces the old one.
+      session = it->second;
+      LOG(INFO) << "Client reconnected on " << channelId;
+    }
+    session->channel = channel;
+    session->lastReceiveTime = TimeHandler::currentTimeMicros();
+  }
+}
+
+void ShmRpcRouter::receiveFrames() {
+  string message;
+  for (auto& session : getShmSessions()) {
+    if (!session->channel.get()) {
+      continue;
+    }
+    session->channel->drain();
+    while (session->channel->read(&message)) {
+      session->lastReceiveTime = TimeHandler::currentTimeMicros();
+      VLOG(1) << "Got message with size " << message.size() << endl;
+      session->receive(message.data(), message.size());
+    }
+    if (!session->channel->isOpen()) {
+      // The client reconnects on a new channel once we go quiet
+      session->channel.reset();
+    }
+  }
+}
+
+void ShmRpcRouter::expireIdleSessions() {
+  int64_t now = TimeHandler::currentTimeMicros();
+  for (auto& session : getShmSessions()) {
+    if (now - session->lastReceiveTime > SESSION_IDLE_TIMEOUT_MICROS) {
+      LOG(INFO) << "Client went quiet";
+      closeSession(session->getIdentity());
+    }
+  }
+}
+
+void ShmRpcRouter::flushPendingFrames() {
+  auto currentSessions = getShmSessions();
+  int64_t shortestWait = 0;
+  for (auto& session : currentSessions) {
+    int64_t flushMicros = session->microsUntilFlush();
+    if (flushMicros > 0 && flushMicros < 1000) {
+      shortestWait = max(shortestWait, flushMicros);
+    }
+  }
+  if (shortestWait) {
+    usleep(shortestWait);
+  }
+  for (auto& session : currentSessions) {
+    if (session->microsUntilFlush() == 0) {
+      session->flushPendingFrame();
+    }
+  }
+}
+
+void ShmRpcRouter::flushOutgoingFrames() {
+  pair<string, string> frame;
+  while (true) {
+    int priority = 0;
+    while (priority < NUM_PRIORITIES && !outgoingFrames[priority].pop(&frame)) {
+      priority++;
+    }
+    if (priority == NUM_PRIORITIES) {
+      return;
+    }
+    shared_ptr<ShmRouterSession> session;
+    {
+      lock_guard<recursive_mutex> guard(sessionsMutex);
+      auto it = sessions.find(frame.first);
+      if (it == sessions.end()) {
+        // The session was closed after this was queued
+        continue;
+      }
+      session = it->second;
+    }
+    if (!session->channel.get()) {
+      // Dropped, the frame is retransmitted on the next channel
+      continue;
+    }
+    if (!session->channel->write(frame.second)) {
+      // The client is behind.  Treat it like a lost packet, the frame is
+      // retransmitted if it mattered.
+      VLOG(1) << "Ring full, dropping frame of " << frame.second.length();
+    }
+  }
+}
+}  // namespace codefs
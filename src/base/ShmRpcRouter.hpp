@@ -0,0 +1,80 @@
+#ifndef __SHM_RPC_ROUTER_H__
+#define __SHM_RPC_ROUTER_H__
+
+#include "MpscQueue.hpp"
+#include "RpcTransport.hpp"
+#include "ShmChannel.hpp"
+#include "WakeupPipe.hpp"
+
+namespace codefs {
+class ShmRpcRouter;
+
+// The rpc state for one peer of a ShmRpcRouter.  The identity is the peer's
+// session id.
+class ShmRouterSession : public RpcSession {
+ public:
+  ShmRouterSession(ShmRpcRouter* _router, const string& _identity);
+  virtual ~ShmRouterSession() {}
+
+ protected:
+  friend class ShmRpcRouter;
+
+  ShmRpcRouter* router;
+  // The peer's current channel.  Replaced when it reconnects, null if it was
+  // dropped as corrupt.  Only touched by the router's io thread.
+  shared_ptr<ShmChannel> channel;
+  int64_t lastReceiveTime;
+
+  virtual void onFramePending();
+  virtual void onIncoming();
+  virtual void send(string message, RpcPriority priority);
+};
+
+// Listens on a fifo in a directory for clients on the same host to announce
+// their channels.  One io thread drives all of the channels and sessions.
+class ShmRpcRouter : public RpcRouter {
+ public:
+  explicit ShmRpcRouter(const string& address);
+  virtual ~ShmRpcRouter();
+  virtual void start();
+  virtual void shutdown();
+
+  virtual vector<shared_ptr<RpcSession>> getSessions();
+  virtual void closeSession(const string& identity);
+  virtual bool waitForIncoming(int64_t timeoutMs);
+
+ protected:
+  friend class ShmRouterSession;
+
+  string directory;
+  int listenFd;
+  // A partial announcement left over from the last read
+  string listenBuffer;
+
+  recursive_mutex sessionsMutex;
+  unordered_map<string, shared_ptr<ShmRouterSession>> sessions;
+
+  MpscQueue<pair<string, string>> outgoingFrames[NUM_PRIORITIES];
+  shared_ptr<thread> ioThread;
+  atomic<bool> running;
+  WakeupPipe wakeupPipe;
+
+  std::mutex incomingMutex;
+  std::condition_variable incomingCondition;
+  bool incomingPending;
+
+  string listenPath() const { return directory + "/listen"; }
+  vector<shared_ptr<ShmRouterSession>> getShmSessions();
+  void runIoThread();
+  void acceptChannels();
+  void receiveFrames();
+  void expireIdleSessions();
+  void flushPendingFrames();
+  void flushOutgoingFrames();
+  void notifyIncoming();
+  void queueFrame(const string& identity, string message,
+                  RpcPriority priority);
+};
+}  // namespace codefs
+
+#endif  // __SHM_RPC_ROUTER_H__
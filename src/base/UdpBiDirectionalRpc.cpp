@@ -0,0 +1,225 @@
+#include "UdpBiDirectionalRpc.hpp"
+
+#include "TimeHandler.hpp"
+#include "UdpSocket.hpp"
+
+namespace codefs {
+namespace {
+// Same as the zmq client: the router heartbeats every few seconds, so this
+// much silence means the path to it is gone, e.g. after a network change
+const int64_t RECONNECT_AFTER_SILENCE_MICROS = 10 * 1000 * 1000;
+const int64_t HEARTBEAT_INTERVAL_MS = 3000;
+}  // namespace
+
+UdpBiDirectionalRpc::UdpBiDirectionalRpc(const string& _address)
+    : RpcEndpoint(),
+      address(_address),
+      running(false),
+      reconnectRequested(false),
+      lastReceiveTime(TimeHandler::currentTimeMicros()),
+      receiveBuffer(MAX_DATAGRAM_SIZE, '\0') {
+  // One chunk per datagram
+  setChunkSize(UDP_CHUNK_SIZE);
+  LOG(INFO) << "Connecting to address: " << address;
+  socketFd = openUdpSocket(address, false);
+}
+
+UdpBiDirectionalRpc::~UdpBiDirectionalRpc() {
+  if (socketFd >= 0) {
+    LOGFATAL << "Tried to destroy an RPC instance without calling shutdown";
+  }
+}
+
+void UdpBiDirectionalRpc::shutdown() {
+  if (ioThread.get()) {
+    running = false;
+    wakeupPipe.wakeup();
+    ioThread->join();
+    ioThread.reset();
+  }
+  ::close(socketFd);
+  socketFd = -1;
+}
+
+void UdpBiDirectionalRpc::start() {
+  if (ioThread.get()) {
+    LOGFATAL << "Tried to start the io thread twice";
+  }
+  running = true;
+  ioThread.reset(new thread(&UdpBiDirectionalRpc::runIoThread, this));
+}
+
+void UdpBiDirectionalRpc::reconnect() {
+  if (ioThread.get()) {
+    // The socket belongs to the io thread
+    reconnectRequested = true;
+    wakeupPipe.wakeup();
+    return;
+  }
+  reconnectSocket();
+}
+
+void UdpBiDirectionalRpc::reconnectSocket() {
+  LOG(INFO) << "Reconnecting to " << address;
+  ::close(socketFd);
+  socketFd = openUdpSocket(address, false);
+  lastReceiveTime = TimeHandler::currentTimeMicros();
+  // A restarted router only makes a session for a hello, so keep sending
+  // one until it answers
+  resendHello();
+}
+
+void UdpBiDirectionalRpc::runIoThread() {
+  auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+  while (running) {
+    resendOverdueMessages();
+    receiveFrames();
+    if (reconnectRequested.exchange(false) ||
+        TimeHandler::currentTimeMicros() - lastReceiveTime >
+            RECONNECT_AFTER_SILENCE_MICROS) {
+      reconnectSocket();
+    }
+
+    int64_t flushMicros = microsUntilFlush();
+    if (flushMicros > 0 && flushMicros < 1000) {
+      usleep(flushMicros);
+      flushMicros = 0;
+    }
+    if (flushMicros == 0) {
+      flushPendingFrame();
+    }
+    int64_t pacingMicros = flushOutgoingFrames();
+
+    auto msSinceLastHeartbeat =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
+            .count();
+    if (msSinceLastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
+      heartbeat();
+      lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      continue;
+    }
+
+    // Sleep until a datagram arrives, another thread queues a frame, or it
+    // is time for the next heartbeat, retransmit, flush or paced send.
+    int64_t timeoutMs = HEARTBEAT_INTERVAL_MS - msSinceLastHeartbeat;
+    int64_t resendMicros = microsUntilNextResend();
+    if (resendMicros >= 0) {
+      timeoutMs = min(timeoutMs, (resendMicros + 999) / 1000);
+    }
+    flushMicros = microsUntilFlush();
+    if (flushMicros >= 0) {
+      timeoutMs = min(timeoutMs, (flushMicros + 999) / 1000);
+    }
+    if (pacingMicros >= 0) {
+      timeoutMs = min(timeoutMs, (pacingMicros + 999) / 1000);
+    }
+    struct pollfd items[] = {
+        {socketFd, POLLIN, 0},
+        {wakeupPipe.readFd(), POLLIN, 0},
+    };
+    int rc = ::poll(items, 2, int(timeoutMs));
+    if (rc < 0 && errno != EINTR) {
+      FATAL_FAIL(rc);
+    }
+    if (items[1].revents & POLLIN) {
+      wakeupPipe.drain();
+    }
+  }
+  // Push out anything that was queued before we were asked to stop
+  flushPendingFrame();
+  int64_t pacingMicros;
+  while ((pacingMicros = flushOutgoingFrames()) > 0) {
+    usleep(pacingMicros);
+  }
+}
+
+void UdpBiDirectionalRpc::update() {
+  resendOverdueMessages();
+  receiveFrames();
+  flushPendingFrame();
+  flushOutgoingFrames();
+}
+
+void UdpBiDirectionalRpc::receiveFrames() {
+  while (true) {
+    ssize_t size =
+        ::recv(socketFd, &receiveBuffer[0], receiveBuffer.size(), 0);
+    if (size < 0) {
+      if (!isTransientUdpError(errno)) {
+        FATAL_FAIL(size);
+      }
+      // Nothing to recieve
+      return;
+    }
+    if (size == 0) {
+      continue;
+    }
+    VLOG(1) << "Got message with size " << size << endl;
+    lastReceiveTime = TimeHandler::currentTimeMicros();
+    BiDirectionalRpc::receive(receiveBuffer.data(), size);
+  }
+}
+
+void UdpBiDirectionalRpc::send(string message, RpcPriority priority) {
+  VLOG(1) << "SENDING " << message.length();
+  if (message.length() == 0) {
+    LOGFATAL << "Invalid message size";
+  }
+  if (int64_t(message.length()) + UDP_SESSION_HEADER_SIZE >
+      MAX_DATAGRAM_SIZE) {
+    LOGFATAL << "Frame of " << message.length()
+             << " bytes does not fit in a datagram";
+  }
+  outgoingFrames[priority].push(std::move(message));
+  wakeupPipe.wakeup();
+}
+
+int64_t UdpBiDirectionalRpc::flushOutgoingFrames() {
+  pacer.setSmoothedRtt(getSmoothedRtt());
+  char header[UDP_SESSION_HEADER_SIZE];
+  writeUdpSessionHeader(getSessionId(), header);
+  string message;
+  while (true) {
+    int priority = 0;
+    while (priority < NUM_PRIORITIES && outgoingFrames[priority].empty()) {
+      priority++;
+    }
+    if (priority == NUM_PRIORITIES) {
+      return -1;
+    }
+    int64_t now = TimeHandler::currentTimeMicros();
+    int64_t waitMicros = pacer.microsUntilSend(now);
+    if (waitMicros > 0) {
+      return waitMicros;
+    }
+    // Check the classes again, something more urgent may have arrived
+    priority = 0;
+    while (priority < NUM_PRIORITIES &&
+           !outgoingFrames[priority].pop(&message)) {
+      priority++;
+    }
+    if (priority == NUM_PRIORITIES) {
+      return -1;
+    }
+
+    struct iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = UDP_SESSION_HEADER_SIZE;
+    parts[1].iov_base = &message[0];
+    parts[1].iov_len = message.length();
+    struct msghdr datagram;
+    memset(&datagram, 0, sizeof(datagram));
+    datagram.msg_iov = parts;
+    datagram.msg_iovlen = 2;
+    ssize_t rc = ::sendmsg(socketFd, &datagram, 0);
+    if (rc < 0) {
+      if (!isTransientUdpError(errno)) {
+        FATAL_FAIL(rc);
+      }
+      VLOG(1) << "Dropped a datagram: " << strerror(errno);
+    }
+    pacer.onSend(UDP_SESSION_HEADER_SIZE + message.length(), now);
+  }
+}
+}  // namespace codefs
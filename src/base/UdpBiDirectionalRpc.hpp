@@ -0,0 +1,52 @@
+#ifndef __UDP_BIDIRECTIONAL_RPC_H__
+#define __UDP_BIDIRECTIONAL_RPC_H__
+
+#include "MpscQueue.hpp"
+#include "Pacer.hpp"
+#include "RpcTransport.hpp"
+#include "WakeupPipe.hpp"
+
+namespace codefs {
+// The client end of a datagram connection to a UdpRpcRouter.  Every frame is
+// one datagram and BiDirectionalRpc already acknowledges and retransmits
+// what it sends, so a lost packet only holds up the requests it carried
+// instead of everything behind it in a TCP stream.
+class UdpBiDirectionalRpc : public RpcEndpoint {
+ public:
+  explicit UdpBiDirectionalRpc(const string& address);
+  virtual ~UdpBiDirectionalRpc();
+  virtual void shutdown();
+  virtual void update();
+  virtual void start();
+  // Opens a new socket, which gets a new source port.  The router follows
+  // us to it because every datagram carries our session id.
+  virtual void reconnect();
+
+ protected:
+  string address;
+  // Only touched by whoever calls update()
+  int socketFd;
+  Pacer pacer;
+
+  MpscQueue<string> outgoingFrames[NUM_PRIORITIES];
+  shared_ptr<thread> ioThread;
+  atomic<bool> running;
+  atomic<bool> reconnectRequested;
+  int64_t lastReceiveTime;
+  WakeupPipe wakeupPipe;
+  // Big enough for any datagram
+  string receiveBuffer;
+
+  void reconnectSocket();
+  void runIoThread();
+  void receiveFrames();
+  // Sends as many queued frames as the pacer allows, most urgent first.
+  // Returns the microseconds until the next one may go, or -1 if the queues
+  // are empty.
+  int64_t flushOutgoingFrames();
+  virtual void onFramePending() { wakeupPipe.wakeup(); }
+  virtual void send(string message, RpcPriority priority);
+};
+}  // namespace codefs
+
+#endif  // __UDP_BIDIRECTIONAL_RPC_H__
@@ -0,0 +1,302 @@
+#include "UdpRpcRouter.hpp"
+
+#include "TimeHandler.hpp"
+
+namespace codefs {
+namespace {
+// Peers heartbeat every few seconds, so a session this quiet is gone
+const int64_t SESSION_IDLE_TIMEOUT_MICROS = 60 * 1000 * 1000;
+const int64_t HEARTBEAT_INTERVAL_MS = 3000;
+// Every session costs memory until it goes idle, so a flood of hellos with
+// made up session ids can't have more than this
+const size_t MAX_SESSIONS = 1024;
+}  // namespace
+
+UdpRouterSession::UdpRouterSession(UdpRpcRouter* _router,
+                                   const string& _identity)
+    : RpcSession(_identity),
+      router(_router),
+      peerAddressLength(0),
+      lastReceiveTime(TimeHandler::currentTimeMicros()) {
+  memset(&peerAddress, 0, sizeof(peerAddress));
+  // One chunk per datagram
+  setChunkSize(UDP_CHUNK_SIZE);
+}
+
+void UdpRouterSession::onFramePending() { router->wakeupPipe.wakeup(); }
+
+void UdpRouterSession::onIncoming() { router->notifyIncoming(); }
+
+void UdpRouterSession::send(string message, RpcPriority priority) {
+  VLOG(1) << "SENDING " << message.length();
+  if (message.length() == 0) {
+    LOGFATAL << "Invalid message size";
+  }
+  if (int64_t(message.length()) > MAX_DATAGRAM_SIZE) {
+    LOGFATAL << "Frame of " << message.length()
+             << " bytes does not fit in a datagram";
+  }
+  outgoingFrames[priority].push(std::move(message));
+  router->wakeupPipe.wakeup();
+}
+
+UdpRpcRouter::UdpRpcRouter(const string& _address)
+    : address(_address),
+      receiveBuffer(MAX_DATAGRAM_SIZE, '\0'),
+      running(false),
+      incomingPending(false) {
+  LOG(INFO) << "Binding on address: " << address;
+  socketFd = openUdpSocket(address, true);
+}
+
+UdpRpcRouter::~UdpRpcRouter() {
+  if (socketFd >= 0) {
+    LOGFATAL << "Tried to destroy a router without calling shutdown";
+  }
+}
+
+void UdpRpcRouter::start() {
+  if (ioThread.get()) {
+    LOGFATAL << "Tried to start the io thread twice";
+  }
+  running = true;
+  ioThread.reset(new thread(&UdpRpcRouter::runIoThread, this));
+}
+
+void UdpRpcRouter::shutdown() {
+  if (ioThread.get()) {
+    running = false;
+    wakeupPipe.wakeup();
+    ioThread->join();
+    ioThread.reset();
+  }
+  ::close(socketFd);
+  socketFd = -1;
+}
+
+vector<shared_ptr<RpcSession>> UdpRpcRouter::getSessions() {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  vector<shared_ptr<RpcSession>> retval;
+  retval.reserve(sessions.size());
+  for (const auto& it : sessions) {
+    retval.push_back(it.second);
+  }
+  return retval;
+}
+
+vector<shared_ptr<UdpRouterSession>> UdpRpcRouter::getUdpSessions() {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  vector<shared_ptr<UdpRouterSession>> retval;
+  retval.reserve(sessions.size());
+  for (const auto& it : sessions) {
+    retval.push_back(it.second);
+  }
+  return retval;
+}
+
+void UdpRpcRouter::closeSession(const string& identity) {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  if (sessions.erase(identity)) {
+    LOG(INFO) << "Closed session, " << sessions.size() << " left";
+  }
+}
+
+bool UdpRpcRouter::waitForIncoming(int64_t timeoutMs) {
+  unique_lock<std::mutex> guard(incomingMutex);
+  bool result =
+      incomingCondition.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+                                 [this] { return incomingPending; });
+  incomingPending = false;
+  return result;
+}
+
+void UdpRpcRouter::notifyIncoming() {
+  lock_guard<std::mutex> guard(incomingMutex);
+  incomingPending = true;
+  incomingCondition.notify_all();
+}
+
+void UdpRpcRouter::runIoThread() {
+  auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+  while (running) {
+    for (auto& session : getUdpSessions()) {
+      session->resendOverdueMessages();
+    }
+    receiveFrames();
+    expireIdleSessions();
+    flushPendingFrames();
+    int64_t pacingMicros = flushOutgoingFrames();
+
+    auto msSinceLastHeartbeat =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
+            .count();
+    if (msSinceLastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
+      for (auto& session : getUdpSessions()) {
+        session->heartbeat();
+      }
+      lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      continue;
+    }
+
+    int64_t timeoutMs = HEARTBEAT_INTERVAL_MS - msSinceLastHeartbeat;
+    if (pacingMicros >= 0) {
+      timeoutMs = min(timeoutMs, (pacingMicros + 999) / 1000);
+    }
+    for (auto& session : getUdpSessions()) {
+      int64_t resendMicros = session->microsUntilNextResend();
+      if (resendMicros >= 0) {
+        timeoutMs = min(timeoutMs, (resendMicros + 999) / 1000);
+      }
+      int64_t flushMicros = session->microsUntilFlush();
+      if (flushMicros >= 0) {
+        timeoutMs = min(timeoutMs, (flushMicros + 999) / 1000);
+      }
+    }
+    struct pollfd items[] = {
+        {socketFd, POLLIN, 0},
+        {wakeupPipe.readFd(), POLLIN, 0},
+    };
+    int rc = ::poll(items, 2, int(timeoutMs));
+    if (rc < 0 && errno != EINTR) {
+      FATAL_FAIL(rc);
+    }
+    if (items[1].revents & POLLIN) {
+      wakeupPipe.drain();
+    }
+  }
+  // Push out anything that was queued before we were asked to stop
+  for (auto& session : getUdpSessions()) {
+    session->flushPendingFrame();
+  }
+  int64_t pacingMicros;
+  while ((pacingMicros = flushOutgoingFrames()) > 0) {
+    usleep(pacingMicros);
+  }
+}
+
+void UdpRpcRouter::receiveFrames() {
+  while (true) {
+    struct sockaddr_storage from;
+    socklen_t fromLength = sizeof(from);
+    ssize_t size = ::recvfrom(socketFd, &receiveBuffer[0],
+                              receiveBuffer.size(), 0,
+                              (struct sockaddr*)&from, &fromLength);
+    if (size < 0) {
+      if (!isTransientUdpError(errno)) {
+        FATAL_FAIL(size);
+      }
+      // Nothing to recieve
+      return;
+    }
+    if (size <= UDP_SESSION_HEADER_SIZE) {
+      VLOG(1) << "Ignoring a runt datagram of " << size << " bytes";
+      continue;
+    }
+
+    std::ostringstream ss;
+    ss << std::hex << readUdpSessionHeader(receiveBuffer.data());
+    string identity = ss.str();
+    shared_ptr<UdpRouterSession> session;
+    {
+      lock_guard<recursive_mutex> guard(sessionsMutex);
+      auto it = sessions.find(identity);
+      if (it == sessions.end()) {
+        // Anyone can send us a datagram, so only a real hello gets state
+        if (!BiDirectionalRpc::startsWithHello(
+                receiveBuffer.data() + UDP_SESSION_HEADER_SIZE,
+                size - UDP_SESSION_HEADER_SIZE)) {
+          VLOG(1) << "Ignoring a datagram for unknown session " << identity;
+          continue;
+        }
+        if (sessions.size() >= MAX_SESSIONS) {
+          VLOG(1) << "Too many sessions, ignoring a hello from " << identity;
+          continue;
+        }
+        session.reset(new UdpRouterSession(this, identity));
+        sessions[identity] = session;
+        LOG(INFO) << "Got a new client, " << sessions.size() << " connected";
+      } else {
+        session = it->second;
+      }
+    }
+    if (session->peerAddressLength != fromLength ||
+        memcmp(&session->peerAddress, &from, fromLength)) {
+      if (session->peerAddressLength) {
+        LOG(INFO) << "Client " << identity << " moved to a new address";
+      }
+      memcpy(&session->peerAddress, &from, fromLength);
+      session->peerAddressLength = fromLength;
+    }
+    session->lastReceiveTime = TimeHandler::currentTimeMicros();
+    VLOG(1) << "Got message with size " << size << endl;
+    session->receive(receiveBuffer.data() + UDP_SESSION_HEADER_SIZE,
+                     size - UDP_SESSION_HEADER_SIZE);
+  }
+}
+
+void UdpRpcRouter::expireIdleSessions() {
+  int64_t now = TimeHandler::currentTimeMicros();
+  for (auto& session : getUdpSessions()) {
+    if (now - session->lastReceiveTime > SESSION_IDLE_TIMEOUT_MICROS) {
+      LOG(INFO) << "Client went quiet";
+      closeSession(session->getIdentity());
+    }
+  }
+}
+
+void UdpRpcRouter::flushPendingFrames() {
+  // The rest are waited for in poll, so one session's flush window doesn't
+  // hold up every other session's traffic
+  for (auto& session : getUdpSessions()) {
+    if (session->microsUntilFlush() == 0) {
+      session->flushPendingFrame();
+    }
+  }
+}
+
+int64_t UdpRpcRouter::flushOutgoingFrames() {
+  int64_t nextSendMicros = -1;
+  string message;
+  for (auto& session : getUdpSessions()) {
+    session->pacer.setSmoothedRtt(session->getSmoothedRtt());
+    while (true) {
+      int priority = 0;
+      while (priority < NUM_PRIORITIES &&
+             session->outgoingFrames[priority].empty()) {
+        priority++;
+      }
+      if (priority == NUM_PRIORITIES) {
+        break;
+      }
+      int64_t now = TimeHandler::currentTimeMicros();
+      int64_t waitMicros = session->pacer.microsUntilSend(now);
+      if (waitMicros > 0) {
+        if (nextSendMicros < 0 || waitMicros < nextSendMicros) {
+          nextSendMicros = waitMicros;
+        }
+        break;
+      }
+      priority = 0;
+      while (priority < NUM_PRIORITIES &&
+             !session->outgoingFrames[priority].pop(&message)) {
+        priority++;
+      }
+      if (priority == NUM_PRIORITIES) {
+        break;
+      }
+      ssize_t rc = ::sendto(socketFd, message.data(), message.length(), 0,
+                            (struct sockaddr*)&session->peerAddress,
+                            session->peerAddressLength);
+      if (rc < 0) {
+        if (!isTransientUdpError(errno)) {
+          FATAL_FAIL(rc);
+        }
+        VLOG(1) << "Dropped a datagram: " << strerror(errno);
+      }
+      session->pacer.onSend(message.length(), now);
+    }
+  }
+  return nextSendMicros;
+}
+}  // namespace codefs
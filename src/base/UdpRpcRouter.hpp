@@ -0,0 +1,86 @@
+#ifndef __UDP_RPC_ROUTER_H__
+#define __UDP_RPC_ROUTER_H__
+
+#include "MpscQueue.hpp"
+#include "Pacer.hpp"
+#include "RpcTransport.hpp"
+#include "UdpSocket.hpp"
+#include "WakeupPipe.hpp"
+
+namespace codefs {
+class UdpRpcRouter;
+
+// The rpc state for one peer of a UdpRpcRouter.  The identity is the peer's
+// session id.
+class UdpRouterSession : public RpcSession {
+ public:
+  UdpRouterSession(UdpRpcRouter* _router, const string& _identity);
+  virtual ~UdpRouterSession() {}
+
+ protected:
+  friend class UdpRpcRouter;
+
+  UdpRpcRouter* router;
+  // Frames waiting for the pacer, drained most urgent class first
+  MpscQueue<string> outgoingFrames[NUM_PRIORITIES];
+
+  // The rest is only touched by the router's io thread.  Replies go to
+  // wherever the peer last sent from, so it can roam between networks.
+  struct sockaddr_storage peerAddress;
+  socklen_t peerAddressLength;
+  Pacer pacer;
+  int64_t lastReceiveTime;
+
+  virtual void onFramePending();
+  virtual void onIncoming();
+  virtual void send(string message, RpcPriority priority);
+};
+
+// Binds a datagram socket and keeps a session for every client that sends
+// to it, keyed by the session id at the front of each datagram.  One io
+// thread owns the socket and drives all of the sessions.
+class UdpRpcRouter : public RpcRouter {
+ public:
+  explicit UdpRpcRouter(const string& address);
+  virtual ~UdpRpcRouter();
+  virtual void start();
+  virtual void shutdown();
+
+  virtual vector<shared_ptr<RpcSession>> getSessions();
+  virtual void closeSession(const string& identity);
+  virtual bool waitForIncoming(int64_t timeoutMs);
+  // The port we are bound to, useful when the address asked for port 0
+  int getPort() { return getUdpSocketPort(socketFd); }
+
+ protected:
+  friend class UdpRouterSession;
+
+  string address;
+  int socketFd;
+  string receiveBuffer;
+
+  recursive_mutex sessionsMutex;
+  unordered_map<string, shared_ptr<UdpRouterSession>> sessions;
+
+  shared_ptr<thread> ioThread;
+  atomic<bool> running;
+  WakeupPipe wakeupPipe;
+
+  std::mutex incomingMutex;
+  std::condition_variable incomingCondition;
+  bool incomingPending;
+
+  vector<shared_ptr<UdpRouterSession>> getUdpSessions();
+  void runIoThread();
+  void receiveFrames();
+  void expireIdleSessions();
+  // Sends the partial frames whose flush window has closed
+  void flushPendingFrames();
+  // Sends what each session's pacer allows.  Returns the microseconds until
+  // the next paced send, or -1 if nothing is queued.
+  int64_t flushOutgoingFrames();
+  void notifyIncoming();
+};
+}  // namespace codefs
+
+#endif  // __UDP_RPC_ROUTER_H__
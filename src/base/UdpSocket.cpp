@@ -0,0 +1,77 @@
+#include "UdpSocket.hpp"
+
+namespace codefs {
+namespace {
+// Room for a full pacing window, so bursts the pacer allows aren't dropped
+// by the kernel
+const int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+}  // namespace
+
+int openUdpSocket(const string& address, bool bind) {
+  const string prefix = "udp://";
+  size_t colon = address.rfind(':');
+  if (address.find(prefix) != 0 || colon == string::npos ||
+      colon < prefix.length()) {
+    LOGFATAL << "Invalid udp address: " << address;
+  }
+  string host = address.substr(prefix.length(), colon - prefix.length());
+  string port = address.substr(colon + 1);
+  if (host.length() >= 2 && host[0] == '[' && host[host.length() - 1] == ']') {
+    // IPv6 literal
+    host = host.substr(1, host.length() - 2);
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (bind) {
+    hints.ai_flags = AI_PASSIVE;
+    if (host == "*") {
+      host.clear();
+    }
+  }
+  struct addrinfo* results;
+  int rc = ::getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                         &hints, &results);
+  if (rc) {
+    LOGFATAL << "Could not resolve " << address << ": " << gai_strerror(rc);
+  }
+
+  int fd = -1;
+  for (struct addrinfo* info = results; info != NULL; info = info->ai_next) {
+    fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (bind ? ::bind(fd, info->ai_addr, info->ai_addrlen) == 0
+             : ::connect(fd, info->ai_addr, info->ai_addrlen) == 0) {
+      break;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  ::freeaddrinfo(results);
+  if (fd < 0) {
+    LOGFATAL << "Could not " << (bind ? "bind to " : "connect to ") << address
+             << ": " << strerror(errno);
+  }
+
+  FATAL_FAIL(::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK));
+  int bufferSize = SOCKET_BUFFER_SIZE;
+  // Best effort, the kernel may clamp these
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+  return fd;
+}
+
+int getUdpSocketPort(int fd) {
+  struct sockaddr_storage local;
+  socklen_t localLength = sizeof(local);
+  FATAL_FAIL(::getsockname(fd, (struct sockaddr*)&local, &localLength));
+  if (local.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6*)&local)->sin6_port);
+  }
+  return ntohs(((struct sockaddr_in*)&local)->sin_port);
+}
+}  // namespace codefs
@@ -0,0 +1,48 @@
+#ifndef __UDP_SOCKET_H__
+#define __UDP_SOCKET_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// Small enough that a chunk plus its framing fits one datagram inside the
+// usual 1500 byte MTU, so a lost packet costs one chunk and nothing else
+const int64_t UDP_CHUNK_SIZE = 1200;
+// The largest payload IPv4 can carry in one datagram
+const int64_t MAX_DATAGRAM_SIZE = 65507;
+// Client datagrams start with the client's session id so the server can
+// follow it across address changes
+const int64_t UDP_SESSION_HEADER_SIZE = sizeof(uint64_t);
+
+// Opens a non-blocking datagram socket for udp://<host>:<port>.  When binding,
+// a host of * listens on every interface.  Otherwise the socket is connected
+// to the host.
+int openUdpSocket(const string& address, bool bind);
+
+// The local port of a socket, which is how to find out what port the kernel
+// picked for one bound to port 0
+int getUdpSocketPort(int fd);
+
+inline void writeUdpSessionHeader(uint64_t sessionId, char* header) {
+  for (int a = 0; a < UDP_SESSION_HEADER_SIZE; a++) {
+    header[a] = char((sessionId >> (8 * a)) & 0xff);
+  }
+}
+
+inline uint64_t readUdpSessionHeader(const char* header) {
+  uint64_t sessionId = 0;
+  for (int a = 0; a < UDP_SESSION_HEADER_SIZE; a++) {
+    sessionId |= uint64_t((unsigned char)header[a]) << (8 * a);
+  }
+  return sessionId;
+}
+
+// Send errors that mean the datagram was lost rather than that something is
+// broken.  The rpc layer retransmits whatever mattered.
+inline bool isTransientUdpError(int error) {
+  return error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS ||
+         error == ECONNREFUSED || error == EHOSTUNREACH ||
+         error == ENETUNREACH || error == ENETDOWN || error == EINTR;
+}
+}  // namespace codefs
+
+#endif  // __UDP_SOCKET_H__
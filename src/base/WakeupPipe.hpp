@@ -0,0 +1,54 @@
+#ifndef __WAKEUP_PIPE_H__
+#define __WAKEUP_PIPE_H__
+
+#include "Headers.hpp"
+
+namespace codefs {
+// Self-pipe used to wake an io thread out of poll() from other threads.
+// Repeated wakeups collapse into one until the io thread drains the pipe.
+class WakeupPipe {
+ public:
+  WakeupPipe() : pending(false) {
+    FATAL_FAIL(::pipe(fds));
+    for (int a = 0; a < 2; a++) {
+      FATAL_FAIL(
+          ::fcntl(fds[a], F_SETFL, ::fcntl(fds[a], F_GETFL) | O_NONBLOCK));
+    }
+  }
+
+  ~WakeupPipe() {
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  void wakeup() {
+    if (pending.exchange(true)) {
+      // The io thread already has a wakeup it hasn't consumed
+      return;
+    }
+    char c = 0;
+    int rc = ::write(fds[1], &c, 1);
+    if (rc < 0 && errno != EAGAIN) {
+      FATAL_FAIL(rc);
+    }
+  }
+
+  void drain() {
+    // Clear the flag before draining so a wakeup that races with us is not
+    // lost
+    pending = false;
+    char buf[64];
+    while (::read(fds[0], buf, sizeof(buf)) > 0) {
+    }
+  }
+
+  // The end to poll for readability
+  int readFd() const { return fds[0]; }
+
+ protected:
+  int fds[2];
+  atomic<bool> pending;
+};
+}  // namespace codefs
+
+#endif  // __WAKEUP_PIPE_H__
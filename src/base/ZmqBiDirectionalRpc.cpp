@@ -1,19 +1,34 @@
 #include "ZmqBiDirectionalRpc.hpp"
 
+#include "TimeHandler.hpp"
+
 namespace codefs {
+namespace {
+// The server heartbeats every few seconds, so this much silence means the
+// connection is gone even if the socket hasn't noticed, e.g. after a suspend
+const int64_t RECONNECT_AFTER_SILENCE_MICROS = 10 * 1000 * 1000;
+}  // namespace
+
 ZmqBiDirectionalRpc::ZmqBiDirectionalRpc(const string& _address, bool _bind)
-    : BiDirectionalRpc(), address(_address), bind(_bind) {
+    : RpcEndpoint(),
+      address(_address),
+      bind(_bind),
+      running(false),
+      reconnectRequested(false),
+      lastReceiveTime(TimeHandler::currentTimeMicros()) {
   context = shared_ptr<zmq::context_t>(new zmq::context_t(8));
   if (bind) {
     LOG(INFO) << "Binding on address: " << address;
     socket = shared_ptr<zmq::socket_t>(
         new zmq::socket_t(*(context.get()), ZMQ_ROUTER));
+    // A peer that reconnects with its old identity takes over from the old
+    // connection, which may not have noticed that it is dead yet
+    int handover = 1;
+    socket->setsockopt(ZMQ_ROUTER_HANDOVER, handover);
     socket->bind(address);
   } else {
     LOG(INFO) << "Connecting to address: " << address;
-    socket = shared_ptr<zmq::socket_t>(
-        new zmq::socket_t(*(context.get()), ZMQ_DEALER));
-    socket->connect(address);
+    connectSocket();
   }
   LOG(INFO) << "Done";
 }
@@ -25,6 +40,13 @@ ZmqBiDirectionalRpc::~ZmqBiDirectionalRpc() {
 }
 
 void ZmqBiDirectionalRpc::shutdown() {
+  if (ioThread.get()) {
+    LOG(INFO) << "STOPPING IO THREAD";
+    running = false;
+    wakeupPipe.wakeup();
+    ioThread->join();
+    ioThread.reset();
+  }
   LOG(INFO) << "CLOSING SOCKET";
   socket->close();
   LOG(INFO) << "KILLING SOCKET";
@@ -36,7 +58,86 @@ void ZmqBiDirectionalRpc::shutdown() {
   LOG(INFO) << "SHUTDOWN COMPLETE";
 }
 
+void ZmqBiDirectionalRpc::start() {
+  if (ioThread.get()) {
+    LOGFATAL << "Tried to start the io thread twice";
+  }
+  running = true;
+  ioThread.reset(new thread(&ZmqBiDirectionalRpc::runIoThread, this));
+}
+
+void ZmqBiDirectionalRpc::runIoThread() {
+  auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+  while (running) {
+    resendOverdueMessages();
+    receiveFrames();
+    if (reconnectRequested.exchange(false) ||
+        (!bind && TimeHandler::currentTimeMicros() - lastReceiveTime >
+                      RECONNECT_AFTER_SILENCE_MICROS)) {
+      reconnectSocket();
+    }
+
+    // Give other threads a short window to add to a partially filled frame
+    // before it goes out.  Windows below the poll resolution are slept off
+    // here instead.
+    int64_t flushMicros = microsUntilFlush();
+    if (flushMicros > 0 && flushMicros < 1000) {
+      usleep(flushMicros);
+      flushMicros = 0;
+    }
+    if (flushMicros == 0) {
+      flushPendingFrame();
+    }
+    flushOutgoingFrames();
+
+    auto msSinceLastHeartbeat =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
+            .count();
+    if (msSinceLastHeartbeat >= 3000) {
+      heartbeat();
+      lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      continue;
+    }
+
+    // Sleep until the socket has data, another thread queues a frame, or it
+    // is time for the next heartbeat, retransmit or flush.
+    int64_t timeoutMs = 3000 - msSinceLastHeartbeat;
+    int64_t resendMicros = microsUntilNextResend();
+    if (resendMicros >= 0) {
+      timeoutMs = min(timeoutMs, (resendMicros + 999) / 1000);
+    }
+    flushMicros = microsUntilFlush();
+    if (flushMicros >= 0) {
+      timeoutMs = min(timeoutMs, (flushMicros + 999) / 1000);
+    }
+    zmq::pollitem_t items[] = {
+        {(void*)(*socket), 0, ZMQ_POLLIN, 0},
+        {NULL, wakeupPipe.readFd(), ZMQ_POLLIN, 0},
+    };
+    int rc = zmq_poll(items, 2, long(timeoutMs));
+    if (rc < 0 && zmq_errno() != EINTR) {
+      LOGFATAL << "zmq_poll failed: " << zmq_strerror(zmq_errno());
+    }
+    if (items[1].revents & ZMQ_POLLIN) {
+      wakeupPipe.drain();
+    }
+  }
+  // Push out anything that was queued before we were asked to stop
+  flushPendingFrame();
+  flushOutgoingFrames();
+}
+
 void ZmqBiDirectionalRpc::update() {
+  resendOverdueMessages();
+  receiveFrames();
+  // Nobody is timing a coalescing window when update() is pumped by hand, so
+  // send everything now.
+  flushPendingFrame();
+  flushOutgoingFrames();
+}
+
+void ZmqBiDirectionalRpc::receiveFrames() {
   while (true) {
     zmq::message_t message;
     bool result = socket->recv(&message, ZMQ_DONTWAIT);
@@ -64,33 +165,77 @@ void ZmqBiDirectionalRpc::update() {
     }
 
     VLOG(1) << "Got message with size " << message.size() << endl;
-    string s(message.data<char>(), message.size());
-    BiDirectionalRpc::receive(s);
+    lastReceiveTime = TimeHandler::currentTimeMicros();
+    BiDirectionalRpc::receive(message.data<char>(), message.size());
   }
 }
 
 void ZmqBiDirectionalRpc::reconnect() {
-  // Skip reconnect
-  return;
-
-  shutdown();
-
-  context = shared_ptr<zmq::context_t>(new zmq::context_t(4));
-  socket.reset(new zmq::socket_t(*(context.get()), ZMQ_PAIR));
-  socket->setsockopt(ZMQ_LINGER, 3000);
   if (bind) {
-    LOG(INFO) << "Binding on address: " << address;
-    socket->bind(address);
-  } else {
-    socket->connect(address);
+    // Peers dial us, so there is nothing to redial
+    return;
   }
+  if (ioThread.get()) {
+    // The socket belongs to the io thread
+    reconnectRequested = true;
+    wakeupPipe.wakeup();
+    return;
+  }
+  reconnectSocket();
+}
+
+void ZmqBiDirectionalRpc::connectSocket() {
+  socket = shared_ptr<zmq::socket_t>(
+      new zmq::socket_t(*(context.get()), ZMQ_DEALER));
+  // Keeping the same identity across connections lets the server find our
+  // session again
+  std::ostringstream identity;
+  identity << "codefs-" << std::hex << getSessionId();
+  string identityString = identity.str();
+  socket->setsockopt(ZMQ_IDENTITY, identityString.data(),
+                     identityString.size());
+  socket->connect(address);
 }
 
-void ZmqBiDirectionalRpc::send(const string& message) {
+void ZmqBiDirectionalRpc::reconnectSocket() {
+  LOG(INFO) << "Reconnecting to " << address;
+  // Anything still sitting in the old socket is retransmitted anyway
+  int linger = 0;
+  socket->setsockopt(ZMQ_LINGER, linger);
+  socket->close();
+  connectSocket();
+  lastReceiveTime = TimeHandler::currentTimeMicros();
+}
+
+void ZmqBiDirectionalRpc::send(string message, RpcPriority priority) {
   VLOG(1) << "SENDING " << message.length();
   if (message.length() == 0) {
     LOGFATAL << "Invalid message size";
   }
+  // The socket is only touched by whoever calls update(), so just queue the
+  // frame here.
+  outgoingFrames[priority].push(std::move(message));
+  wakeupPipe.wakeup();
+}
+
+void ZmqBiDirectionalRpc::flushOutgoingFrames() {
+  string message;
+  while (true) {
+    // Start from the most urgent class after every frame, so anything
+    // interactive queued meanwhile jumps ahead of bulk transfers
+    int priority = 0;
+    while (priority < NUM_PRIORITIES &&
+           !outgoingFrames[priority].pop(&message)) {
+      priority++;
+    }
+    if (priority == NUM_PRIORITIES) {
+      return;
+    }
+    sendFrame(std::move(message));
+  }
+}
+
+void ZmqBiDirectionalRpc::sendFrame(string message) {
   if (bind) {
     if (clientIdentity.size() == 0) {
       // no one to send to
@@ -102,7 +247,7 @@ void ZmqBiDirectionalRpc::send(const string& message) {
         ZMQ_SNDMORE));
     FATAL_IF_FALSE(socket->send(zmq::message_t(), ZMQ_SNDMORE));
   }
-  zmq::message_t zmqMessage(message.c_str(), message.length());
+  zmq::message_t zmqMessage = stringToZmqMessage(std::move(message));
   FATAL_IF_FALSE(socket->send(zmqMessage));
 }
 }  // namespace codefs
@@ -1,17 +1,20 @@
 #ifndef __ZMQ_BIDIRECTIONAL_RPC_H__
 #define __ZMQ_BIDIRECTIONAL_RPC_H__
 
-#include "BiDirectionalRpc.hpp"
+#include "MpscQueue.hpp"
+#include "RpcTransport.hpp"
+#include "WakeupPipe.hpp"
 
 namespace codefs {
-class ZmqBiDirectionalRpc : public BiDirectionalRpc {
+class ZmqBiDirectionalRpc : public RpcEndpoint {
  public:
   ZmqBiDirectionalRpc(const string& address, bool bind);
   virtual ~ZmqBiDirectionalRpc();
-  void shutdown();
-  void update();
-
-  void reconnect();
+  virtual void shutdown();
+  virtual void update();
+  virtual void start();
+  // The server picks our session back up because we keep the same identity
+  virtual void reconnect();
 
  protected:
   shared_ptr<zmq::context_t> context;
@@ -22,8 +25,28 @@ class ZmqBiDirectionalRpc : public BiDirectionalRpc {
   string address;
   bool bind;
 
-  virtual void send(const string& message);
+  // Frames waiting for the io thread, drained most urgent class first
+  MpscQueue<string> outgoingFrames[NUM_PRIORITIES];
+  shared_ptr<thread> ioThread;
+  atomic<bool> running;
+  // Set by reconnect() for the io thread to act on
+  atomic<bool> reconnectRequested;
+  // When we last heard from the peer.  Only touched by whoever owns the
+  // socket.
+  int64_t lastReceiveTime;
+  // Wakes the io thread out of zmq_poll when frames are queued from other
+  // threads
+  WakeupPipe wakeupPipe;
+
+  void connectSocket();
+  void reconnectSocket();
+  void runIoThread();
+  void receiveFrames();
+  void flushOutgoingFrames();
+  void sendFrame(string message);
+  virtual void onFramePending() { wakeupPipe.wakeup(); }
+  virtual void send(string message, RpcPriority priority);
 };
 }  // namespace codefs
 
-#endif  // __BIDIRECTIONAL_RPC_H__
\ No newline at end of file
+#endif  // __BIDIRECTIONAL_RPC_H__
@@ -0,0 +1,264 @@
+#include "ZmqRpcRouter.hpp"
+
+#include "TimeHandler.hpp"
+
+namespace codefs {
+namespace {
+// Peers heartbeat every few seconds, so a session this quiet is gone
+const int64_t SESSION_IDLE_TIMEOUT_MICROS = 60 * 1000 * 1000;
+const int64_t HEARTBEAT_INTERVAL_MS = 3000;
+}  // namespace
+
+ZmqRouterSession::ZmqRouterSession(ZmqRpcRouter* _router,
+                                   const string& _identity)
+    : RpcSession(_identity),
+      router(_router),
+      lastReceiveTime(TimeHandler::currentTimeMicros()) {}
+
+void ZmqRouterSession::onFramePending() { router->wakeupPipe.wakeup(); }
+
+void ZmqRouterSession::onIncoming() { router->notifyIncoming(); }
+
+void ZmqRouterSession::send(string message, RpcPriority priority) {
+  VLOG(1) << "SENDING " << message.length();
+  if (message.length() == 0) {
+    LOGFATAL << "Invalid message size";
+  }
+  router->queueFrame(identity, std::move(message), priority);
+}
+
+ZmqRpcRouter::ZmqRpcRouter(const string& _address)
+    : address(_address), running(false), incomingPending(false) {
+  context = shared_ptr<zmq::context_t>(new zmq::context_t(8));
+  LOG(INFO) << "Binding on address: " << address;
+  socket = shared_ptr<zmq::socket_t>(
+      new zmq::socket_t(*(context.get()), ZMQ_ROUTER));
+  // A client that comes back with its old identity, after a network change or
+  // a suspend, takes over its session from the dead connection
+  int handover = 1;
+  socket->setsockopt(ZMQ_ROUTER_HANDOVER, handover);
+  socket->bind(address);
+}
+
+ZmqRpcRouter::~ZmqRpcRouter() {
+  if (context.get() || socket.get()) {
+    LOGFATAL << "Tried to destroy a router without calling shutdown";
+  }
+}
+
+void ZmqRpcRouter::start() {
+  if (ioThread.get()) {
+    LOGFATAL << "Tried to start the io thread twice";
+  }
+  running = true;
+  ioThread.reset(new thread(&ZmqRpcRouter::runIoThread, this));
+}
+
+void ZmqRpcRouter::shutdown() {
+  if (ioThread.get()) {
+    running = false;
+    wakeupPipe.wakeup();
+    ioThread->join();
+    ioThread.reset();
+  }
+  socket->close();
+  socket.reset();
+  context->close();
+  context.reset();
+}
+
+vector<shared_ptr<RpcSession>> ZmqRpcRouter::getSessions() {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  vector<shared_ptr<RpcSession>> retval;
+  retval.reserve(sessions.size());
+  for (const auto& it : sessions) {
+    retval.push_back(it.second);
+  }
+  return retval;
+}
+
+vector<shared_ptr<ZmqRouterSession>> ZmqRpcRouter::getZmqSessions() {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  vector<shared_ptr<ZmqRouterSession>> retval;
+  retval.reserve(sessions.size());
+  for (const auto& it : sessions) {
+    retval.push_back(it.second);
+  }
+  return retval;
+}
+
+void ZmqRpcRouter::closeSession(const string& identity) {
+  lock_guard<recursive_mutex> guard(sessionsMutex);
+  if (sessions.erase(identity)) {
+    LOG(INFO) << "Closed session, " << sessions.size() << " left";
+  }
+}
+
+bool ZmqRpcRouter::waitForIncoming(int64_t timeoutMs) {
+  unique_lock<std::mutex> guard(incomingMutex);
+  bool result =
+      incomingCondition.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+                                 [this] { return incomingPending; });
+  incomingPending = false;
+  return result;
+}
+
+void ZmqRpcRouter::notifyIncoming() {
+  lock_guard<std::mutex> guard(incomingMutex);
+  incomingPending = true;
+  incomingCondition.notify_all();
+}
+
+void ZmqRpcRouter::queueFrame(const string& identity, string message,
+                              RpcPriority priority) {
+  outgoingFrames[priority].push(make_pair(identity, std::move(message)));
+  wakeupPipe.wakeup();
+}
+
+void ZmqRpcRouter::runIoThread() {
+  auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+  while (running) {
+    for (auto& session : getZmqSessions()) {
+      session->resendOverdueMessages();
+    }
+    receiveFrames();
+    expireIdleSessions();
+    flushPendingFrames();
+    flushOutgoingFrames();
+
+    auto msSinceLastHeartbeat =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
+            .count();
+    if (msSinceLastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
+      for (auto& session : getZmqSessions()) {
+        session->heartbeat();
+      }
+      lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      continue;
+    }
+
+    // Sleep until the socket has data, a session queues a frame, or it is
+    // time for the next heartbeat, retransmit or flush in any session.
+    int64_t timeoutMs = HEARTBEAT_INTERVAL_MS - msSinceLastHeartbeat;
+    for (auto& session : getZmqSessions()) {
+      int64_t resendMicros = session->microsUntilNextResend();
+      if (resendMicros >= 0) {
+        timeoutMs = min(timeoutMs, (resendMicros + 999) / 1000);
+      }
+      int64_t flushMicros = session->microsUntilFlush();
+      if (flushMicros >= 0) {
+        timeoutMs = min(timeoutMs, (flushMicros + 999) / 1000);
+      }
+    }
+    zmq::pollitem_t items[] = {
+        {(void*)(*socket), 0, ZMQ_POLLIN, 0},
+        {NULL, wakeupPipe.readFd(), ZMQ_POLLIN, 0},
+    };
+    int rc = zmq_poll(items, 2, long(timeoutMs));
+    if (rc < 0 && zmq_errno() != EINTR) {
+      LOGFATAL << "zmq_poll failed: " << zmq_strerror(zmq_errno());
+    }
+    if (items[1].revents & ZMQ_POLLIN) {
+      wakeupPipe.drain();
+    }
+  }
+  // Push out anything that was queued before we were asked to stop
+  for (auto& session : getZmqSessions()) {
+    session->flushPendingFrame();
+  }
+  flushOutgoingFrames();
+}
+
+void ZmqRpcRouter::receiveFrames() {
+  while (true) {
+    zmq::message_t identityMessage;
+    bool result = socket->recv(&identityMessage, ZMQ_DONTWAIT);
+    FATAL_IF_FALSE_NOT_EAGAIN(result);
+    if (!result) {
+      // Nothing to recieve
+      return;
+    }
+    if (!identityMessage.more()) {
+      LOGFATAL << "Expected more data!";
+    }
+    zmq::message_t message;
+    FATAL_IF_FALSE(socket->recv(&message));
+    if (message.more()) {
+      LOGFATAL << "DID NOT GET ALL";
+    }
+
+    string identity(identityMessage.data<char>(), identityMessage.size());
+    shared_ptr<ZmqRouterSession> session;
+    {
+      lock_guard<recursive_mutex> guard(sessionsMutex);
+      auto it = sessions.find(identity);
+      if (it == sessions.end()) {
+        session.reset(new ZmqRouterSession(this, identity));
+        sessions[identity] = session;
+        LOG(INFO) << "Got a new client, " << sessions.size() << " connected";
+      } else {
+        session = it->second;
+      }
+    }
+    session->lastReceiveTime = TimeHandler::currentTimeMicros();
+    VLOG(1) << "Got message with size " << message.size() << endl;
+    session->receive(message.data<char>(), message.size());
+  }
+}
+
+void ZmqRpcRouter::expireIdleSessions() {
+  int64_t now = TimeHandler::currentTimeMicros();
+  for (auto& session : getZmqSessions()) {
+    if (now - session->lastReceiveTime > SESSION_IDLE_TIMEOUT_MICROS) {
+      LOG(INFO) << "Client went quiet";
+      closeSession(session->getIdentity());
+    }
+  }
+}
+
+void ZmqRpcRouter::flushPendingFrames() {
+  auto currentSessions = getZmqSessions();
+  int64_t shortestWait = 0;
+  for (auto& session : currentSessions) {
+    int64_t flushMicros = session->microsUntilFlush();
+    if (flushMicros > 0 && flushMicros < 1000) {
+      shortestWait = max(shortestWait, flushMicros);
+    }
+  }
+  if (shortestWait) {
+    usleep(shortestWait);
+  }
+  for (auto& session : currentSessions) {
+    if (session->microsUntilFlush() == 0) {
+      session->flushPendingFrame();
+    }
+  }
+}
+
+void ZmqRpcRouter::flushOutgoingFrames() {
+  pair<string, string> frame;
+  while (true) {
+    // Start from the most urgent class after every frame
+    int priority = 0;
+    while (priority < NUM_PRIORITIES && !outgoingFrames[priority].pop(&frame)) {
+      priority++;
+    }
+    if (priority == NUM_PRIORITIES) {
+      return;
+    }
+    {
+      lock_guard<recursive_mutex> guard(sessionsMutex);
+      if (sessions.find(frame.first) == sessions.end()) {
+        // The session was closed after this was queued
+        continue;
+      }
+    }
+    FATAL_IF_FALSE(socket->send(
+        zmq::message_t(frame.first.data(), frame.first.size()), ZMQ_SNDMORE));
+    FATAL_IF_FALSE(socket->send(zmq::message_t(), ZMQ_SNDMORE));
+    zmq::message_t data = stringToZmqMessage(std::move(frame.second));
+    FATAL_IF_FALSE(socket->send(data));
+  }
+}
+}  // namespace codefs
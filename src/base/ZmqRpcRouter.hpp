@@ -0,0 +1,77 @@
+#ifndef __ZMQ_RPC_ROUTER_H__
+#define __ZMQ_RPC_ROUTER_H__
+
+#include "MpscQueue.hpp"
+#include "RpcTransport.hpp"
+#include "WakeupPipe.hpp"
+
+namespace codefs {
+class ZmqRpcRouter;
+
+// The rpc state for one peer of a ZmqRpcRouter.  The identity is the
+// peer's zmq routing identity.
+class ZmqRouterSession : public RpcSession {
+ public:
+  ZmqRouterSession(ZmqRpcRouter* _router, const string& _identity);
+  virtual ~ZmqRouterSession() {}
+
+ protected:
+  friend class ZmqRpcRouter;
+
+  ZmqRpcRouter* router;
+  // Only touched by the router's io thread
+  int64_t lastReceiveTime;
+
+  virtual void onFramePending();
+  virtual void onIncoming();
+  virtual void send(string message, RpcPriority priority);
+};
+
+// Binds a ROUTER socket.  One io thread owns the socket and drives all of
+// the sessions.
+class ZmqRpcRouter : public RpcRouter {
+ public:
+  explicit ZmqRpcRouter(const string& address);
+  virtual ~ZmqRpcRouter();
+  virtual void start();
+  virtual void shutdown();
+
+  virtual vector<shared_ptr<RpcSession>> getSessions();
+  virtual void closeSession(const string& identity);
+  virtual bool waitForIncoming(int64_t timeoutMs);
+
+ protected:
+  friend class ZmqRouterSession;
+
+  string address;
+  shared_ptr<zmq::context_t> context;
+  shared_ptr<zmq::socket_t> socket;
+
+  recursive_mutex sessionsMutex;
+  unordered_map<string, shared_ptr<ZmqRouterSession>> sessions;
+
+  // (identity, frame) pairs waiting for the io thread, per priority class
+  MpscQueue<pair<string, string>> outgoingFrames[NUM_PRIORITIES];
+  shared_ptr<thread> ioThread;
+  atomic<bool> running;
+  WakeupPipe wakeupPipe;
+
+  std::mutex incomingMutex;
+  std::condition_variable incomingCondition;
+  bool incomingPending;
+
+  vector<shared_ptr<ZmqRouterSession>> getZmqSessions();
+  void runIoThread();
+  void receiveFrames();
+  void expireIdleSessions();
+  // Flushes every session whose coalescing window has closed, sleeping off
+  // windows that are shorter than the poll resolution first
+  void flushPendingFrames();
+  void flushOutgoingFrames();
+  void notifyIncoming();
+  void queueFrame(const string& identity, string message,
+                  RpcPriority priority);
+};
+}  // namespace codefs
+
+#endif  // __ZMQ_RPC_ROUTER_H__
@@ -4,47 +4,54 @@
 
 namespace codefs {
 Client::Client(const string& _address, shared_ptr<ClientFileSystem> _fileSystem)
-    : address(_address), fileSystem(_fileSystem) {
+    : address(_address),
+      fileSystem(_fileSystem),
+      metadataDictionaryId(0),
+      metadataDictionaryTime(0) {
   MessageReader reader;
   MessageWriter writer;
-  rpc =
-      shared_ptr<ZmqBiDirectionalRpc>(new ZmqBiDirectionalRpc(address, false));
+  rpc = createRpcEndpoint(address, false);
   writer.start();
   writer.writePrimitive<unsigned char>(CLIENT_SERVER_FETCH_METADATA);
   writer.writePrimitive<int>(1);
   writer.writePrimitive<string>(string("/"));
-  RpcId initId = rpc->request(writer.finish());
+  future<string> initReply = rpc->requestAsync(writer.finish());
 
   while (true) {
     LOG(INFO) << "Waiting for init...";
-    {
-      lock_guard<std::recursive_mutex> lock(mutex);
-      rpc->update();
-      rpc->heartbeat();
-      if (rpc->hasIncomingReplyWithId(initId)) {
-        string payload = rpc->consumeIncomingReplyWithId(initId);
-        reader.load(payload);
-        auto path = reader.readPrimitive<string>();
-        auto data = reader.readPrimitive<string>();
-        fileSystem->deserializeFileDataCompressed(path, data);
-        break;
-      }
+    rpc->update();
+    rpc->heartbeat();
+    // Nobody else is pumping the rpc yet, so wait here between updates
+    if (initReply.wait_for(std::chrono::seconds(1)) ==
+        std::future_status::ready) {
+      reader.load(initReply.get());
+      auto path = reader.readPrimitive<string>();
+      auto data = reader.readPrimitive<string>();
+      fileSystem->deserializeFileDataCompressed(path, data);
+      break;
     }
-    sleep(1);
   }
+
+  // From now on the socket belongs to the rpc's io thread
+  rpc->start();
 }
 
 int Client::update() {
   MessageReader reader;
   MessageWriter writer;
-  lock_guard<std::recursive_mutex> lock(mutex);
-  rpc->update();
+
+  if (rpc->consumePeerReset()) {
+    // The new server has never heard of our dictionary, so fetch its own
+    metadataDictionaryId = 0;
+    metadataDictionaryTime = 0;
+    validateCache();
+  }
+  refreshMetadataDictionary();
 
   while (rpc->hasIncomingRequest()) {
     auto idPayload = rpc->getFirstIncomingRequest();
     auto id = idPayload.id;
-    string payload = idPayload.payload;
-    reader.load(payload);
+    reader.load(std::move(idPayload.payload));
     unsigned char header = reader.readPrimitive<unsigned char>();
     switch (header) {
       case SERVER_CLIENT_METADATA_UPDATE: {
@@ -75,8 +82,64 @@ int Client::update() {
   return 0;
 }
 
+void Client::refreshMetadataDictionary() {
+  if ((rpc->getNegotiatedFeatures() & FEATURE_COMPACT_METADATA) == 0) {
+    return;
+  }
+  int64_t now = TimeHandler::currentTimeMicros();
+  if (metadataDictionaryTime &&
+      now - metadataDictionaryTime < METADATA_DICTIONARY_REFRESH_MICROS) {
+    return;
+  }
+  metadataDictionaryTime = now;
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_FETCH_DICTIONARY);
+  string result = fileRpc(writer.finish());
+  MessageReader reader;
+  reader.load(std::move(result));
+  uint32_t dictionaryId = reader.readPrimitive<uint32_t>();
+  string dictionary = reader.readPrimitive<string>();
+  if (dictionaryId == 0) {
+    // The server is still training, or has nothing to train on yet
+    metadataDictionaryTime = now - METADATA_DICTIONARY_REFRESH_MICROS +
+                             METADATA_DICTIONARY_RETRY_MICROS;
+    return;
+  }
+  if (addCodecDictionary(dictionary) != dictionaryId) {
+    LOG(ERROR) << "Metadata dictionary " << dictionaryId << " is corrupt";
+    return;
+  }
+  LOG(INFO) << "Using metadata dictionary " << dictionaryId;
+  metadataDictionaryId = dictionaryId;
+}
+
+void Client::validateCache() {
+  auto fingerprints = fileSystem->getNodeFingerprints();
+  LOG(INFO) << "Server restarted, validating " << fingerprints.size()
+            << " cached nodes";
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_VALIDATE_CACHE);
+  writer.writePrimitive<int>(fingerprints.size());
+  for (const auto& it : fingerprints) {
+    writer.writePrimitive<string>(it.first);
+    writer.writePrimitive<uint64_t>(it.second);
+  }
+  string result = fileRpc(writer.finish());
+  MessageReader reader;
+  reader.load(std::move(result));
+  int numChanged = reader.readPrimitive<int>();
+  for (int a = 0; a < numChanged; a++) {
+    FileData fileData = reader.readProto<FileData>();
+    LOG(INFO) << "STALE PATH: " << fileData.path();
+    fileSystem->setNode(fileData);
+    fileSystem->forgetCachedFile(fileData.path());
+  }
+  fileSystem->invalidateVfsCache();
+}
+
 vector<optional<FileData>> Client::getNodes(const vector<string>& paths) {
-  vector<RpcId> rpcIds;
   string payload;
   vector<string> metadataToFetch;
   for (auto path : paths) {
@@ -89,9 +152,7 @@ vector<optional<FileData>> Client::getNodes(const vector<string>& paths) {
   }
 
   if (!metadataToFetch.empty()) {
-    RpcId id;
     {
-      lock_guard<std::recursive_mutex> lock(mutex);
       MessageWriter writer;
       writer.start();
       writer.writePrimitive<unsigned char>(CLIENT_SERVER_FETCH_METADATA);
@@ -99,30 +160,19 @@ vector<optional<FileData>> Client::getNodes(const vector<string>& paths) {
       for (auto s : metadataToFetch) {
         writer.writePrimitive<string>(s);
       }
-      payload = writer.finish();
-      id = rpc->request(payload);
-    }
-    rpcIds.push_back(id);
-    string result;
-    while (true) {
-      usleep(1);
-      {
-        lock_guard<std::recursive_mutex> lock(mutex);
-        if (rpc->hasIncomingReplyWithId(id)) {
-          result = rpc->consumeIncomingReplyWithId(id);
-          break;
-        }
+      uint32_t dictionaryId = metadataDictionaryId;
+      if (dictionaryId) {
+        writer.writePrimitive<uint32_t>(dictionaryId);
       }
+      payload = writer.finish();
     }
-    {
-      lock_guard<std::recursive_mutex> lock(mutex);
-      MessageReader reader;
-      reader.load(result);
-      while (reader.sizeRemaining()) {
-        auto path = reader.readPrimitive<string>();
-        auto data = reader.readPrimitive<string>();
-        fileSystem->deserializeFileDataCompressed(path, data);
-      }
+    string result = fileRpc(std::move(payload));
+    MessageReader reader;
+    reader.load(std::move(result));
+    while (reader.sizeRemaining()) {
+      auto path = reader.readPrimitive<string>();
+      auto data = reader.readPrimitive<string>();
+      fileSystem->deserializeFileDataCompressed(path, data);
     }
   }
 
@@ -143,25 +193,18 @@ vector<optional<FileData>> Client::getNodes(const vector<string>& paths) {
                        << " is invalid for too long, demanding new version "
                           "from server";
             string payload;
-            {
-              lock_guard<std::recursive_mutex> lock(mutex);
-              MessageWriter writer;
-              writer.start();
-              writer.writePrimitive<unsigned char>(
-                  CLIENT_SERVER_FETCH_METADATA);
-              writer.writePrimitive<int>(1);
-              writer.writePrimitive<string>(path);
-              payload = writer.finish();
-            }
-            string result = fileRpc(payload);
-            {
-              lock_guard<std::recursive_mutex> lock(mutex);
-              MessageReader reader;
-              reader.load(result);
-              auto path = reader.readPrimitive<string>();
-              auto data = reader.readPrimitive<string>();
-              fileSystem->deserializeFileDataCompressed(path, data);
-            }
+            MessageWriter writer;
+            writer.start();
+            writer.writePrimitive<unsigned char>(CLIENT_SERVER_FETCH_METADATA);
+            writer.writePrimitive<int>(1);
+            writer.writePrimitive<string>(path);
+            payload = writer.finish();
+            string result = fileRpc(std::move(payload));
+            MessageReader reader;
+            reader.load(std::move(result));
+            auto path = reader.readPrimitive<string>();
+            auto data = reader.readPrimitive<string>();
+            fileSystem->deserializeFileDataCompressed(path, data);
           } else {
             usleep(100 * 1000);
           }
@@ -222,29 +265,26 @@ int Client::open(const string& path, int flags) {
       fileSystem->addOwnedFileContents(path, fd, *cachedData, readOnly);
     } else {
       string payload;
-      {
-        lock_guard<std::recursive_mutex> lock(mutex);
-        fileSystem->invalidateVfsCache();
-        writer.start();
-        writer.writePrimitive<unsigned char>(CLIENT_SERVER_REQUEST_FILE);
-        writer.writePrimitive<string>(path);
-        writer.writePrimitive<int>(flags);
-        payload = writer.finish();
-      }
-      string result = fileRpc(payload);
-      {
-        lock_guard<std::recursive_mutex> lock(mutex);
-        reader.load(result);
-        int rpcErrno = reader.readPrimitive<int>();
-        if (rpcErrno) {
-          errno = rpcErrno;
-          return -1;
-        }
-        string fileContents = decompressString(reader.readPrimitive<string>());
-        LOG(INFO) << "READ FILE: " << path << " WITH CONTENTS SIZE "
-                  << fileContents.size();
-        fileSystem->addOwnedFileContents(path, fd, fileContents, readOnly);
+      fileSystem->invalidateVfsCache();
+      writer.start();
+      writer.writePrimitive<unsigned char>(CLIENT_SERVER_REQUEST_FILE);
+      writer.writePrimitive<string>(path);
+      writer.writePrimitive<int>(flags);
+      payload = writer.finish();
+      // File contents shouldn't hold up other metadata calls
+      string result = fileRpc(std::move(payload), PRIORITY_BULK, path);
+      reader.load(std::move(result));
+      int rpcErrno = reader.readPrimitive<int>();
+      if (rpcErrno) {
+        errno = rpcErrno;
+        return -1;
       }
+      ByteView compressed = reader.readView();
+      string fileContents =
+          decompressPayload(compressed.data, compressed.size);
+      LOG(INFO) << "READ FILE: " << path << " WITH CONTENTS SIZE "
+                << fileContents.size();
+      fileSystem->addOwnedFileContents(path, fd, fileContents, readOnly);
     }
   } else {
     LOG(INFO) << "FILE IS ALREADY IN LOCAL CACHE, SKIPPING READ";
@@ -271,31 +311,25 @@ int Client::create(const string& path, int flags, mode_t mode) {
       LOGFATAL << "TRIED TO CREATE A FILE THAT IS CACHED";
     } else {
       string payload;
-      {
-        lock_guard<std::recursive_mutex> lock(mutex);
-        fileSystem->invalidateVfsCache();
-        writer.start();
-        writer.writePrimitive<unsigned char>(CLIENT_SERVER_CREATE_FILE);
-        writer.writePrimitive<string>(path);
-        writer.writePrimitive<int>(flags);
-        writer.writePrimitive<int>(mode);
-        payload = writer.finish();
-      }
+      fileSystem->invalidateVfsCache();
+      writer.start();
+      writer.writePrimitive<unsigned char>(CLIENT_SERVER_CREATE_FILE);
+      writer.writePrimitive<string>(path);
+      writer.writePrimitive<int>(flags);
+      writer.writePrimitive<int>(mode);
+      payload = writer.finish();
       // Create an invalid node until we get the real one
       fileSystem->createStub(path);
-      string result = fileRpc(payload);
-      {
-        lock_guard<std::recursive_mutex> lock(mutex);
-        reader.load(result);
-        int rpcErrno = reader.readPrimitive<int>();
-        if (rpcErrno) {
-          errno = rpcErrno;
-          fileSystem->deleteNode(path);
-          return -1;
-        }
-        LOG(INFO) << "CREATED FILE: " << path;
-        fileSystem->addOwnedFileContents(path, fd, "", readOnly);
+      string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+      reader.load(std::move(result));
+      int rpcErrno = reader.readPrimitive<int>();
+      if (rpcErrno) {
+        errno = rpcErrno;
+        fileSystem->deleteNode(path);
+        return -1;
       }
+      LOG(INFO) << "CREATED FILE: " << path;
+      fileSystem->addOwnedFileContents(path, fd, "", readOnly);
     }
   } else {
     LOGFATAL << "Tried to create a file that is already owned!";
@@ -313,36 +347,32 @@ int Client::close(const string& path, int fd) {
   fileSystem->closeOwnedFile(path, fd, &readOnly, &content);
 
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    fileSystem->invalidateVfsCache();
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_RETURN_FILE);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<bool>(readOnly);
-    fileSystem->setCachedFile(path, content);
-    if (readOnly) {
-      LOG(INFO) << "RETURNED FILE " << path << " TO SERVER READ-ONLY";
-    } else {
-      writer.writePrimitive<string>(compressString(content));
-      LOG(INFO) << "RETURNED FILE " << path << " TO SERVER WITH "
-                << content.size() << " BYTES";
-    }
-    payload = writer.finish();
-  }
-
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-      return -1;
-    }
-    return 0;
+  fileSystem->invalidateVfsCache();
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_RETURN_FILE);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<bool>(readOnly);
+  fileSystem->setCachedFile(path, content);
+  if (readOnly) {
+    LOG(INFO) << "RETURNED FILE " << path << " TO SERVER READ-ONLY";
+  } else {
+    writer.writePrimitive<string>(compressPayload(
+        content, codecOptionsForPeer(rpc->getNegotiatedFeatures(),
+                                     rpc->getCompressionLevel())));
+    LOG(INFO) << "RETURNED FILE " << path << " TO SERVER WITH "
+              << content.size() << " BYTES";
+  }
+  payload = writer.finish();
+
+  string result = fileRpc(std::move(payload), PRIORITY_BULK, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+    return -1;
   }
+  return 0;
 }
 
 int Client::pread(const string& path, char* buf, int64_t size, int64_t offset) {
@@ -359,25 +389,19 @@ int Client::mkdir(const string& path, mode_t mode) {
   MessageWriter writer;
   fileSystem->invalidatePathAndParent(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_MKDIR);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<int>(mode);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_MKDIR);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<int>(mode);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 
 int Client::unlink(const string& path) {
@@ -416,51 +440,39 @@ int Client::chmod(const string& path, int mode) {
   MessageWriter writer;
   fileSystem->invalidatePath(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_CHMOD);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<int>(mode);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_CHMOD);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<int>(mode);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 int Client::lchown(const string& path, int64_t uid, int64_t gid) {
   MessageReader reader;
   MessageWriter writer;
   fileSystem->invalidatePath(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_LCHOWN);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<int64_t>(uid);
-    writer.writePrimitive<int64_t>(gid);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_LCHOWN);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<int64_t>(uid);
+  writer.writePrimitive<int64_t>(gid);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 int Client::truncate(const string& path, int64_t size) {
   MessageReader reader;
@@ -472,25 +484,19 @@ int Client::truncate(const string& path, int64_t size) {
 
   fileSystem->invalidatePath(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_TRUNCATE);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<int64_t>(size);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_TRUNCATE);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<int64_t>(size);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 int Client::statvfs(struct statvfs* stbuf) {
   StatVfsData statVfsProto;
@@ -503,25 +509,19 @@ int Client::statvfs(struct statvfs* stbuf) {
     statVfsProto = *cachedVfs;
   } else {
     string payload;
-    {
-      lock_guard<std::recursive_mutex> lock(mutex);
-      writer.start();
-      writer.writePrimitive<unsigned char>(CLIENT_SERVER_STATVFS);
-      payload = writer.finish();
-    }
-    string result = fileRpc(payload);
-    {
-      lock_guard<std::recursive_mutex> lock(mutex);
-      reader.load(result);
-      int res = reader.readPrimitive<int>();
-      int rpcErrno = reader.readPrimitive<int>();
-      statVfsProto = reader.readProto<StatVfsData>();
-      if (res) {
-        errno = rpcErrno;
-        return res;
-      }
-      fileSystem->setVfsCache(statVfsProto);
+    writer.start();
+    writer.writePrimitive<unsigned char>(CLIENT_SERVER_STATVFS);
+    payload = writer.finish();
+    string result = fileRpc(std::move(payload));
+    reader.load(std::move(result));
+    int res = reader.readPrimitive<int>();
+    int rpcErrno = reader.readPrimitive<int>();
+    statVfsProto = reader.readProto<StatVfsData>();
+    if (res) {
+      errno = rpcErrno;
+      return res;
     }
+    fileSystem->setVfsCache(statVfsProto);
   }
   stbuf->f_bsize = statVfsProto.bsize();
   stbuf->f_frsize = statVfsProto.frsize();
@@ -542,53 +542,41 @@ int Client::utimensat(const string& path, const struct timespec ts[2]) {
   MessageWriter writer;
   fileSystem->invalidatePath(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_UTIMENSAT);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<int64_t>(ts[0].tv_sec);
-    writer.writePrimitive<int64_t>(ts[0].tv_nsec);
-    writer.writePrimitive<int64_t>(ts[1].tv_sec);
-    writer.writePrimitive<int64_t>(ts[1].tv_nsec);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_UTIMENSAT);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<int64_t>(ts[0].tv_sec);
+  writer.writePrimitive<int64_t>(ts[0].tv_nsec);
+  writer.writePrimitive<int64_t>(ts[1].tv_sec);
+  writer.writePrimitive<int64_t>(ts[1].tv_nsec);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 int Client::lremovexattr(const string& path, const string& name) {
   MessageReader reader;
   MessageWriter writer;
   fileSystem->invalidatePath(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_LREMOVEXATTR);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<string>(name);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_LREMOVEXATTR);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<string>(name);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 int Client::lsetxattr(const string& path, const string& name,
                       const string& value, int64_t size, int flags) {
@@ -596,28 +584,22 @@ int Client::lsetxattr(const string& path, const string& name,
   MessageWriter writer;
   fileSystem->invalidatePath(path);
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(CLIENT_SERVER_LSETXATTR);
-    writer.writePrimitive<string>(path);
-    writer.writePrimitive<string>(name);
-    writer.writePrimitive<string>(value);
-    writer.writePrimitive<int64_t>(size);
-    writer.writePrimitive<int>(flags);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(CLIENT_SERVER_LSETXATTR);
+  writer.writePrimitive<string>(path);
+  writer.writePrimitive<string>(name);
+  writer.writePrimitive<string>(value);
+  writer.writePrimitive<int64_t>(size);
+  writer.writePrimitive<int>(flags);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 
 int Client::twoPathsNoReturn(unsigned char header, const string& from,
@@ -625,66 +607,107 @@ int Client::twoPathsNoReturn(unsigned char header, const string& from,
   MessageReader reader;
   MessageWriter writer;
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(header);
-    writer.writePrimitive<string>(from);
-    writer.writePrimitive<string>(to);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(header);
+  writer.writePrimitive<string>(from);
+  writer.writePrimitive<string>(to);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, from);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 
 int Client::singlePathNoReturn(unsigned char header, const string& path) {
   MessageReader reader;
   MessageWriter writer;
   string payload;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    writer.start();
-    writer.writePrimitive<unsigned char>(header);
-    writer.writePrimitive<string>(path);
-    payload = writer.finish();
-  }
-  string result = fileRpc(payload);
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    reader.load(result);
-    int res = reader.readPrimitive<int>();
-    int rpcErrno = reader.readPrimitive<int>();
-    if (res) {
-      errno = rpcErrno;
-    }
-    return res;
-  }
+  writer.start();
+  writer.writePrimitive<unsigned char>(header);
+  writer.writePrimitive<string>(path);
+  payload = writer.finish();
+  string result = fileRpc(std::move(payload), PRIORITY_INTERACTIVE, path);
+  reader.load(std::move(result));
+  int res = reader.readPrimitive<int>();
+  int rpcErrno = reader.readPrimitive<int>();
+  if (res) {
+    errno = rpcErrno;
+  }
+  return res;
 }
 
-string Client::fileRpc(const string& payload) {
-  RpcId id;
-  {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    id = rpc->request(payload);
+vector<int> Client::runCompound(CompoundRequest* compound) {
+  // Our copy of an open file would overwrite the server's when it is
+  // closed, so truncating one has to go through truncate().  The compound
+  // fails there with EBUSY, as if the server had stopped at it.
+  int busyOp = -1;
+  for (int a = 0; a < compound->size(); a++) {
+    const auto& op = compound->getOps()[a];
+    if (get<0>(op) == CLIENT_SERVER_TRUNCATE &&
+        fileSystem->ownsPathContents(get<1>(op))) {
+      LOG(ERROR) << "Tried to truncate an open file in a compound: "
+                 << get<1>(op);
+      busyOp = a;
+      break;
+    }
   }
-  while (true) {
-    usleep(1);
-    {
-      lock_guard<std::recursive_mutex> lock(mutex);
-      if (rpc->hasIncomingReplyWithId(id)) {
-        return rpc->consumeIncomingReplyWithId(id);
+  if (busyOp >= 0) {
+    compound->dropOpsFrom(busyOp);
+  }
+
+  vector<int> results;
+  if (compound->size()) {
+    fileSystem->invalidateVfsCache();
+    for (const auto& it : compound->getOps()) {
+      const string& from = get<1>(it);
+      const string& to = get<2>(it);
+      switch (get<0>(it)) {
+        case CLIENT_SERVER_RENAME:
+          fileSystem->renameOwnedFileIfItExists(from, to);
+          fileSystem->invalidatePathAndParentAndChildren(from);
+          fileSystem->invalidatePathAndParentAndChildren(to);
+          break;
+        case CLIENT_SERVER_CHMOD:
+        case CLIENT_SERVER_LCHOWN:
+        case CLIENT_SERVER_TRUNCATE:
+        case CLIENT_SERVER_UTIMENSAT:
+          fileSystem->invalidatePath(from);
+          break;
+        default:
+          fileSystem->invalidatePathAndParent(from);
+          if (!to.empty()) {
+            fileSystem->invalidatePathAndParent(to);
+          }
+          break;
       }
     }
+
+    // Keeps the ops in order with other calls on the first path they touch
+    string orderingKey = get<1>(compound->getOps().front());
+    string result =
+        fileRpc(compound->finish(), PRIORITY_INTERACTIVE, orderingKey);
+    results = CompoundRequest::readResults(std::move(result));
+  }
+  if (busyOp >= 0) {
+    if (int(results.size()) == busyOp) {
+      results.push_back(EBUSY);
+    }
+    // Whatever came after it never runs, start the next compound empty
+    compound->finish();
   }
+  return results;
+}
+
+string Client::fileRpc(string payload, RpcPriority priority,
+                       const string& orderingKey) {
+  future<string> reply;
+  reply = rpc->requestAsync(std::move(payload), priority, orderingKey);
+  // Sleep until the update thread hands us the reply
+  return reply.get();
 }
 
 }  // namespace codefs
\ No newline at end of file
@@ -1,19 +1,19 @@
 #include "Headers.hpp"
 
 #include "ClientFileSystem.hpp"
+#include "Codec.hpp"
+#include "CompoundRequest.hpp"
 #include "MessageReader.hpp"
 #include "MessageWriter.hpp"
-#include "ZmqBiDirectionalRpc.hpp"
+#include "RpcTransport.hpp"
+#include "TimeHandler.hpp"
 
 namespace codefs {
 class Client {
  public:
   Client(const string& _address, shared_ptr<ClientFileSystem> _fileSystem);
   int update();
-  inline void heartbeat() {
-    lock_guard<std::recursive_mutex> lock(mutex);
-    rpc->heartbeat();
-  }
+  inline void waitForWork() { rpc->waitForIncoming(1000); }
 
   optional<FileData> getNode(const string& path) { return getNodes({path})[0]; }
   vector<optional<FileData>> getNodes(const vector<string>& paths);
@@ -48,18 +48,39 @@ class Client {
   int lsetxattr(const string& path, const string& name, const string& value,
                 int64_t size, int flags);
 
+  // Sends every op in one request.  Returns the errno of each op that ran,
+  // 0 for success.  The server stops after the first failure, so a short
+  // list means the rest never ran.  Truncating a file that is open here
+  // fails with EBUSY instead of being sent.
+  vector<int> runCompound(CompoundRequest* compound);
+
   optional<int64_t> getSizeOverride(const string& path) {
     return fileSystem->getSizeOverride(path);
   }
 
  protected:
   string address;
-  shared_ptr<ZmqBiDirectionalRpc> rpc;
+  shared_ptr<RpcEndpoint> rpc;
   shared_ptr<ClientFileSystem> fileSystem;
-  recursive_mutex mutex;
+  // Read by the fuse threads, written by the update thread
+  atomic<uint32_t> metadataDictionaryId;
+  int64_t metadataDictionaryTime;
+  static const int64_t METADATA_DICTIONARY_REFRESH_MICROS =
+      10 * 60 * 1000 * 1000ll;
+  static const int64_t METADATA_DICTIONARY_RETRY_MICROS = 10 * 1000 * 1000;
+
   int twoPathsNoReturn(unsigned char header, const string& from,
                        const string& to);
   int singlePathNoReturn(unsigned char header, const string& path);
-  string fileRpc(const string& payload);
+  // Checks every cached node against the server after it restarted, since
+  // any updates it was about to push us are gone
+  void validateCache();
+  // Fetches the server's metadata dictionary once it can serve one, and
+  // again every so often as the server retrains it
+  void refreshMetadataDictionary();
+  // Calls that touch a path pass it as the ordering key, so calls on the
+  // same path reach the server in order while the rest run concurrently.
+  string fileRpc(string payload, RpcPriority priority = PRIORITY_INTERACTIVE,
+                 const string& orderingKey = string());
 };
 }  // namespace codefs
\ No newline at end of file
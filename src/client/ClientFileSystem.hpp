@@ -125,6 +125,22 @@ class ClientFileSystem : public FileSystem {
     fileCache[path] = data;
   }
 
+  inline void forgetCachedFile(const string& path) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    fileCache.erase(path);
+  }
+
+  // The fingerprint of every node we hold, to check against the server
+  inline vector<pair<string, uint64_t>> getNodeFingerprints() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    vector<pair<string, uint64_t>> retval;
+    retval.reserve(allFileData.size());
+    for (const auto& it : allFileData) {
+      retval.push_back(make_pair(it.first, fingerprint(it.second)));
+    }
+    return retval;
+  }
+
   inline void invalidateVfsCache() {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     cachedStatVfsProto.reset();
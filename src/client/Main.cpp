@@ -73,6 +73,10 @@ int main(int argc, char *argv[]) {
          cxxopts::value<int>()->default_value("2298"))  //
         ("hostname", "Hostname to connect to",
          cxxopts::value<std::string>())  //
+        ("address",
+         "Address to connect to instead of the hostname and port, e.g. "
+         "shm:///tmp/codefs-shm for a server on this host",
+         cxxopts::value<std::string>())  //
         ("mountpoint", "Where to mount the FS for server access",
          cxxopts::value<std::string>()->default_value("/tmp/clientmount"))  //
         ("v,verbose", "Enable verbose logging",
@@ -114,32 +118,30 @@ int main(int argc, char *argv[]) {
       }
     }
 
-    int port = result["port"].as<int>();
+    string address;
+    if (result.count("address")) {
+      address = result["address"].as<string>();
+    } else {
+      int port = result["port"].as<int>();
+      address = string("tcp://") + result["hostname"].as<string>() + ":" +
+                to_string(port);
+    }
 
     shared_ptr<ClientFileSystem> fileSystem(
         new ClientFileSystem(result["mountpoint"].as<string>()));
-    shared_ptr<Client> client(new Client(string("tcp://") +
-                                             result["hostname"].as<string>() +
-                                             ":" + to_string(port),
-                                         fileSystem));
+    shared_ptr<Client> client(new Client(address, fileSystem));
     sleep(1);
 
     auto future = std::async(std::launch::async, [client] {
-      auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+      // Network I/O and heartbeats happen on the rpc's own thread, this loop
+      // only handles requests pushed from the server.
       while (true) {
         int retval = client->update();
         if (retval) {
           return retval;
         }
-        auto msSinceLastHeartbeat =
-            std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
-                .count();
-        if (msSinceLastHeartbeat >= 3000) {
-          client->heartbeat();
-          lastHeartbeatTime = std::chrono::high_resolution_clock::now();
-        }
-        usleep(1);
+        // Sleep until the rpc thread queues something for us
+        client->waitForWork();
       }
     });
 
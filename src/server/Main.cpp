@@ -86,6 +86,10 @@ int main(int argc, char *argv[]) {
         ("h,help", "Print help")  //
         ("port", "Port to listen on",
          cxxopts::value<int>()->default_value("2298"))  //
+        ("address",
+         "Address to listen on instead of the port, e.g. "
+         "shm:///tmp/codefs-shm for clients on this host",
+         cxxopts::value<std::string>())  //
         ("path", "Absolute path containing code for codefs to monitor",
          cxxopts::value<std::string>()->default_value(""))  //
         ("v,verbose", "Enable verbose logging",
@@ -163,10 +167,12 @@ int main(int argc, char *argv[]) {
 
     shared_ptr<ServerFileSystem> fileSystem(
         new ServerFileSystem(ROOT_PATH.string(), excludes));
-    shared_ptr<Server> server(
-        new Server(string("tcp://") + "0.0.0.0" + ":" +
-                       to_string(result["port"].as<int>()),
-                   fileSystem));
+    string address = string("tcp://") + "0.0.0.0" + ":" +
+                     to_string(result["port"].as<int>());
+    if (result.count("address")) {
+      address = result["address"].as<string>();
+    }
+    shared_ptr<Server> server(new Server(address, fileSystem));
 
     globalFileSystem = fileSystem;
     shared_ptr<thread> watchThread(new thread(runFsWatch));
@@ -179,21 +185,15 @@ int main(int argc, char *argv[]) {
     server->init();
     usleep(100 * 1000);
 
-    auto lastHeartbeatTime = std::chrono::high_resolution_clock::now();
+    // Network I/O and heartbeats happen on the rpc's own thread, this loop
+    // only dispatches requests.
     while (true) {
       int retval = server->update();
       if (retval) {
         return retval;
       }
-      auto msSinceLastHeartbeat =
-          std::chrono::duration_cast<std::chrono::milliseconds>(
-              std::chrono::high_resolution_clock::now() - lastHeartbeatTime)
-              .count();
-      if (msSinceLastHeartbeat >= 3000) {
-        server->heartbeat();
-        lastHeartbeatTime = std::chrono::high_resolution_clock::now();
-      }
-      usleep(1);
+      // Sleep until the rpc thread queues something for us
+      server->waitForWork();
     }
   } catch (cxxopts::OptionException &oe) {
     cout << "Exception: " << oe.what() << "\n" << endl;
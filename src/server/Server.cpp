@@ -1,93 +1,49 @@
 #include "Server.hpp"
 
-#include "ZmqBiDirectionalRpc.hpp"
 
 namespace codefs {
 Server::Server(const string &_address, shared_ptr<ServerFileSystem> _fileSystem)
-    : address(_address), fileSystem(_fileSystem), clientFd(-1) {}
+    : address(_address),
+      fileSystem(_fileSystem),
+      metadataDictionaryId(0),
+      metadataDictionaryTime(0) {}
 
 void Server::init() {
-  lock_guard<std::recursive_mutex> lock(rpcMutex);
-  rpc = shared_ptr<ZmqBiDirectionalRpc>(new ZmqBiDirectionalRpc(address, true));
+  router = createRpcRouter(address);
+  router->start();
 }
 
 int Server::update() {
-  {
-    lock_guard<std::recursive_mutex> lock(rpcMutex);
-    rpc->update();
+  for (const auto& session : router->getSessions()) {
+    updateSession(session);
   }
+  flushMetadataUpdates();
+  refreshMetadataDictionary();
+  return 0;
+}
 
+void Server::updateSession(const shared_ptr<RpcSession> &rpc) {
   MessageWriter writer;
   MessageReader reader;
-  while (true) {
-    RpcId id;
-    string payload;
-    {
-      lock_guard<std::recursive_mutex> lock(rpcMutex);
-      if (!rpc->hasIncomingRequest()) {
-        break;
-      }
-      auto idPayload = rpc->getFirstIncomingRequest();
-      id = idPayload.id;
-      payload = idPayload.payload;
-    }
-    reader.load(payload);
+  while (rpc->hasIncomingRequest()) {
+    auto idPayload = rpc->getFirstIncomingRequest();
+    RpcId id = idPayload.id;
+    int64_t payloadSize = idPayload.payload.size();
+    // The reader keeps the payload and hands it back to the buffer pool,
+    // where the writer picks it up for the next reply
+    reader.load(std::move(idPayload.payload));
     unsigned char header = reader.readPrimitive<unsigned char>();
     VLOG(1) << "CONSUMING REQUEST: " << id.str() << ": " << int(header) << " "
-            << payload.size();
+            << payloadSize;
     switch (header) {
       case CLIENT_SERVER_CREATE_FILE: {
         string path = reader.readPrimitive<string>();
         int flags = reader.readPrimitive<int>();
         int mode = reader.readPrimitive<int>();
-        int readWriteMode = (flags & O_ACCMODE);
-        LOG(INFO) << "REQUESTING FILE: " << path << " FLAGS: " << flags << " "
-                  << readWriteMode << " " << mode;
-        optional<FileData> fileData = fileSystem->getNode(path);
-
+        int rpcErrno = createFile(path, flags, mode);
         writer.start();
-
-        bool access = true;
-        if (readWriteMode == O_RDONLY) {
-          if (!fileData) {
-            writer.writePrimitive<int>(ENOENT);
-            access = false;
-          } else if (!fileData->can_read()) {
-            writer.writePrimitive<int>(EACCES);
-            access = false;
-          }
-        } else {
-          if (!fileData) {
-            LOG(INFO) << "FILE DOES NOT EXIST YET";
-
-            // Get the parent path and make sure we can write there
-            string parentPath =
-                boost::filesystem::path(path).parent_path().string();
-            LOG(INFO) << "PARENT PATH: " << parentPath;
-            if (parentPath != string("/")) {
-              optional<FileData> parentFileData =
-                  fileSystem->getNode(parentPath);
-              if (!parentFileData || !parentFileData->can_execute()) {
-                writer.writePrimitive<int>(EACCES);
-                access = false;
-              }
-            }
-
-            if (access) {
-              LOG(INFO) << "Creating empty file";
-              fileSystem->writeFile(path, "");
-              fileSystem->chmod(path, mode_t(mode));
-            }
-          } else if (!fileData->can_write()) {
-            writer.writePrimitive<int>(EACCES);
-            access = false;
-          }
-        }
-
-        if (access) {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
+        writer.writePrimitive<int>(rpcErrno);
+        rpc->reply(id, writer.finish());
         fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(path));
 
       } break;
@@ -134,9 +90,10 @@ int Server::update() {
           }
 
           writer.writePrimitive<int>(0);
-          writer.writePrimitive<string>(compressString(fileContents));
+          writer.writePrimitive<string>(
+              compressPayload(fileContents, codecOptionsFor(rpc)));
         }
-        reply(id, writer.finish());
+        rpc->reply(id, writer.finish());
         if (readWriteMode != O_RDONLY) {
           fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(path));
         }
@@ -148,11 +105,12 @@ int Server::update() {
         if (readOnly) {
           LOG(INFO) << "RETURNED READ-ONLY FILE";
         } else {
-          string fileContents =
-              decompressString(reader.readPrimitive<string>());
-          LOG(INFO) << "WRITING FILE " << path << " " << fileContents.size();
+          ByteView compressed = reader.readView();
+          LOG(INFO) << "WRITING FILE " << path << " FROM " << compressed.size
+                    << " BYTES";
 
-          res = fileSystem->writeFile(path, fileContents);
+          res = fileSystem->writeCompressedFile(path, compressed.data,
+                                                compressed.size);
         }
 
         writer.start();
@@ -162,148 +120,118 @@ int Server::update() {
         } else {
           writer.writePrimitive<int>(0);
         }
-        reply(id, writer.finish());
+        rpc->reply(id, writer.finish());
         if (!readOnly) {
           fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(path));
         }
       } break;
       case CLIENT_SERVER_FETCH_METADATA: {
         int numPaths = reader.readPrimitive<int>();
-        writer.start();
+        vector<string> paths;
         for (int a = 0; a < numPaths; a++) {
-          string path = reader.readPrimitive<string>();
+          paths.push_back(reader.readPrimitive<string>());
+        }
+        CodecOptions codecOptions = codecOptionsFor(rpc);
+        // Clients with a metadata dictionary say which one they have
+        if (reader.sizeRemaining()) {
+          uint32_t dictionaryId = reader.readPrimitive<uint32_t>();
+          if (getCodecDictionary(dictionaryId)) {
+            codecOptions.dictionaryId = dictionaryId;
+          }
+        }
+        bool compact =
+            (rpc->getNegotiatedFeatures() & FEATURE_COMPACT_METADATA) != 0;
+        writer.start();
+        for (const auto &path : paths) {
           VLOG(1) << "Fetching Metadata for " << path;
-          auto s = fileSystem->serializeFileDataCompressed(path);
+          auto s = fileSystem->serializeFileDataCompressed(path, codecOptions,
+                                                           compact);
           writer.writePrimitive<string>(path);
           writer.writePrimitive<string>(s);
         }
-        reply(id, writer.finish());
+        rpc->reply(id, writer.finish());
       } break;
-      case CLIENT_SERVER_MKDIR: {
-        string path = reader.readPrimitive<string>();
-        mode_t mode = reader.readPrimitive<int>();
-        int res = fileSystem->mkdir(path, mode);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(path));
-      } break;
-      case CLIENT_SERVER_UNLINK: {
-        string path = reader.readPrimitive<string>();
-        LOG(INFO) << "UNLINKING: " << path << " "
-                  << fileSystem->relativeToAbsolute(path);
-        int res = fileSystem->unlink(path);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(path));
+      case CLIENT_SERVER_FETCH_DICTIONARY: {
+        // Zero until the first training finishes, the client asks again
+        auto dictionary = getCodecDictionary(metadataDictionaryId);
+        writer.writePrimitive<uint32_t>(dictionary ? metadataDictionaryId : 0);
+        writer.writePrimitive<string>(dictionary ? *dictionary : string());
+        rpc->reply(id, writer.finish());
       } break;
-      case CLIENT_SERVER_RMDIR: {
-        string path = reader.readPrimitive<string>();
-        int res = fileSystem->rmdir(path);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(path));
-      } break;
-      case CLIENT_SERVER_SYMLINK: {
-        string from = reader.readPrimitive<string>();
-        string to = reader.readPrimitive<string>();
-        int res = fileSystem->symlink(from, to);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(from));
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(to));
-      } break;
-      case CLIENT_SERVER_RENAME: {
-        string from = reader.readPrimitive<string>();
-        string to = reader.readPrimitive<string>();
-        int res = fileSystem->rename(from, to);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPathAndParentAndChildren(
-            fileSystem->relativeToAbsolute(from));
-        fileSystem->rescanPathAndParentAndChildren(
-            fileSystem->relativeToAbsolute(to));
-      } break;
-      case CLIENT_SERVER_LINK: {
-        string from = reader.readPrimitive<string>();
-        if (from[0] == '/') {
-          from = fileSystem->relativeToAbsolute(from);
+      case CLIENT_SERVER_VALIDATE_CACHE: {
+        // Sent by a client that held on to its cache while we restarted.
+        // Reply with every node that it has a different version of.
+        int numPaths = reader.readPrimitive<int>();
+        vector<FileData> changed;
+        for (int a = 0; a < numPaths; a++) {
+          string path = reader.readPrimitive<string>();
+          uint64_t fingerprint = reader.readPrimitive<uint64_t>();
+          optional<FileData> fileData = fileSystem->getNode(path);
+          if (!fileData) {
+            FileData deleted;
+            deleted.set_path(path);
+            deleted.set_deleted(true);
+            changed.push_back(deleted);
+          } else if (FileSystem::fingerprint(*fileData) != fingerprint) {
+            changed.push_back(*fileData);
+          }
         }
-        string to = reader.readPrimitive<string>();
-        int res = fileSystem->link(from, to);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
+        LOG(INFO) << changed.size() << " of " << numPaths
+                  << " cached nodes are stale";
+        writer.start();
+        writer.writePrimitive<int>(changed.size());
+        for (const auto &fileData : changed) {
+          writer.writeProto<FileData>(fileData);
         }
-        reply(id, writer.finish());
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(from));
-        fileSystem->rescanPathAndParent(fileSystem->relativeToAbsolute(to));
+        rpc->reply(id, writer.finish());
       } break;
-      case CLIENT_SERVER_CHMOD: {
-        string path = reader.readPrimitive<string>();
-        int mode = reader.readPrimitive<int>();
-        int res = fileSystem->chmod(path, mode);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPath(fileSystem->relativeToAbsolute(path));
+      case CLIENT_SERVER_MKDIR:
+      case CLIENT_SERVER_UNLINK:
+      case CLIENT_SERVER_RMDIR:
+      case CLIENT_SERVER_SYMLINK:
+      case CLIENT_SERVER_RENAME:
+      case CLIENT_SERVER_LINK:
+      case CLIENT_SERVER_CHMOD:
+      case CLIENT_SERVER_LCHOWN:
+      case CLIENT_SERVER_TRUNCATE:
+      case CLIENT_SERVER_UTIMENSAT: {
+        RescanList rescans;
+        int rpcErrno = applyMutation(header, &reader, &rescans);
+        writer.writePrimitive<int>(rpcErrno ? -1 : 0);
+        writer.writePrimitive<int>(rpcErrno);
+        rpc->reply(id, writer.finish());
+        runRescans(rescans);
       } break;
-      case CLIENT_SERVER_LCHOWN: {
-        string path = reader.readPrimitive<string>();
-        int64_t uid = reader.readPrimitive<int64_t>();
-        int64_t gid = reader.readPrimitive<int64_t>();
-        int res = fileSystem->lchown(path, uid, gid);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
+      case CLIENT_SERVER_COMPOUND: {
+        int numOps = reader.readPrimitive<int>();
+        ByteView ops = reader.readView();
+        MessageReader opReader;
+        opReader.load(ops.data, ops.size);
+        RescanList rescans;
+        vector<int> results;
+        for (int a = 0; a < numOps; a++) {
+          int rpcErrno;
+          try {
+            unsigned char opHeader = opReader.readPrimitive<unsigned char>();
+            rpcErrno = applyMutation(opHeader, &opReader, &rescans);
+          } catch (const std::runtime_error& e) {
+            LOG(ERROR) << "Malformed compound op: " << e.what();
+            rpcErrno = EINVAL;
+          }
+          results.push_back(rpcErrno);
+          if (rpcErrno) {
+            // Later ops usually depend on this one, so they don't run
+            break;
+          }
         }
-        reply(id, writer.finish());
-        fileSystem->rescanPath(fileSystem->relativeToAbsolute(path));
-      } break;
-      case CLIENT_SERVER_TRUNCATE: {
-        string path = reader.readPrimitive<string>();
-        int64_t size = reader.readPrimitive<int64_t>();
-        int res = fileSystem->truncate(path, size);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
+        VLOG(1) << "RAN " << results.size() << " OF " << numOps
+                << " COMPOUND OPS";
+        writer.writePrimitive<int>(results.size());
+        for (int rpcErrno : results) {
+          writer.writePrimitive<int>(rpcErrno);
         }
-        reply(id, writer.finish());
-        fileSystem->rescanPath(fileSystem->relativeToAbsolute(path));
+        rpc->reply(id, writer.finish());
+        runRescans(rescans);
       } break;
       case CLIENT_SERVER_STATVFS: {
         struct statvfs stbuf;
@@ -329,24 +257,7 @@ int Server::update() {
           statVfsProto.set_namemax(stbuf.f_namemax);
         }
         writer.writeProto<StatVfsData>(statVfsProto);
-        reply(id, writer.finish());
-      } break;
-      case CLIENT_SERVER_UTIMENSAT: {
-        string path = reader.readPrimitive<string>();
-        struct timespec ts[2];
-        ts[0].tv_sec = reader.readPrimitive<int64_t>();
-        ts[0].tv_nsec = reader.readPrimitive<int64_t>();
-        ts[1].tv_sec = reader.readPrimitive<int64_t>();
-        ts[1].tv_nsec = reader.readPrimitive<int64_t>();
-        int res = fileSystem->utimensat(path, ts);
-        writer.writePrimitive<int>(res);
-        if (res) {
-          writer.writePrimitive<int>(errno);
-        } else {
-          writer.writePrimitive<int>(0);
-        }
-        reply(id, writer.finish());
-        fileSystem->rescanPath(fileSystem->relativeToAbsolute(path));
+        rpc->reply(id, writer.finish());
       } break;
       case CLIENT_SERVER_LREMOVEXATTR: {
         string path = reader.readPrimitive<string>();
@@ -357,7 +268,7 @@ int Server::update() {
         } else {
           writer.writePrimitive<int>(0);
         }
-        reply(id, writer.finish());
+        rpc->reply(id, writer.finish());
         fileSystem->rescanPath(fileSystem->relativeToAbsolute(path));
       } break;
       case CLIENT_SERVER_LSETXATTR: {
@@ -372,7 +283,7 @@ int Server::update() {
         } else {
           writer.writePrimitive<int>(0);
         }
-        reply(id, writer.finish());
+        rpc->reply(id, writer.finish());
         fileSystem->rescanPath(fileSystem->relativeToAbsolute(path));
       } break;
       default:
@@ -380,19 +291,9 @@ int Server::update() {
     }
   }
 
-  while (true) {
-    RpcId id;
-    string payload;
-    {
-      lock_guard<std::recursive_mutex> lock(rpcMutex);
-      if (!rpc->hasIncomingReply()) {
-        break;
-      }
-      auto idPayload = rpc->getFirstIncomingReply();
-      id = idPayload.id;
-      payload = idPayload.payload;
-    }
-    reader.load(payload);
+  while (rpc->hasIncomingReply()) {
+    auto idPayload = rpc->getFirstIncomingReply();
+    reader.load(std::move(idPayload.payload));
     unsigned char header = reader.readPrimitive<unsigned char>();
 
     switch (header) {
@@ -403,17 +304,273 @@ int Server::update() {
         LOGFATAL << "Invalid packet header: " << int(header);
     }
   }
+}
+
+int Server::createFile(const string &path, int flags, int mode) {
+  int readWriteMode = (flags & O_ACCMODE);
+  LOG(INFO) << "REQUESTING FILE: " << path << " FLAGS: " << flags << " "
+            << readWriteMode << " " << mode;
+  optional<FileData> fileData = fileSystem->getNode(path);
+
+  if (readWriteMode == O_RDONLY) {
+    if (!fileData) {
+      return ENOENT;
+    } else if (!fileData->can_read()) {
+      return EACCES;
+    }
+  } else {
+    if (!fileData) {
+      LOG(INFO) << "FILE DOES NOT EXIST YET";
 
+      // Get the parent path and make sure we can write there
+      string parentPath = boost::filesystem::path(path).parent_path().string();
+      LOG(INFO) << "PARENT PATH: " << parentPath;
+      if (parentPath != string("/")) {
+        optional<FileData> parentFileData = fileSystem->getNode(parentPath);
+        if (!parentFileData || !parentFileData->can_execute()) {
+          return EACCES;
+        }
+      }
+
+      LOG(INFO) << "Creating empty file";
+      fileSystem->writeFile(path, "");
+      fileSystem->chmod(path, mode_t(mode));
+    } else if (!fileData->can_write()) {
+      return EACCES;
+    }
+  }
   return 0;
 }
 
+int Server::applyMutation(unsigned char header, MessageReader *reader,
+                          RescanList *rescans) {
+  // Saved right away, before logging or anything else can clobber it
+  int rpcErrno = 0;
+  switch (header) {
+    case CLIENT_SERVER_CREATE_FILE: {
+      string path = reader->readPrimitive<string>();
+      int flags = reader->readPrimitive<int>();
+      int mode = reader->readPrimitive<int>();
+      // An earlier op in the compound may have made the parent directory,
+      // and createFile needs to see it
+      runRescans(*rescans);
+      rescans->clear();
+      rpcErrno = createFile(path, flags, mode);
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, path));
+    } break;
+    case CLIENT_SERVER_MKDIR: {
+      string path = reader->readPrimitive<string>();
+      mode_t mode = reader->readPrimitive<int>();
+      if (fileSystem->mkdir(path, mode)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, path));
+    } break;
+    case CLIENT_SERVER_UNLINK: {
+      string path = reader->readPrimitive<string>();
+      LOG(INFO) << "UNLINKING: " << path << " "
+                << fileSystem->relativeToAbsolute(path);
+      if (fileSystem->unlink(path)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, path));
+    } break;
+    case CLIENT_SERVER_RMDIR: {
+      string path = reader->readPrimitive<string>();
+      if (fileSystem->rmdir(path)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, path));
+    } break;
+    case CLIENT_SERVER_SYMLINK: {
+      string from = reader->readPrimitive<string>();
+      string to = reader->readPrimitive<string>();
+      if (fileSystem->symlink(from, to)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, from));
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, to));
+    } break;
+    case CLIENT_SERVER_RENAME: {
+      string from = reader->readPrimitive<string>();
+      string to = reader->readPrimitive<string>();
+      if (fileSystem->rename(from, to)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH_PARENT_AND_CHILDREN, from));
+      rescans->push_back(make_pair(RESCAN_PATH_PARENT_AND_CHILDREN, to));
+    } break;
+    case CLIENT_SERVER_LINK: {
+      string from = reader->readPrimitive<string>();
+      if (from[0] == '/') {
+        from = fileSystem->relativeToAbsolute(from);
+      }
+      string to = reader->readPrimitive<string>();
+      if (fileSystem->link(from, to)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, from));
+      rescans->push_back(make_pair(RESCAN_PATH_AND_PARENT, to));
+    } break;
+    case CLIENT_SERVER_CHMOD: {
+      string path = reader->readPrimitive<string>();
+      int mode = reader->readPrimitive<int>();
+      if (fileSystem->chmod(path, mode)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH, path));
+    } break;
+    case CLIENT_SERVER_LCHOWN: {
+      string path = reader->readPrimitive<string>();
+      int64_t uid = reader->readPrimitive<int64_t>();
+      int64_t gid = reader->readPrimitive<int64_t>();
+      if (fileSystem->lchown(path, uid, gid)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH, path));
+    } break;
+    case CLIENT_SERVER_TRUNCATE: {
+      string path = reader->readPrimitive<string>();
+      int64_t size = reader->readPrimitive<int64_t>();
+      if (fileSystem->truncate(path, size)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH, path));
+    } break;
+    case CLIENT_SERVER_UTIMENSAT: {
+      string path = reader->readPrimitive<string>();
+      struct timespec ts[2];
+      ts[0].tv_sec = reader->readPrimitive<int64_t>();
+      ts[0].tv_nsec = reader->readPrimitive<int64_t>();
+      ts[1].tv_sec = reader->readPrimitive<int64_t>();
+      ts[1].tv_nsec = reader->readPrimitive<int64_t>();
+      if (fileSystem->utimensat(path, ts)) {
+        rpcErrno = errno;
+      }
+      rescans->push_back(make_pair(RESCAN_PATH, path));
+    } break;
+    default:
+      // Nothing after it can be read either, but the compound stops here
+      LOG(ERROR) << "Not a path mutation: " << int(header);
+      return EINVAL;
+  }
+  return rpcErrno;
+}
+
+void Server::runRescans(const RescanList &rescans) {
+  // A compound often touches the same directory over and over
+  set<pair<RescanScope, string>> done;
+  for (const auto &it : rescans) {
+    if (!done.insert(it).second) {
+      continue;
+    }
+    string absolutePath = fileSystem->relativeToAbsolute(it.second);
+    switch (it.first) {
+      case RESCAN_PATH:
+        fileSystem->rescanPath(absolutePath);
+        break;
+      case RESCAN_PATH_AND_PARENT:
+        fileSystem->rescanPathAndParent(absolutePath);
+        break;
+      case RESCAN_PATH_PARENT_AND_CHILDREN:
+        fileSystem->rescanPathAndParentAndChildren(absolutePath);
+        break;
+    }
+  }
+}
+
+void Server::refreshMetadataDictionary() {
+  if (metadataDictionaryTraining.valid()) {
+    if (metadataDictionaryTraining.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      return;
+    }
+    string dictionary;
+    try {
+      dictionary = metadataDictionaryTraining.get();
+    } catch (const std::exception &e) {
+      // Metadata still goes out, just without a dictionary until the next
+      // refresh
+      LOG(ERROR) << "Training a metadata dictionary failed: " << e.what();
+    }
+    if (!dictionary.empty()) {
+      metadataDictionaryId = addCodecDictionary(dictionary);
+      LOG(INFO) << "Trained a " << dictionary.size()
+                << " byte metadata dictionary";
+    }
+    return;
+  }
+  int64_t now = TimeHandler::currentTimeMicros();
+  if (metadataDictionaryTime &&
+      now - metadataDictionaryTime < METADATA_DICTIONARY_REFRESH_MICROS) {
+    return;
+  }
+  metadataDictionaryTime = now;
+  // Sampling walks the whole tree, so keep it off the dispatch loop
+  shared_ptr<ServerFileSystem> sampledFileSystem = fileSystem;
+  metadataDictionaryTraining =
+      std::async(std::launch::async, [sampledFileSystem]() {
+        return trainCodecDictionary(
+            sampledFileSystem->sampleDirectoryPayloads(
+                METADATA_DICTIONARY_SAMPLES),
+            METADATA_DICTIONARY_SIZE);
+      });
+}
+
 void Server::metadataUpdated(const string &path, const FileData &fileData) {
   MessageWriter writer;
   writer.start();
   writer.writePrimitive<unsigned char>(SERVER_CLIENT_METADATA_UPDATE);
   writer.writePrimitive<string>(path);
   writer.writeProto<FileData>(fileData);
-  request(writer.finish());
+  string payload = writer.finish();
+  {
+    lock_guard<std::mutex> guard(pendingUpdatesMutex);
+    for (const auto &session : router->getSessions()) {
+      auto &pending = pendingUpdates[session->getIdentity()];
+      auto it = pending.payloads.find(path);
+      if (it != pending.payloads.end()) {
+        // The client hasn't been told about the last change yet, so it only
+        // needs to hear about this one
+        it->second = payload;
+        continue;
+      }
+      pending.paths.push_back(path);
+      pending.payloads[path] = payload;
+    }
+  }
+  flushMetadataUpdates();
+}
+
+void Server::flushMetadataUpdates() {
+  lock_guard<std::mutex> guard(pendingUpdatesMutex);
+  if (pendingUpdates.empty()) {
+    return;
+  }
+  // Sessions that closed since drop out along the way
+  unordered_map<string, PendingUpdates> stillPending;
+  for (const auto &session : router->getSessions()) {
+    auto it = pendingUpdates.find(session->getIdentity());
+    if (it == pendingUpdates.end()) {
+      continue;
+    }
+    PendingUpdates &pending = it->second;
+    // Only what the client's window has room for goes out now.  The rest
+    // stays here, where a newer update to the same path replaces it,
+    // instead of queueing behind the window.
+    int64_t credit = session->getWindowCredit();
+    while (!pending.paths.empty() && credit-- > 0) {
+      auto payloadIt = pending.payloads.find(pending.paths.front());
+      // Pushes are advisory, so let the client's own calls go first
+      session->request(std::move(payloadIt->second), PRIORITY_BACKGROUND);
+      pending.payloads.erase(payloadIt);
+      pending.paths.pop_front();
+    }
+    if (!pending.paths.empty()) {
+      stillPending[it->first] = std::move(pending);
+    }
+  }
+  pendingUpdates.swap(stillPending);
 }
 
 }  // namespace codefs
\ No newline at end of file
@@ -3,10 +3,12 @@
 
 #include "Headers.hpp"
 
+#include "Codec.hpp"
 #include "MessageReader.hpp"
 #include "MessageWriter.hpp"
 #include "ServerFileSystem.hpp"
-#include "ZmqBiDirectionalRpc.hpp"
+#include "RpcTransport.hpp"
+#include "TimeHandler.hpp"
 
 namespace codefs {
 class Server : public ServerFileSystem::Handler {
@@ -16,27 +18,73 @@ class Server : public ServerFileSystem::Handler {
   virtual ~Server() {}
 
   void init();
+  void shutdown() { router->shutdown(); }
   int update();
-  inline void heartbeat() { rpc->heartbeat(); }
+  inline void waitForWork() { router->waitForIncoming(1000); }
 
   virtual void metadataUpdated(const string& path, const FileData& fileData);
 
  protected:
-  RpcId request(const string& payload) {
-    lock_guard<std::recursive_mutex> lock(rpcMutex);
-    return rpc->request(payload);
-  }
-  void reply(const RpcId& rpcId, const string& payload) {
-    lock_guard<std::recursive_mutex> lock(rpcMutex);
-    rpc->reply(rpcId, payload);
+  // Handles everything one client has sent us
+  void updateSession(const shared_ptr<RpcSession>& rpc);
+
+  // Which cached nodes a mutation may have changed
+  enum RescanScope {
+    RESCAN_PATH,
+    RESCAN_PATH_AND_PARENT,
+    RESCAN_PATH_PARENT_AND_CHILDREN
+  };
+  typedef vector<pair<RescanScope, string>> RescanList;
+
+  // Creates an empty file if it is missing and the client may, like open()
+  // with O_CREAT.  Returns 0 or the errno to give the client.
+  int createFile(const string& path, int flags, int mode);
+
+  // Reads the arguments of one path mutation and runs it.  Returns 0 or the
+  // errno it failed with, EINVAL if the header isn't a mutation.  The paths
+  // to rescan are added to rescans, which the caller runs once the reply is
+  // on its way.
+  int applyMutation(unsigned char header, MessageReader* reader,
+                    RescanList* rescans);
+  void runRescans(const RescanList& rescans);
+
+  // Pushes as many pending metadata updates as each client's window has
+  // room for
+  void flushMetadataUpdates();
+
+  // Starts training a new dictionary for metadata in the background when
+  // the current one has gone stale, and installs it once it is done
+  void refreshMetadataDictionary();
+
+  CodecOptions codecOptionsFor(const shared_ptr<RpcSession>& rpc) {
+    return codecOptionsForPeer(rpc->getNegotiatedFeatures(),
+                               rpc->getCompressionLevel());
   }
 
   string address;
-  shared_ptr<ZmqBiDirectionalRpc> rpc;
-  int port;
+  // One session per connected client, all sharing fileSystem
+  shared_ptr<RpcRouter> router;
   shared_ptr<ServerFileSystem> fileSystem;
-  int clientFd;
-  recursive_mutex rpcMutex;
+
+  // zlib only looks back 32KB, so a bigger dictionary would go unused
+  static const int64_t METADATA_DICTIONARY_SIZE = 32 * 1024;
+  static const int METADATA_DICTIONARY_SAMPLES = 1024;
+  static const int64_t METADATA_DICTIONARY_REFRESH_MICROS =
+      10 * 60 * 1000 * 1000ll;
+  uint32_t metadataDictionaryId;
+  int64_t metadataDictionaryTime;
+  future<string> metadataDictionaryTraining;
+
+  // Metadata pushes waiting for room in a client's window, by session
+  // identity.  A path that changes again before its push goes out is only
+  // pushed once, with the latest data, so a burst of changes costs memory in
+  // proportion to the paths it touched.
+  struct PendingUpdates {
+    deque<string> paths;
+    unordered_map<string, string> payloads;
+  };
+  std::mutex pendingUpdatesMutex;
+  unordered_map<string, PendingUpdates> pendingUpdates;
 };
 }  // namespace codefs
 
@@ -41,6 +41,67 @@ int ServerFileSystem::writeFile(const string& path,
   return 0;
 }
 
+int ServerFileSystem::writeCompressedFile(const string& path, const char* data,
+                                          int64_t size) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  // Inflate next to the file and only replace it once the whole payload
+  // checked out, so a corrupt one leaves the old contents alone
+  string absolutePath = relativeToAbsolute(path);
+  string tempPath = absolutePath + ".codefs-XXXXXX";
+  int fd = ::mkstemp(&tempPath[0]);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat fileStat;
+  if (::stat(absolutePath.c_str(), &fileStat) == 0) {
+    ::fchmod(fd, fileStat.st_mode & 07777);
+  } else {
+    // mkstemp makes it private, a new file gets the usual mode instead
+    ::fchmod(fd, 0644);
+  }
+  FILE* fp = ::fdopen(fd, "wb");
+  if (fp == NULL) {
+    int savedErrno = errno;
+    ::close(fd);
+    ::unlink(tempPath.c_str());
+    errno = savedErrno;
+    return -1;
+  }
+  int res = 0;
+  try {
+    decompressPayload(data, size, [fp](const char* block, int64_t blockSize) {
+      size_t bytesWritten = 0;
+      while (bytesWritten < size_t(blockSize)) {
+        size_t written = ::fwrite(block + bytesWritten, 1,
+                                  blockSize - bytesWritten, fp);
+        if (written == 0) {
+          throw std::runtime_error("Short write");
+        }
+        bytesWritten += written;
+      }
+    });
+  } catch (const std::runtime_error& e) {
+    LOG(ERROR) << "Could not write " << path << ": " << e.what();
+    res = -1;
+  }
+  if (::fclose(fp) != 0) {
+    LOG(ERROR) << "Could not write " << path << ": " << strerror(errno);
+    res = -1;
+  }
+  if (res == 0 && ::rename(tempPath.c_str(), absolutePath.c_str()) != 0) {
+    LOG(ERROR) << "Could not replace " << path << ": " << strerror(errno);
+    res = -1;
+  }
+  if (res) {
+    ::unlink(tempPath.c_str());
+  }
+  rescanPath(absolutePath);
+  if (res) {
+    errno = EIO;
+  }
+  return res;
+}
+
 const int MAX_XATTR_SIZE = 64 * 1024;
 
 void ServerFileSystem::scanRecursively(
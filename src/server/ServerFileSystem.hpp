@@ -63,6 +63,10 @@ class ServerFileSystem : public FileSystem {
 
   string readFile(const string &path);
   int writeFile(const string &path, const string &fileContents);
+  // Inflates a payload from compressPayload() a block at a time into a
+  // temporary file, which then replaces the file.  A corrupt payload fails
+  // with EIO and leaves the file as it was.
+  int writeCompressedFile(const string &path, const char *data, int64_t size);
 
   int mkdir(const string &path, mode_t mode) {
     std::lock_guard<std::recursive_mutex> lock(mutex);
@@ -100,21 +104,28 @@ class ServerFileSystem : public FileSystem {
   int chmod(const string &path, mode_t mode) {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     int res = ::chmod(relativeToAbsolute(path).c_str(), mode);
+    // The rescan stats paths that may not exist, so keep our errno
+    int savedErrno = errno;
     rescanPath(relativeToAbsolute(path));
+    errno = savedErrno;
     return res;
   }
 
   int lchown(const string &path, int64_t uid, int64_t gid) {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     int res = ::lchown(relativeToAbsolute(path).c_str(), uid, gid);
+    int savedErrno = errno;
     rescanPath(relativeToAbsolute(path));
+    errno = savedErrno;
     return res;
   }
 
   int truncate(const string &path, int64_t size) {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     int res = ::truncate(relativeToAbsolute(path).c_str(), size);
+    int savedErrno = errno;
     rescanPath(relativeToAbsolute(path));
+    errno = savedErrno;
     return res;
   }
 
@@ -122,14 +133,18 @@ class ServerFileSystem : public FileSystem {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     int res = ::utimensat(0, relativeToAbsolute(path).c_str(), ts,
                           AT_SYMLINK_NOFOLLOW);
+    int savedErrno = errno;
     rescanPath(relativeToAbsolute(path));
+    errno = savedErrno;
     return res;
   }
 
   int lremovexattr(const string &path, const string &name) {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     int res = ::lremovexattr(relativeToAbsolute(path).c_str(), name.c_str());
+    int savedErrno = errno;
     rescanPath(relativeToAbsolute(path));
+    errno = savedErrno;
     return res;
   }
 
@@ -138,7 +153,9 @@ class ServerFileSystem : public FileSystem {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     int res = ::lsetxattr(relativeToAbsolute(path).c_str(), name.c_str(),
                           value.c_str(), size, flags);
+    int savedErrno = errno;
     rescanPath(relativeToAbsolute(path));
+    errno = savedErrno;
     return res;
   }
 
@@ -0,0 +1,183 @@
+#include "Headers.hpp"
+
+#include "Codec.hpp"
+
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace codefs {
+namespace {
+CodecOptions framedOptions() {
+  return codecOptionsForPeer(FEATURE_PAYLOAD_CODECS, Z_DEFAULT_COMPRESSION);
+}
+
+// Compressible, but not so repetitive that every block is the same
+string makeText(int64_t size) {
+  string s;
+  s.reserve(size);
+  for (int64_t a = 0; s.size() < size_t(size); a++) {
+    s.append("line " + to_string(a * 7919 % 100003) + " of the file\n");
+  }
+  s.resize(size);
+  return s;
+}
+}  // namespace
+
+TEST_CASE("CodecSelection", "[CodecTest]") {
+  CodecOptions options = framedOptions();
+
+  // Too small to be worth a zlib header
+  string tiny = makeText(100);
+  string compressed = compressPayload(tiny, options);
+  REQUIRE((unsigned char)compressed[0] == CODEC_NONE);
+  REQUIRE(compressed.substr(1) == tiny);
+  REQUIRE(decompressPayload(compressed) == tiny);
+
+  // Random bytes look already compressed, so they are stored as is
+  string noise(64 * 1024, '\0');
+  uint32_t state = 12345;
+  for (auto& it : noise) {
+    state = state * 1103515245 + 12345;
+    it = char(state >> 24);
+  }
+  REQUIRE(looksIncompressible(noise.data(), noise.size()));
+  compressed = compressPayload(noise, options);
+  REQUIRE((unsigned char)compressed[0] == CODEC_NONE);
+  REQUIRE(compressed.size() == noise.size() + 1);
+  REQUIRE(decompressPayload(compressed) == noise);
+
+  // Text under a block is one zlib stream behind the codec byte
+  string text = makeText(64 * 1024);
+  REQUIRE(!looksIncompressible(text.data(), text.size()));
+  compressed = compressPayload(text, options);
+  REQUIRE((unsigned char)compressed[0] == CODEC_ZLIB);
+  REQUIRE(compressed.size() < text.size() / 2);
+  REQUIRE(decompressString(compressed.substr(1)) == text);
+  REQUIRE(decompressPayload(compressed) == text);
+
+  // Over a block it is split up
+  string big = makeText(2 * 1024 * 1024 + 1);
+  REQUIRE((unsigned char)compressPayload(big, options)[0] == CODEC_ZLIB_BLOCKS);
+}
+
+TEST_CASE("UnframedPeers", "[CodecTest]") {
+  // Peers without codecs get a bare zlib stream for everything
+  CodecOptions options = codecOptionsForPeer(0, Z_DEFAULT_COMPRESSION);
+  REQUIRE(!options.framed);
+  for (int64_t size : {int64_t(0), int64_t(100), int64_t(64 * 1024)}) {
+    string raw = makeText(size);
+    string compressed = compressPayload(raw, options);
+    REQUIRE((unsigned char)compressed[0] == 0x78);
+    REQUIRE(decompressString(compressed) == raw);
+    REQUIRE(decompressPayload(compressed) == raw);
+  }
+
+  // And a bare stream from an old peer still decodes
+  string raw = makeText(4096);
+  REQUIRE(decompressPayload(compressString(raw)) == raw);
+}
+
+TEST_CASE("BlockRoundTrip", "[CodecTest]") {
+  // A partial last block, and exactly two blocks
+  for (int64_t size : {int64_t(3500000), int64_t(2 * 1024 * 1024)}) {
+    string raw = makeText(size);
+    string compressed = compressPayload(raw, framedOptions());
+    REQUIRE((unsigned char)compressed[0] == CODEC_ZLIB_BLOCKS);
+    REQUIRE(compressed.size() < raw.size());
+    REQUIRE(decompressPayload(compressed) == raw);
+
+    string streamed;
+    int pieces = 0;
+    decompressPayload(compressed.data(), compressed.size(),
+                      [&](const char* data, int64_t dataSize) {
+                        streamed.append(data, dataSize);
+                        pieces++;
+                      });
+    REQUIRE(streamed == raw);
+    REQUIRE(pieces == int((size + 1024 * 1024 - 1) / (1024 * 1024)));
+  }
+}
+
+TEST_CASE("BlockCorruptInput", "[CodecTest]") {
+  string raw = makeText(3500000);
+  string compressed = compressPayload(raw, framedOptions());
+  REQUIRE((unsigned char)compressed[0] == CODEC_ZLIB_BLOCKS);
+
+  // Nothing at all, which no codec ever produces
+  REQUIRE_THROWS(decompressPayload(string()));
+
+  // Cut off in the header, in the size table and in the last block
+  for (size_t size : {size_t(5), size_t(15), compressed.size() - 10}) {
+    string truncated = compressed.substr(0, size);
+    REQUIRE_THROWS(decompressPayload(truncated));
+  }
+
+  // A 4KB header claiming 1GB of raw data in 1024 empty blocks must be
+  // rejected before anything is allocated for it
+  string bogus(1 + 8 + 4 + 4 * 1024, '\0');
+  bogus[0] = char(CODEC_ZLIB_BLOCKS);
+  bogus[4] = char(0x40);
+  bogus[10] = char(0x04);
+  REQUIRE_THROWS(decompressPayload(bogus));
+
+  // A flipped byte inside a block fails that block, streaming or not
+  string flipped = compressed;
+  flipped[flipped.size() / 2] ^= 0x55;
+  REQUIRE_THROWS(decompressPayload(flipped));
+  string streamed;
+  REQUIRE_THROWS(decompressPayload(
+      flipped.data(), flipped.size(),
+      [&](const char* data, int64_t size) { streamed.append(data, size); }));
+  REQUIRE(streamed.size() < raw.size());
+}
+
+TEST_CASE("DictionaryRoundTrip", "[CodecTest]") {
+  vector<string> samples;
+  for (int a = 0; a < 100; a++) {
+    samples.push_back("{\"path\": \"/home/user/project/src/module" +
+                      to_string(a) + "\", \"mode\": 16877, \"uid\": 1000}");
+  }
+  string dictionary = trainCodecDictionary(samples, 4 * 1024);
+  REQUIRE(!dictionary.empty());
+  REQUIRE(dictionary.size() <= 4 * 1024);
+  // Samples that could never fit are ignored
+  samples.push_back(string(8 * 1024, 'x'));
+  REQUIRE(trainCodecDictionary(samples, 4 * 1024).size() <= 4 * 1024);
+
+  CodecOptions options = framedOptions();
+  options.dictionaryId = addCodecDictionary(dictionary);
+  REQUIRE(getCodecDictionary(options.dictionaryId));
+  string raw = "{\"path\": \"/home/user/project/src/module42\", "
+               "\"mode\": 16877, \"uid\": 1000}";
+  string compressed = compressPayload(raw, options);
+  REQUIRE((unsigned char)compressed[0] == CODEC_ZLIB_DICTIONARY);
+  REQUIRE(compressed.size() < raw.size() / 2);
+  REQUIRE(decompressPayload(compressed) == raw);
+
+  // A dictionary we never had can't be guessed at
+  string unknown = compressed;
+  unknown[1] ^= 0x01;
+  REQUIRE_THROWS(decompressPayload(unknown));
+
+  // Nothing primed inflates past a block, however many zeroes it claims
+  string bomb(5, '\0');
+  bomb[0] = char(CODEC_ZLIB_DICTIONARY);
+  for (int a = 0; a < 4; a++) {
+    bomb[1 + a] = char((options.dictionaryId >> (8 * a)) & 0xff);
+  }
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  REQUIRE(deflateInit(&zs, Z_BEST_COMPRESSION) == Z_OK);
+  REQUIRE(deflateSetDictionary(&zs, (const Bytef*)dictionary.data(),
+                               dictionary.size()) == Z_OK);
+  string zeroes(4 * 1024 * 1024, '\0');
+  string deflated(deflateBound(&zs, zeroes.size()), '\0');
+  zs.next_in = (Bytef*)zeroes.data();
+  zs.avail_in = zeroes.size();
+  zs.next_out = (Bytef*)&deflated[0];
+  zs.avail_out = deflated.size();
+  REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+  deflated.resize(zs.total_out);
+  deflateEnd(&zs);
+  REQUIRE_THROWS(decompressPayload(bomb + deflated));
+}
+}  // namespace codefs
@@ -0,0 +1,77 @@
+#include "Headers.hpp"
+
+#include "FileSystem.hpp"
+
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace codefs {
+namespace {
+FileData makeNode(const string& path, mode_t mode) {
+  FileData fileData;
+  fileData.set_path(path);
+  fileData.mutable_stat_data()->set_mode(mode);
+  fileData.mutable_stat_data()->set_size(path.size());
+  return fileData;
+}
+}  // namespace
+
+TEST_CASE("CompactLayoutRoundTrip", "[FileSystemTest]") {
+  FileSystem source("/tmp/source");
+  FileData directory = makeNode("/src", S_IFDIR | 0755);
+  // Shared prefixes, a name that is a prefix of the next, and a child the
+  // server hasn't scanned yet
+  for (const string& name :
+       vector<string>{"FileSystem.cpp", "FileSystem.hpp", "File", "Files",
+                      "Headers.hpp", "unscanned"}) {
+    directory.add_child_node(name);
+    if (name != "unscanned") {
+      source.setNode(makeNode("/src/" + name, S_IFREG | 0644));
+    }
+  }
+  source.setNode(directory);
+
+  CodecOptions options =
+      codecOptionsForPeer(FEATURE_PAYLOAD_CODECS, Z_DEFAULT_COMPRESSION);
+  string legacy = source.serializeFileData("/src", false);
+  string compact = source.serializeFileData("/src", true);
+  REQUIRE(compact.size() < legacy.size());
+
+  FileSystem destination("/tmp/destination");
+  destination.deserializeFileDataCompressed(
+      "/src", source.serializeFileDataCompressed("/src", options, true));
+  REQUIRE(destination.allFileData.size() == source.allFileData.size());
+  for (const auto& it : source.allFileData) {
+    auto node = destination.getNode(it.first);
+    REQUIRE(node);
+    REQUIRE(node->SerializeAsString() == it.second.SerializeAsString());
+  }
+}
+
+TEST_CASE("CompactLayoutWithDictionary", "[FileSystemTest]") {
+  FileSystem source("/tmp/source");
+  for (int a = 0; a < 64; a++) {
+    string path = "/dir" + to_string(a);
+    FileData directory = makeNode(path, S_IFDIR | 0755);
+    for (int b = 0; b < 4; b++) {
+      string name = "file" + to_string(b) + ".txt";
+      directory.add_child_node(name);
+      source.setNode(makeNode(path + "/" + name, S_IFREG | 0644));
+    }
+    source.setNode(directory);
+  }
+  string dictionary =
+      trainCodecDictionary(source.sampleDirectoryPayloads(32), 32 * 1024);
+  REQUIRE(!dictionary.empty());
+  CodecOptions options =
+      codecOptionsForPeer(FEATURE_PAYLOAD_CODECS, Z_DEFAULT_COMPRESSION);
+  options.dictionaryId = addCodecDictionary(dictionary);
+
+  string payload = source.serializeFileDataCompressed("/dir7", options, true);
+  REQUIRE((unsigned char)payload[0] == CODEC_ZLIB_DICTIONARY);
+  FileSystem destination("/tmp/destination");
+  destination.deserializeFileDataCompressed("/dir7", payload);
+  REQUIRE(destination.allFileData.size() == 5);
+  REQUIRE(destination.getNode("/dir7/file3.txt")->SerializeAsString() ==
+          source.getNode("/dir7/file3.txt")->SerializeAsString());
+}
+}  // namespace codefs
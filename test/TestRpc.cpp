@@ -1,6 +1,12 @@
 #include "Headers.hpp"
 
+#include "RpcTransport.hpp"
+#include "ShmChannel.hpp"
+#include "TimeHandler.hpp"
+#include "UdpRpcRouter.hpp"
+#include "UdpSocket.hpp"
 #include "ZmqBiDirectionalRpc.hpp"
+#include "ZmqRpcRouter.hpp"
 
 #include "Catch2/single_include/catch2/catch.hpp"
 
@@ -138,4 +144,574 @@ TEST_CASE("FlakyReadWriteBarrier", "[RpcTest]") {
 
   boost::filesystem::remove_all(dirName);
 }
+
+TEST_CASE("AsyncRequest", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    ZmqBiDirectionalRpc server(address, true);
+    ZmqBiDirectionalRpc client(address, false);
+
+    vector<string> payloads = {"Hello", "World", "How", "Are", "You", "Today"};
+    vector<future<string>> replies;
+    for (const auto& payload : payloads) {
+      replies.push_back(client.requestAsync(payload));
+    }
+
+    for (int a = 0; a < 1000; a++) {
+      usleep(10 * 1000);
+      server.update();
+      client.update();
+      if (a && a % 100 == 0) {
+        server.heartbeat();
+        client.heartbeat();
+      }
+      while (server.hasIncomingRequest()) {
+        auto idPayload = server.getFirstIncomingRequest();
+        server.reply(idPayload.id, idPayload.payload + idPayload.payload);
+      }
+      bool allReady = true;
+      for (auto& reply : replies) {
+        if (reply.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready) {
+          allReady = false;
+        }
+      }
+      if (allReady) {
+        break;
+      }
+    }
+
+    for (int a = 0; a < int(payloads.size()); a++) {
+      REQUIRE(replies[a].get() == payloads[a] + payloads[a]);
+    }
+    // Replies with a waiter should not also be queued
+    REQUIRE(!client.hasIncomingReply());
+    // The hellos have gone both ways, so both ends speak the compact format
+    for (int a = 0; a < 100 && server.getWireVersion() != WIRE_VERSION_2;
+         a++) {
+      usleep(10 * 1000);
+      client.update();
+      server.update();
+    }
+    REQUIRE(client.getWireVersion() == WIRE_VERSION_2);
+    REQUIRE(server.getWireVersion() == WIRE_VERSION_2);
+
+    // A version 1 frame has no session tag, so now it could be left over
+    // from anyone and its records are dropped
+    FrameWriter stale;
+    stale.start(WIRE_VERSION_1, 0, 0);
+    stale.writeByte(REQUEST);
+    stale.writeByte(PRIORITY_INTERACTIVE);
+    stale.writeId(RpcId(0, client.getSessionId() + 1000000), 0);
+    stale.writeBytes("Stale");
+    server.receive(stale.finish());
+    REQUIRE(!server.hasIncomingRequest());
+    REQUIRE(server.getWireVersion() == WIRE_VERSION_2);
+
+    client.shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("ChunkedRequest", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    ZmqBiDirectionalRpc server(address, true);
+    ZmqBiDirectionalRpc client(address, false);
+    // Small chunks so both directions need more chunks than fit in the window
+    server.setChunkSize(4096);
+    client.setChunkSize(4096);
+
+    string payload(256 * 1024, '\0');
+    for (int a = 0; a < int(payload.size()); a++) {
+      payload[a] = char(rand() % 256);
+    }
+    future<string> reply = client.requestAsync(payload);
+
+    for (int a = 0; a < 1000; a++) {
+      usleep(10 * 1000);
+      server.update();
+      client.update();
+      while (server.hasIncomingRequest()) {
+        auto idPayload = server.getFirstIncomingRequest();
+        server.reply(idPayload.id, idPayload.payload + idPayload.payload);
+      }
+      if (reply.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+        break;
+      }
+    }
+
+    REQUIRE(reply.get() == payload + payload);
+
+    client.shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("FlowControl", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    ZmqBiDirectionalRpc server(address, true);
+    ZmqBiDirectionalRpc client(address, false);
+    server.setFlowControl(4, 1000);
+    client.setFlowControl(4, 1000);
+    // The client assumes the default window until the server tells it
+    // otherwise, so let the first heartbeat through before sending.
+    server.heartbeat();
+    for (int a = 0; a < 10; a++) {
+      usleep(10 * 1000);
+      server.update();
+      client.update();
+    }
+
+    vector<future<string>> replies;
+    for (int a = 0; a < 50; a++) {
+      replies.push_back(client.requestAsync(to_string(a)));
+    }
+
+    int numReplied = 0;
+    for (int a = 0; a < 1000 && numReplied < 50; a++) {
+      usleep(10 * 1000);
+      server.update();
+      client.update();
+      int numPending = 0;
+      while (server.hasIncomingRequest()) {
+        auto idPayload = server.getFirstIncomingRequest();
+        server.reply(idPayload.id, idPayload.payload + idPayload.payload);
+        numPending++;
+        numReplied++;
+      }
+      REQUIRE(numPending <= 4);
+    }
+
+    for (int a = 0; a < 50; a++) {
+      REQUIRE(replies[a].get() == to_string(a) + to_string(a));
+    }
+
+    client.shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("PriorityDispatch", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    ZmqBiDirectionalRpc server(address, true);
+    ZmqBiDirectionalRpc client(address, false);
+
+    client.request("Background1", PRIORITY_BACKGROUND);
+    client.request("Bulk1", PRIORITY_BULK);
+    client.request("Background2", PRIORITY_BACKGROUND);
+    client.request("Interactive1", PRIORITY_INTERACTIVE);
+    client.request("Bulk2", PRIORITY_BULK);
+    client.request("Interactive2", PRIORITY_INTERACTIVE);
+
+    for (int a = 0; a < 100; a++) {
+      usleep(10 * 1000);
+      client.update();
+      server.update();
+    }
+
+    vector<string> expected = {"Interactive1", "Interactive2", "Bulk1",
+                               "Bulk2",        "Background1",  "Background2"};
+    for (const auto& payload : expected) {
+      REQUIRE(server.hasIncomingRequest());
+      auto idPayload = server.getFirstIncomingRequest();
+      REQUIRE(idPayload.payload == payload);
+      server.reply(idPayload.id, idPayload.payload);
+    }
+    REQUIRE(!server.hasIncomingRequest());
+
+    for (int a = 0; a < 50; a++) {
+      usleep(10 * 1000);
+      client.update();
+      server.update();
+    }
+    // Latencies are kept per leading byte of the request
+    RpcStats stats = client.getStats();
+    REQUIRE(stats.requestLatency['I'].getCount() == 2);
+    REQUIRE(stats.requestLatency['B'].getCount() == 4);
+    REQUIRE(stats.outgoingRequests == 0);
+    REQUIRE(stats.queuedRequests == 0);
+
+    client.shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("OrderingKeys", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    ZmqBiDirectionalRpc server(address, true);
+    ZmqBiDirectionalRpc client(address, false);
+
+    RpcId a1 = client.request("A1", PRIORITY_INTERACTIVE, "/a");
+    RpcId a2 = client.request("A2", PRIORITY_INTERACTIVE, "/a");
+    RpcId b1 = client.request("B1", PRIORITY_INTERACTIVE, "/b");
+
+    auto pump = [&]() {
+      for (int a = 0; a < 50; a++) {
+        usleep(10 * 1000);
+        client.update();
+        server.update();
+      }
+    };
+    pump();
+
+    // A2 waits for A1, but B1 doesn't have to
+    REQUIRE(server.hasIncomingRequestWithId(a1));
+    REQUIRE(server.hasIncomingRequestWithId(b1));
+    REQUIRE(!server.hasIncomingRequestWithId(a2));
+
+    server.reply(a1, "A1");
+    pump();
+    REQUIRE(server.hasIncomingRequestWithId(a2));
+
+    client.shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("MultiClientRouter", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    ZmqRpcRouter router(address);
+    router.start();
+    ZmqBiDirectionalRpc client1(address, false);
+    ZmqBiDirectionalRpc client2(address, false);
+
+    future<string> reply1 = client1.requestAsync("One");
+    future<string> reply2 = client2.requestAsync("Two");
+
+    for (int a = 0; a < 1000; a++) {
+      usleep(10 * 1000);
+      client1.update();
+      client2.update();
+      for (const auto& session : router.getSessions()) {
+        while (session->hasIncomingRequest()) {
+          auto idPayload = session->getFirstIncomingRequest();
+          session->reply(idPayload.id, idPayload.payload + idPayload.payload);
+        }
+      }
+      if (reply1.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready &&
+          reply2.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready) {
+        break;
+      }
+    }
+
+    // Each client gets its own session and only its own reply
+    REQUIRE(router.getSessions().size() == 2);
+    REQUIRE(reply1.get() == "OneOne");
+    REQUIRE(reply2.get() == "TwoTwo");
+
+    client1.shutdown();
+    client2.shutdown();
+    router.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("ShmRouter", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("shm://") + dirName;
+
+  {
+    shared_ptr<RpcRouter> router = createRpcRouter(address);
+    router->start();
+    shared_ptr<RpcEndpoint> client1 = createRpcEndpoint(address, false);
+    shared_ptr<RpcEndpoint> client2 = createRpcEndpoint(address, false);
+
+    future<string> reply1 = client1->requestAsync("One");
+    // Big enough to wrap around the ring a few times
+    string bigPayload(3 * 1024 * 1024, 'x');
+    future<string> reply2 = client2->requestAsync(bigPayload);
+
+    for (int a = 0; a < 1000; a++) {
+      usleep(10 * 1000);
+      client1->update();
+      client2->update();
+      for (const auto& session : router->getSessions()) {
+        while (session->hasIncomingRequest()) {
+          auto idPayload = session->getFirstIncomingRequest();
+          session->reply(idPayload.id, idPayload.payload + idPayload.payload);
+        }
+      }
+      if (reply1.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready &&
+          reply2.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready) {
+        break;
+      }
+    }
+
+    REQUIRE(router->getSessions().size() == 2);
+    REQUIRE(reply1.get() == "OneOne");
+    REQUIRE(reply2.get() == bigPayload + bigPayload);
+
+    client1->shutdown();
+    client2->shutdown();
+    router->shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+namespace {
+// Lets a test write whatever it likes into the ring, like a broken peer
+class RawShmChannel : public ShmChannel {
+ public:
+  RawShmChannel(const string& directory, const string& id)
+      : ShmChannel(directory, id, true) {}
+
+  void writeRaw(const string& bytes) {
+    uint64_t tail = outgoing->tail;
+    memcpy(outgoingData + tail % capacity, bytes.data(), bytes.size());
+    outgoing->tail = tail + bytes.size();
+  }
+};
+}  // namespace
+
+TEST_CASE("ShmChannelCorruptFrame", "[RpcTest]") {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+
+  {
+    RawShmChannel client(dirName, "client-1");
+    ShmChannel server(dirName, "client-1", false);
+    REQUIRE(server.isOpen());
+
+    REQUIRE(client.write("Hello"));
+    string frame;
+    REQUIRE(server.read(&frame));
+    REQUIRE(frame == "Hello");
+
+    // A 4GB length with a few bytes behind it is dropped without reading
+    // or allocating anything
+    client.writeRaw(string("\xff\xff\xff\xff") + "junk");
+    REQUIRE(!server.read(&frame));
+    REQUIRE(!server.isOpen());
+    REQUIRE(frame == "Hello");
+    REQUIRE(!server.read(&frame));
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("UdpRouter", "[RpcTest]") {
+  // Let the kernel pick a free port
+  shared_ptr<UdpRpcRouter> router(new UdpRpcRouter("udp://127.0.0.1:0"));
+  string address = "udp://127.0.0.1:" + to_string(router->getPort());
+  router->start();
+  shared_ptr<RpcEndpoint> client = createRpcEndpoint(address, false);
+  client->setFlaky(true);
+
+  // Stray datagrams for the client's session, one cut off after a request
+  // header and one with a header that doesn't exist, must not take down
+  // the router.  Nor do they open a session, only a hello does.
+  int strayFd = openUdpSocket(address, false);
+  char header[UDP_SESSION_HEADER_SIZE];
+  writeUdpSessionHeader(client->getSessionId(), header);
+  for (const string& garbage : {string("\x02"), string("\x63\x01")}) {
+    string datagram = string(header, UDP_SESSION_HEADER_SIZE) + garbage;
+    ::send(strayFd, datagram.data(), datagram.size(), 0);
+  }
+  ::close(strayFd);
+  usleep(100 * 1000);
+  REQUIRE(router->getSessions().empty());
+
+  future<string> smallReply = client->requestAsync("One");
+  // Split over many datagrams, some of which are lost
+  string bigPayload(100 * 1024, 'x');
+  future<string> bigReply = client->requestAsync(bigPayload);
+
+  for (int a = 0; a < 3000; a++) {
+    usleep(10 * 1000);
+    client->update();
+    for (const auto& session : router->getSessions()) {
+      while (session->hasIncomingRequest()) {
+        auto idPayload = session->getFirstIncomingRequest();
+        session->reply(idPayload.id, idPayload.payload + idPayload.payload);
+      }
+    }
+    if (smallReply.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready &&
+        bigReply.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready) {
+      break;
+    }
+  }
+
+  REQUIRE(router->getSessions().size() == 1);
+  REQUIRE(smallReply.get() == "OneOne");
+  REQUIRE(bigReply.get() == bigPayload + bigPayload);
+
+  client->shutdown();
+  router->shutdown();
+}
+
+// Kills the server while the client waits on a reply to payload.  A payload
+// bigger than a chunk is cut off partway, with the server never getting a
+// chance to acknowledge any of it.
+void restartServerDuringRequest(const string& payload) {
+  char dirSchema[] = "/tmp/TestRpc.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string address = string("ipc://") + dirName + "/ipc";
+  bool chunked = payload.size() > 64 * 1024;
+
+  {
+    ZmqBiDirectionalRpc client(address, false);
+    future<string> reply;
+    {
+      ZmqBiDirectionalRpc server(address, true);
+      for (int a = 0; a < 50; a++) {
+        usleep(10 * 1000);
+        if (a % 10 == 0) {
+          client.heartbeat();
+          server.heartbeat();
+        }
+        client.update();
+        server.update();
+      }
+      // The server gets this but dies before replying
+      reply = client.requestAsync(payload);
+      for (int a = 0; a < 50; a++) {
+        usleep(10 * 1000);
+        client.update();
+        if (!chunked) {
+          server.update();
+        }
+      }
+      REQUIRE(server.hasIncomingRequest() == !chunked);
+      server.shutdown();
+    }
+    REQUIRE(!client.consumePeerReset());
+
+    ZmqBiDirectionalRpc server(address, true);
+    bool peerReset = false;
+    for (int a = 0; a < 1000; a++) {
+      usleep(10 * 1000);
+      if (a % 10 == 0) {
+        client.heartbeat();
+        server.heartbeat();
+      }
+      client.update();
+      server.update();
+      while (server.hasIncomingRequest()) {
+        auto idPayload = server.getFirstIncomingRequest();
+        server.reply(idPayload.id, idPayload.payload + idPayload.payload);
+      }
+      peerReset |= client.consumePeerReset();
+      if (peerReset && reply.wait_for(std::chrono::seconds(0)) ==
+                           std::future_status::ready) {
+        break;
+      }
+    }
+
+    // The new server gets the request again and the client finds out that
+    // anything it cached may be stale
+    REQUIRE(peerReset);
+    REQUIRE(reply.get() == payload + payload);
+
+    client.shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("ServerRestart", "[RpcTest]") { restartServerDuringRequest("Lost"); }
+
+TEST_CASE("ServerRestartMidChunks", "[RpcTest]") {
+  string payload;
+  for (int a = 0; a < 64 * 64 * 1024; a++) {
+    payload.push_back('a' + (a % 26));
+  }
+  restartServerDuringRequest(payload);
+}
+
+// Drives send tuning with made up round trips on a clock of our own, so the
+// outcome doesn't depend on how busy the machine running the test is
+class SendTuningRpc : public BiDirectionalRpc {
+ public:
+  void sampleRtt(int64_t rtt) {
+    lock_guard<recursive_mutex> guard(mutex);
+    updateRtt(rtt);
+  }
+  void tune(int64_t now) {
+    lock_guard<recursive_mutex> guard(mutex);
+    tuneSending(now);
+  }
+
+ protected:
+  virtual void send(string message, RpcPriority priority) {}
+};
+
+TEST_CASE("SendTuning", "[RpcTest]") {
+  SendTuningRpc rpc;
+  int initialLevel = rpc.getCompressionLevel();
+  int64_t initialWindow = rpc.getStats().flushWindow;
+  int64_t now = TimeHandler::currentTimeMicros();
+
+  // Round trips that never grow mean nothing is queueing, so flush sooner
+  // and stop spending cpu on compression
+  for (int a = 0; a < 20; a++) {
+    for (int b = 0; b < 10; b++) {
+      rpc.sampleRtt(200);
+    }
+    now += 100 * 1000;
+    rpc.tune(now);
+  }
+  RpcStats stats = rpc.getStats();
+  REQUIRE(stats.queueDelay == 0);
+  REQUIRE(stats.flushWindow < initialWindow);
+  REQUIRE(stats.compressionLevel < initialLevel);
+  REQUIRE(stats.compressionLevel >= Z_BEST_SPEED);
+
+  // Once queues build, batch and compress harder again
+  for (int a = 0; a < 20; a++) {
+    for (int b = 0; b < 10; b++) {
+      rpc.sampleRtt(200 + 50 * 1000);
+    }
+    now += 100 * 1000;
+    rpc.tune(now);
+  }
+  stats = rpc.getStats();
+  REQUIRE(stats.queueDelay == 50 * 1000);
+  REQUIRE(stats.flushWindow > initialWindow);
+  REQUIRE(stats.compressionLevel > initialLevel);
+  REQUIRE(stats.compressionLevel <= Z_BEST_COMPRESSION);
+}
 }  // namespace codefs
@@ -0,0 +1,168 @@
+#include "Headers.hpp"
+
+#include "Codec.hpp"
+#include "CompoundRequest.hpp"
+#include "RpcTransport.hpp"
+#include "Server.hpp"
+#include "ServerFileSystem.hpp"
+
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace codefs {
+namespace {
+// Pumps the server until the client has the reply
+string serverRpc(Server* server, RpcEndpoint* client, string payload) {
+  MessageWriter writer;
+  future<string> reply = client->requestAsync(std::move(payload));
+  for (int a = 0; a < 1000; a++) {
+    usleep(10 * 1000);
+    client->update();
+    server->update();
+    // Metadata pushes for the paths we touched
+    while (client->hasIncomingRequest()) {
+      auto idPayload = client->getFirstIncomingRequest();
+      writer.start();
+      writer.writePrimitive<unsigned char>(SERVER_CLIENT_METADATA_UPDATE);
+      client->reply(idPayload.id, writer.finish());
+    }
+    if (reply.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+      break;
+    }
+  }
+  return reply.get();
+}
+}  // namespace
+
+TEST_CASE("CompoundRoundTrip", "[ServerTest]") {
+  char dirSchema[] = "/tmp/TestServer.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+  string rootPath = dirName + "/root";
+  boost::filesystem::create_directory(rootPath);
+  string address = string("ipc://") + dirName + "/ipc";
+
+  {
+    shared_ptr<ServerFileSystem> fileSystem(
+        new ServerFileSystem(rootPath, set<boost::filesystem::path>()));
+    fileSystem->init();
+    Server server(address, fileSystem);
+    fileSystem->setHandler(&server);
+    server.init();
+    shared_ptr<RpcEndpoint> client = createRpcEndpoint(address, false);
+
+    CompoundRequest compound;
+    compound.mkdir("/dir", 0755);
+    compound.create("/dir/file", O_WRONLY | O_CREAT, 0644);
+    compound.truncate("/dir/file", 100);
+    compound.chmod("/dir/file", 0600);
+    compound.rename("/dir/file", "/dir/renamed");
+    compound.rmdir("/missing");
+    compound.unlink("/dir/renamed");
+    REQUIRE(compound.size() == 7);
+    string payload = compound.finish();
+    REQUIRE(compound.size() == 0);
+
+    // Everything up to the failed rmdir ran, and the unlink after it didn't
+    vector<int> results = CompoundRequest::readResults(
+        serverRpc(&server, client.get(), std::move(payload)));
+    REQUIRE(results == vector<int>({0, 0, 0, 0, 0, ENOENT}));
+
+    struct stat fileStat;
+    REQUIRE(::stat((rootPath + "/dir/file").c_str(), &fileStat) == -1);
+    REQUIRE(::stat((rootPath + "/dir/renamed").c_str(), &fileStat) == 0);
+    REQUIRE(fileStat.st_size == 100);
+    REQUIRE((fileStat.st_mode & 0777) == 0600);
+    // The rescans after the reply picked up the new nodes
+    REQUIRE(bool(fileSystem->getNode("/dir/renamed")));
+    REQUIRE(!bool(fileSystem->getNode("/dir/file")));
+
+    // A compound can be reused once it has been sent
+    compound.create("/dir/renamed", O_WRONLY | O_CREAT, 0644);
+    compound.unlink("/dir/renamed");
+    compound.rmdir("/dir");
+    results = CompoundRequest::readResults(
+        serverRpc(&server, client.get(), compound.finish()));
+    REQUIRE(results == vector<int>({0, 0, 0}));
+    REQUIRE(!boost::filesystem::exists(rootPath + "/dir"));
+
+    // Dropped ops are never sent
+    compound.mkdir("/kept", 0755);
+    compound.mkdir("/dropped", 0755);
+    compound.rmdir("/dropped");
+    compound.dropOpsFrom(1);
+    REQUIRE(compound.size() == 1);
+    results = CompoundRequest::readResults(
+        serverRpc(&server, client.get(), compound.finish()));
+    REQUIRE(results == vector<int>({0}));
+    REQUIRE(boost::filesystem::exists(rootPath + "/kept"));
+    REQUIRE(!boost::filesystem::exists(rootPath + "/dropped"));
+
+    // Anything that isn't a mutation stops the compound with EINVAL
+    MessageWriter ops;
+    ops.start();
+    ops.writePrimitive<unsigned char>(CLIENT_SERVER_STATVFS);
+    ops.writePrimitive<unsigned char>(CLIENT_SERVER_MKDIR);
+    ops.writePrimitive<string>("/never");
+    ops.writePrimitive<int>(0755);
+    MessageWriter bogus;
+    bogus.start();
+    bogus.writePrimitive<unsigned char>(CLIENT_SERVER_COMPOUND);
+    bogus.writePrimitive<int>(2);
+    bogus.writePrimitive<string>(ops.finish());
+    results = CompoundRequest::readResults(
+        serverRpc(&server, client.get(), bogus.finish()));
+    REQUIRE(results == vector<int>({EINVAL}));
+    REQUIRE(!boost::filesystem::exists(rootPath + "/never"));
+
+    client->shutdown();
+    server.shutdown();
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+
+TEST_CASE("CorruptUploadKeepsFile", "[ServerTest]") {
+  char dirSchema[] = "/tmp/TestServer.XXXXXX";
+  string dirName = mkdtemp(dirSchema);
+
+  {
+    ServerFileSystem fileSystem(dirName, set<boost::filesystem::path>());
+    fileSystem.init();
+    fileSystem.writeFile("/file", "original");
+    REQUIRE(fileSystem.chmod("/file", 0600) == 0);
+
+    CodecOptions options = codecOptionsForPeer(FEATURE_PAYLOAD_CODECS,
+                                               Z_DEFAULT_COMPRESSION);
+    string raw;
+    for (int a = 0; raw.size() < 3 * 1024 * 1024; a++) {
+      raw.append("line " + to_string(a) + " of the upload\n");
+    }
+    string compressed = compressPayload(raw, options);
+
+    // Fails part way through, after the first blocks were already written
+    string corrupt = compressed;
+    corrupt[corrupt.size() - 100] ^= 0x55;
+    errno = 0;
+    REQUIRE(fileSystem.writeCompressedFile("/file", corrupt.data(),
+                                           corrupt.size()) == -1);
+    REQUIRE(errno == EIO);
+    REQUIRE(fileSystem.readFile("/file") == "original");
+
+    REQUIRE(fileSystem.writeCompressedFile("/file", compressed.data(),
+                                           compressed.size()) == 0);
+    REQUIRE(fileSystem.readFile("/file") == raw);
+    struct stat fileStat;
+    REQUIRE(::stat((dirName + "/file").c_str(), &fileStat) == 0);
+    REQUIRE((fileStat.st_mode & 0777) == 0600);
+
+    // No temporary files are left behind either way
+    int numFiles = 0;
+    for (boost::filesystem::directory_iterator it(dirName), end; it != end;
+         ++it) {
+      numFiles++;
+    }
+    REQUIRE(numFiles == 1);
+  }
+
+  boost::filesystem::remove_all(dirName);
+}
+}  // namespace codefs